@@ -1,120 +1,584 @@
+#include <sys/mman.h>
+#include <sys/select.h>
+#include <sys/stat.h>
+
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "8-2/misc.h"
+
 enum {
-	/* How many strings are in struct strtable by default. */
-	STRTABLEBUFNMEMB = 10240,
+	/* How many buckets are in struct strtable by default, a power of 2. */
+	STRTABLEBUFNMEMB = 1024,
 	/* It is assumed that a word will never be larger than MAXWORDLEN. */
 	MAXWORDLEN = 100,
 	/* Optimal factor for ASCII string hash function. */
 	OPTMULT = 37,
-	/* Number of word prefixes in Markov chain */
+	/* Default number of word prefixes in Markov chain */
 	NPREF = 2,
-	/* How many are in struct mkrvtable by default. */
-	MRKVTABLEBUFNMEMB = 10240
+	/* Largest number of word prefixes in Markov chain */
+	MAXNPREF = 8,
+	/* How many buckets are in struct mkrvtable by default, a power of 2. */
+	MRKVTABLEBUFNMEMB = 1024,
+	/* Tables double their buckets when they have more members than
+	 * MAXLOAD times their buckets. */
+	MAXLOAD = 1,
+	/* Chain lengths from 0 to CHAINHIST - 1 are counted separately by
+	 * printchains, longer chains are all counted in the last slot. */
+	CHAINHIST = 8,
+	/* Version of the model file format, see struct mrkvhdr. */
+	MODELVERSION = 1,
+	/* Number of states in each slab of struct mrkvtable. */
+	SLABNMEMB = 4096,
+	/* Size of the buffers of struct outbuf. */
+	OUTBUFSIZE = 1 << 20,
+	/* Number of requests batch reads before generating them. */
+	BATCHNREQ = 4096
 };
 
 /* strt_hash: an unsigned type with a size <= size_t */
 typedef size_t strt_hash;
 /* mrkv_hash: an unsigned type with a size <= size_t */
-typedef size_t mrkv_hash;
+typedef uint32_t mrkv_hash;
+
+/* A growable array of string ids. */
+struct wordvec {
+	uint32_t	*w;
+	/* Number of members in w. */
+	size_t		n;
+	/* Number of members that fit in w. */
+	size_t		max;
+};
 
+/* Every string gets the next id when it's added to a table, ids are what the
+ * rest of the program uses to refer to strings. */
 struct strtable {
 	/* Number of members in tab. */
 	size_t		nmemb;
-	/* Number of members that fit in tab's buffer. */
+	/* Number of buckets in tab, a power of 2. */
 	size_t		bufnmemb;
 	struct strlist	**tab;
+	/* String of each id, nmemb of them. */
+	const char	**strs;
+	/* Number of members that fit in strs. */
+	size_t		maxstrs;
+	/* Ids of removed strings, given to new strings before new ids are. */
+	struct wordvec	freeids;
 };
 
 struct strlist {
 	/* Always an unique pointer which can be passed to free(), thus equal
 	 * strings already in the list are always behind equal pointers. */
 	const char	*str;
+	/* Id of str in its table, NOID while a merge moves str. */
+	uint32_t	id;
+	/* strt_hashstr(str), kept so that growing the table is cheap. */
+	strt_hash	hash;
 	struct strlist	*next;
 };
 
+#define NOID UINT32_MAX
+#define NOSTATE UINT32_MAX
+
+/* A range of free state indices in the slabs of a struct mrkvtable, see
+ * mrkv_statenew. Every thread adding states to a table needs its own. */
+struct slabcursor {
+	uint32_t		next;
+	uint32_t		end;
+};
+
+/* States are kept in slabs of SLABNMEMB states each, which never move, and are
+ * referred to by their index, see mrkv_state. */
 struct mrkvtable {
 	/* Number of members in tab. */
 	size_t 			nmemb;
-	/* Number of members that fit in tab's buffer. */
+	/* Number of buckets in tab, a power of 2. */
 	size_t 			bufnmemb;
 	/* Number of word prefixes in Markov chain */
 	size_t			npref;
-	struct mrkvstate	**tab;
+	/* Index of the first state in each bucket, or NOSTATE. */
+	uint32_t		*tab;
+	char			**slabs;
+	/* Number of members in slabs, and that fit in it. */
+	size_t			nslab;
+	size_t			maxslab;
+	/* Size of a state with its prefix. */
+	size_t			stride;
+	/* Where mrkv_lookup takes new states from. */
+	struct slabcursor	cur;
+	/* Freed states, linked through their next, or NOSTATE. */
+	uint32_t		freelist;
+	/* Held while adding a slab. */
+	pthread_mutex_t		lock;
+};
+
+/* While a state is being trained, count is how many times word followed the
+ * state's prefix, and the same word may show up more than once.
+ * Once the state is frozen, every word shows up once and count is cumulative:
+ * the sum of its own count and of the counts of the suffixes before it, so the
+ * suffix for a random number r < total is the first one with r < count.
+ */
+struct mrkvsuffix {
+	uint32_t		word;
+	uint32_t		count;
 };
 
 struct mrkvstate {
-	const char		*pref[NPREF];
+	/* Distinct suffixes of pref, see struct mrkvsuffix. Points to onesuf
+	 * while there's only room for one, which saves most states a malloc. */
 	struct mrkvsuffix	*suf;
-	struct mrkvstate	*next;
+	struct mrkvsuffix	onesuf;
+	/* Number of members in suf. */
+	uint32_t		nsuf;
+	/* Number of members that fit in suf's buffer. */
+	uint32_t		maxsuf;
+	/* Sum of the counts of all suffixes. */
+	uint32_t		total;
+	/* mrkv_hashstate(pref), kept so that growing the table is cheap. */
+	mrkv_hash		hash;
+	/* Index of the next state in the bucket, or NOSTATE. */
+	uint32_t		next;
+	/* Is suf sorted, deduplicated and cumulative? */
+	uint8_t			frozen;
+	/* Was the state trained since stream_evict last passed it? */
+	uint8_t			used;
+	/* The table's npref string ids. */
+	uint32_t		pref[];
 };
 
-struct mrkvsuffix {
-	const char 		*word;
-	struct mrkvsuffix 	*next;
+/* What a tokenizing thread works on, see do_work. */
+struct trainer {
+	struct strtable		*strtab;
+	/* Words read, as ids in strtab. */
+	struct wordvec		words;
+	/* Files to read. */
+	const char		**files;
+	/* Number of members in files. */
+	size_t			nfiles;
+	/* Return value of do_work, and errno if it failed. */
+	int			ret;
+	int			error;
+};
+
+/* What a state building thread works on, see body_build. */
+struct builder {
+	struct mrkvtable	*mrkvtab;
+	/* The whole tokenized input. */
+	const uint32_t		*corpus;
+	/* The builder adds the words of corpus from lo to hi, each to the
+	 * state of the npref words before it. */
+	size_t			lo;
+	size_t			hi;
+	/* Return value of body_build, and errno if it failed. */
+	int			ret;
+	int			error;
+};
+
+/* What a merging thread works on, see mergestrings and mergestates.
+ * Strings are merged from trainers, states from builders.
+ */
+struct merger {
+	struct strtable		*strtab;
+	struct mrkvtable	*mrkvtab;
+	struct trainer		*tr;
+	struct builder		*bl;
+	/* Number of members in tr or bl. */
+	size_t			nsrc;
+	/* Where mergestrings puts the string each of tr's ids became. */
+	struct strlist		***remap;
+	/* Equal hashes modulo nres are in the same bucket modulo nres of every
+	 * table, a power of 2. The thread merges the buckets from first modulo
+	 * nres, skipping step at a time. */
+	size_t			nres;
+	size_t			first;
+	size_t			step;
+	/* Number of members added to the table. */
+	size_t			nmemb;
+	/* Where mergestates takes the table's new states from. */
+	struct slabcursor	cur;
+	/* Where in the corpus mergewords puts the words of tr. */
+	uint32_t		*corpus;
+	/* Return value of the thread, and errno if it failed. */
+	int			ret;
+	int			error;
+};
+
+/* Header of a model file, followed by the sections in struct mrkvmodel in the
+ * order they're declared, each aligned to MODELALIGN.
+ * Models hold no pointers, strings and states are referred to by their index
+ * in the stroff and state sections.
+ * The file is in the byte order of the machine that wrote it.
+ */
+struct mrkvhdr {
+	/* "MRKV" */
+	char		magic[4];
+	/* MODELVERSION */
+	uint32_t	version;
+	/* MODELBYTEORDER, as written by the machine the model was made on. */
+	uint32_t	byteorder;
+	/* Number of word prefixes in Markov chain */
+	uint32_t	npref;
+	/* Number of strings. */
+	uint32_t	nstr;
+	/* Size in bytes of all strings, including their terminators. */
+	uint32_t	strbytes;
+	/* Number of states. */
+	uint32_t	nstate;
+	/* Number of suffixes of all states. */
+	uint32_t	nsuf;
+	/* Number of buckets, a power of 2. */
+	uint32_t	nbucket;
+	uint32_t	pad;
+};
+
+#define MODELMAGIC	"MRKV"
+#define MODELBYTEORDER	0x01020304
+#define MODELALIGN	8
+
+/* A frozen Markov chain, either built by model_compile or mapped from a model
+ * file by model_map.
+ * All the pointers point inside of base.
+ */
+struct mrkvmodel {
+	void			*base;
+	/* Size of base. */
+	size_t			len;
+	/* Was base mmap()ed? */
+	int			mapped;
+	const struct mrkvhdr	*hdr;
+	/* Offset of each string in str, nstr of them. */
+	const uint32_t		*stroff;
+	/* Open addressing hash table of states, holds a state's index + 1, or
+	 * 0 for an empty bucket. */
+	const uint32_t		*bucket;
+	/* Each state is npref string indices, the index of its first suffix in
+	 * sufword and sufcum, and its number of suffixes. */
+	const uint32_t		*state;
+	/* String index of each suffix. */
+	const uint32_t		*sufword;
+	/* Cumulative count of each suffix, see struct mrkvsuffix. */
+	const uint32_t		*sufcum;
+	/* All strings with their terminators. */
+	const char		*str;
+	/* Open addressing hash table of strings built by model_strindex, holds
+	 * a string's index + 1, or 0 for an empty bucket. Not part of the file,
+	 * NULL until model_strindex. */
+	uint32_t		*strbucket;
+	/* Number of buckets in strbucket, a power of 2. */
+	size_t			nstrbucket;
+};
+
+/* A random number generator, see rng_init. */
+struct rng {
+	/* Returns the next 32 random bits. */
+	uint32_t	(*next)(struct rng *);
+	const char	*name;
+	/* State of xoshiro256**, unused by arc4random. */
+	uint64_t	s[4];
+};
+
+/* The tables stream trains, and what it needs to keep them under maxbytes. */
+struct live {
+	struct strtable		*strtab;
+	struct mrkvtable	*mrkvtab;
+	/* The last npref words read, once nword reaches npref. */
+	uint32_t		pref[MAXNPREF];
+	size_t			nword;
+	/* Approximate size of the strings, states and suffixes. */
+	size_t			bytes;
+	size_t			maxbytes;
+	/* Bucket of mrkvtab that stream_evict looks at next. */
+	size_t			hand;
+};
+
+/* A text to generate, read by batch. */
+struct request {
+	/* Number of words in the text. */
+	long		count;
+	/* Model string indices of the words the text starts with. */
+	struct wordvec	words;
+	/* Are all the words in the model, with a state for the last npref? */
+	int		known;
+	/* Seed of the text's random number generator. */
+	long long	seed;
+	/* Where the generating thread put the text in its buffer. */
+	size_t		off;
+	size_t		len;
+};
+
+/* What a batch generating thread works on, see body_batch. */
+struct batcher {
+	const struct mrkvmodel	*model;
+	struct request		*req;
+	/* Number of members in req. The thread generates the requests from
+	 * first, skipping step at a time. */
+	size_t			nreq;
+	size_t			first;
+	size_t			step;
+	/* The texts of the thread's requests, fd is -1. */
+	struct outbuf		ob;
+	struct rng		rng;
+	/* Return value of body_batch, and errno if it failed. */
+	int			ret;
+	int			error;
 };
 
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define ALIGN(n, a) (((n) + (a) - 1) / (a) * (a))
 
 static int cook_args(size_t, char *[]);
-static int do_work(struct mrkvtable *, struct strtable *, const char **, size_t,
+static int tokenize(struct strtable **, struct wordvec *, size_t,
     const char *[]);
-static int body_work(FILE *, struct mrkvtable *, struct strtable *,
-    const char **);
-static int generate(struct mrkvtable *, struct strtable *, const char **);
-static void mrkv_prefixrand(const struct mrkvtable *, const char **);
-static const char *mrkv_sufrand(const struct mrkvstate *);
+static int tokenize_parallel(struct strtable *, struct wordvec *,
+    struct trainer *, size_t, size_t, const char *[]);
+static void *do_work_thread(void *);
+static int do_work(struct trainer *);
+static int body_work(FILE *, struct trainer *);
+static int build(struct mrkvtable **, const struct wordvec *, size_t);
+static int build_parallel(struct mrkvtable *, struct builder *, size_t);
+static void *body_build_thread(void *);
+static int body_build(struct builder *);
+static int runmergers(struct merger *, size_t, void *(*)(void *));
+static void *mergestrings(void *);
+static void *mergewords(void *);
+static void *mergestates(void *);
+static int mergestate(struct mrkvtable *, struct slabcursor *,
+    struct mrkvstate *, size_t *);
+static int emit(struct mrkvmodel *, struct rng *);
+static int generate(const struct mrkvmodel *, struct rng *, struct outbuf *,
+    const struct wordvec *, long, long *);
+static int bench(const struct mrkvmodel *, struct rng *);
+static int batch(struct mrkvmodel *);
+static int readrequest(const struct mrkvmodel *, struct request *, char **,
+    size_t *);
+static void *body_batch_thread(void *);
+static int body_batch(struct batcher *);
+static int stream(struct rng *);
+static void stream_onusr1(int);
+static int stream_addword(struct live *, const char *);
+static int stream_evict(struct live *);
+static int stream_collect(struct live *);
+static void stream_freeze(struct live *, struct mrkvstate *);
+static void stream_halve(struct live *, struct mrkvstate *);
+static int stream_emit(struct live *, struct rng *);
+static int stream_generate(struct live *, struct rng *, struct outbuf *, long);
+static void stream_start(const struct live *, struct rng *, uint32_t[]);
+static size_t stream_strbytes(const char *);
+static size_t stream_statebytes(const struct live *, const struct mrkvstate *);
+static void rng_init(struct rng *, long long, int);
+static uint32_t rng_uniform(struct rng *, uint32_t);
+static uint32_t rng_xoshiro(struct rng *);
+static uint32_t rng_arc4random(struct rng *);
+static uint64_t splitmix64(uint64_t *);
 static const char *readword(FILE *);
 static int skipspace(FILE *);
 
 static struct strlist *strt_lookup(struct strtable *, const char *, int);
-static int strt_addstr(struct strtable *, const char **);
-static struct strtable *strt_new(struct strtable *);
+static int strt_addstr(struct strtable *, const char **, uint32_t *);
+static struct strtable *strt_new(struct strtable *, size_t);
+static int strt_remove(struct strtable *, uint32_t);
+static int strt_resize(struct strtable *, size_t);
+static int strt_growstrs(struct strtable *, size_t);
+static void strt_stats(const struct strtable *);
 static void strt_free(struct strtable *);
 static struct strlist *strl_new(struct strlist *, const char *);
 static void strl_free(struct strlist *);
-static strt_hash strt_hashstr(const struct strtable *, const char *);
+static strt_hash strt_hashstr(const char *);
 
-static struct mrkvtable *mrkv_tablenew(void);
+static int wordvec_add(struct wordvec *, uint32_t);
+
+static struct mrkvtable *mrkv_tablenew(size_t, size_t);
+static int mrkv_resize(struct mrkvtable *, size_t);
+static void mrkv_stats(const struct mrkvtable *);
 static void mrkv_tablefree(struct mrkvtable *);
-static struct mrkvsuffix *mrkv_suffixnew(const char *);
-static int mrkv_sufadd(struct mrkvstate *, const char *);
-static void mrkv_suffixfree(struct mrkvsuffix *);
-static struct mrkvstate *mrkv_statenew(const char *[]);
-static void mrkv_statefree(struct mrkvstate *);
-static mrkv_hash mrkv_hashstate(const struct mrkvtable *, const char *[]);
-static struct mrkvstate *mrkv_lookup(struct mrkvtable *, const char *[], int);
-static int mrkv_prefcmp(const struct mrkvtable *, const char *[],
-    const char *[]);
+static void mrkv_tablefreeze(struct mrkvtable *);
+static int mrkv_sufadd(struct mrkvstate *, uint32_t, uint32_t);
+static int mrkv_sufcmp(const void *, const void *);
+static void mrkv_statefreeze(struct mrkvstate *);
+static void mrkv_statethaw(struct mrkvstate *);
+static uint32_t mrkv_statenew(struct mrkvtable *, struct slabcursor *,
+    const uint32_t *);
+static void mrkv_statefree(struct mrkvtable *, uint32_t);
+static void mrkv_suffree(struct mrkvstate *);
+static struct mrkvstate *mrkv_state(const struct mrkvtable *, uint32_t);
+static int mrkv_slabnew(struct mrkvtable *, struct slabcursor *);
+static int mrkv_reserve(struct mrkvtable *, size_t);
+static mrkv_hash mrkv_hashstate(const struct mrkvtable *, const uint32_t *);
+static struct mrkvstate *mrkv_lookup(struct mrkvtable *, const uint32_t *,
+    int);
+static int mrkv_prefcmp(const struct mrkvtable *, const uint32_t *,
+    const uint32_t *);
+static int mrkv_statecmp(const void *, const void *);
+static size_t pow2(size_t);
+static void printchains(const char *, size_t, size_t, const size_t[], size_t);
+
+static int model_compile(struct mrkvmodel *, const struct mrkvtable *,
+    const struct strtable *);
+static size_t model_layout(const struct mrkvhdr *, size_t[]);
+static void model_setsections(struct mrkvmodel *);
+static int model_write(const struct mrkvmodel *, const char *);
+static int model_map(struct mrkvmodel *, const char *);
+static void model_free(struct mrkvmodel *);
+static uint32_t model_hash(const struct mrkvmodel *, const uint32_t *);
+static const uint32_t *model_lookup(const struct mrkvmodel *,
+    const uint32_t *);
+static void model_prefixrand(const struct mrkvmodel *, struct rng *,
+    uint32_t *);
+static uint32_t model_sufrand(const struct mrkvmodel *, struct rng *,
+    const uint32_t *);
+static const char *model_str(const struct mrkvmodel *, uint32_t);
+static size_t model_strlen(const struct mrkvmodel *, uint32_t);
+static int model_strindex(struct mrkvmodel *);
+static uint32_t model_strlookup(const struct mrkvmodel *, const char *);
+
+static int outbuf_addword(struct outbuf *, const char *, size_t);
 
 long cflag;
+/* Write the model to this file instead of generating text if not NULL. */
+const char *oflag;
+/* Generate text from the model in this file instead of training if not NULL. */
+const char *mflag;
+/* Number of training and batch generating threads. */
+long jflag = 1;
+/* Expected number of words in the input, the tables are sized for it. */
+long nflag;
+/* Orders of the chains to train, npflag of them. */
+size_t pflag[MAXNPREF];
+size_t npflag;
+/* Print statistics of the tables to stderr if true. */
+int vflag;
+/* Time generating to /dev/null instead of generating to stdout if true. */
+int bflag;
+/* Seed of the random number generator, or -1 for a random seed. */
+long long sflag = -1;
+/* Use arc4random instead of the seeded generator if true. */
+int aflag;
+/* Generate the requests read from stdin instead of cflag words if true. */
+int rflag;
+/* Train on stdin as it's read, generating on SIGUSR1 and at EOF, if true. */
+int fflag;
+/* Size that stream keeps its tables under, or 0 for no limit. */
+size_t lflag;
+/* Set by stream_onusr1. */
+static volatile sig_atomic_t gotusr1;
+/* Prefix length of the states mrkv_statecmp compares, qsort takes no
+ * argument for it. */
+static size_t statecmp_npref;
 
 /* This program reads words from stdin and/or files specified as arguments, adds
  * them to a markov chain, and prints out that many words
+ * With -o, the chain is saved to a model file instead, which -m loads in place
+ * of the input files.
+ * With -p, the chain's prefixes are that many words long. -p can be repeated
+ * along with -o to train chains of several orders out of one reading of the
+ * input, each saved to the model file name followed by a dot and the order.
+ * With -j, the files are split between that many training threads.
+ * With -n, the tables start out big enough for that many words, and with -v
+ * their statistics are printed to stderr.
+ * With -b, the words are generated to /dev/null and the speed of generating
+ * them is printed to stderr.
+ * With -s, the random number generator starts from that seed, so the same seed
+ * and input always give the same words. -a uses arc4random instead, which is
+ * slower and can't be seeded.
+ * With -r, texts are generated for requests read from stdin, see batch. -j then
+ * also sets the number of generating threads.
+ * With -f, the chain is trained on stdin as words arrive, and cflag words are
+ * generated from it on every SIGUSR1 and at EOF, see stream. With -l, rarely
+ * used states are evicted to keep it under that many bytes.
  */
 int
 main(int argc, char *argv[])
 {
 	int c;
+	size_t i;
+	long p;
 	const char *errstr;
-	while ((c = getopt(argc, argv, "c:")) != -1) {
+	while ((c = getopt(argc, argv, "abc:fj:l:m:n:o:p:rs:v")) != -1) {
 		switch (c) {
+		case 'a':
+			aflag = 1;
+			break;
+		case 'b':
+			bflag = 1;
+			break;
 		case 'c':
 			cflag = strtonum(optarg, 0, LONG_MAX, &errstr);
 			if (errstr != NULL)
 				goto err;
 			break;
+		case 'f':
+			fflag = 1;
+			break;
+		case 'j':
+			jflag = strtonum(optarg, 1, LONG_MAX, &errstr);
+			if (errstr != NULL)
+				goto err;
+			break;
+		case 'l':
+			lflag = strtonum(optarg, 1, LLONG_MAX, &errstr);
+			if (errstr != NULL)
+				goto err;
+			break;
+		case 'm':
+			mflag = optarg;
+			break;
+		case 'n':
+			nflag = strtonum(optarg, 0, LONG_MAX, &errstr);
+			if (errstr != NULL)
+				goto err;
+			break;
+		case 'o':
+			oflag = optarg;
+			break;
+		case 'p':
+			p = strtonum(optarg, 1, MAXNPREF, &errstr);
+			if (errstr != NULL)
+				goto err;
+			for (i = 0; i < npflag; i++)
+				if (pflag[i] == (size_t)p)
+					break;
+			if (i == npflag)
+				pflag[npflag++] = p;
+			break;
+		case 'r':
+			rflag = 1;
+			break;
+		case 's':
+			sflag = strtonum(optarg, 0, LLONG_MAX, &errstr);
+			if (errstr != NULL)
+				goto err;
+			break;
+		case 'v':
+			vflag = 1;
+			break;
 		default:
 			abort();
 		}
 	}
 	argc -= optind;
 	argv += optind;
+	if (npflag == 0)
+		pflag[npflag++] = NPREF;
+	if ((mflag != NULL && (oflag != NULL || argc > 0)) ||
+	    (npflag > 1 && oflag == NULL) || (aflag && sflag != -1) ||
+	    (rflag && (bflag || oflag != NULL ||
+	    (mflag == NULL && argc == 0))) ||
+	    (fflag && (bflag || rflag || oflag != NULL || mflag != NULL ||
+	    argc > 0 || npflag > 1)) || (lflag != 0 && !fflag)) {
+		errno = EINVAL;
+		goto err;
+	}
 	if (cook_args(argc, argv) == -1)
 		goto err;
 	return (EXIT_SUCCESS);
@@ -133,261 +597,1637 @@ static int
 cook_args(size_t count, char *files[])
 {
 	struct strtable *strtab = NULL;
+	struct wordvec corpus = {0};
 	struct mrkvtable *mrkvtab = NULL;
-	const char **pref = NULL;
+	struct mrkvmodel model = {0};
+	struct rng rng;
+	char path[PATH_MAX];
 	char *dash = "-";
+	size_t i;
 	int ret = -1;
-	if ((strtab = strt_new(NULL)) == NULL)
-		goto end;
-	if ((mrkvtab = mrkv_tablenew()) == NULL)
-		goto end;
-	if ((pref = calloc(mrkvtab->npref, sizeof(*pref))) == NULL)
+	rng_init(&rng, sflag, aflag);
+	if (fflag)
+		return (stream(&rng));
+	if (mflag != NULL) {
+		if (model_map(&model, mflag) == -1)
+			goto end;
+		if (emit(&model, &rng) == -1)
+			goto end;
+		ret = 0;
 		goto end;
+	}
 	if (count == 0) {
 		count = 1;
 		files = &dash;
 	}
-	if (do_work(mrkvtab, strtab, pref, count, (const char **)files) == -1)
+	if (tokenize(&strtab, &corpus, count, (const char **)files) == -1)
 		goto end;
+	if (vflag)
+		strt_stats(strtab);
+	for (i = 0; i < npflag; i++) {
+		if (build(&mrkvtab, &corpus, pflag[i]) == -1)
+			goto end;
+		if (vflag)
+			mrkv_stats(mrkvtab);
+		if (model_compile(&model, mrkvtab, strtab) == -1)
+			goto end;
+		/* The model holds copies of everything. */
+		mrkv_tablefree(mrkvtab);
+		mrkvtab = NULL;
+		if (oflag != NULL && npflag > 1) {
+			if (snprintf(path, sizeof(path), "%s.%zu", oflag,
+			    pflag[i]) >= (int)sizeof(path)) {
+				errno = ENAMETOOLONG;
+				goto end;
+			}
+			if (model_write(&model, path) == -1)
+				goto end;
+		} else if (oflag != NULL) {
+			if (model_write(&model, oflag) == -1)
+				goto end;
+		} else {
+			if (emit(&model, &rng) == -1)
+				goto end;
+		}
+		model_free(&model);
+	}
 	ret = 0;
 end:
 	strt_free(strtab);
+	free(corpus.w);
 	mrkv_tablefree(mrkvtab);
-	free(pref);
+	model_free(&model);
 	return (ret);
 }
 
-/* do_work: do the bulk of the program's work
- * Builds up mrkvtab and strtab data structures, but does not run them
+/* tokenize: read count files into a table of their strings and a corpus of
+ * their words
+ * With more than one thread, the files are split in order between the threads
+ * so that each gets about the same number of bytes, the strings of each thread
+ * are then merged into one table and renumbered as if one thread had read all
+ * of the files.
+ *
+ * Returns -1 on error.
  */
 static int
-do_work(struct mrkvtable *mrkvtab, struct strtable *strtab, const char **pref,
-    size_t count, const char *files[])
+tokenize(struct strtable **strtab, struct wordvec *corpus, size_t count,
+    const char *files[])
 {
-	size_t i;
-	FILE *input = NULL;
+	struct trainer *tr;
+	size_t i, ntr;
 	int ret = -1;
-	for (i = 0; i < count; i++) {
-		if ((input = fopen(files[i], "rb")) == NULL)
+
+	ntr = MIN((size_t)jflag, count);
+	if ((tr = calloc(ntr, sizeof(*tr))) == NULL)
+		return (-1);
+	for (i = 0; i < ntr; i++)
+		if ((tr[i].strtab = strt_new(NULL, nflag / ntr)) == NULL)
 			goto end;
-		if (body_work(input, mrkvtab, strtab, pref) == -1)
+	if (ntr == 1) {
+		tr->files = files;
+		tr->nfiles = count;
+		if (do_work(tr) == -1)
+			goto end;
+		*strtab = tr->strtab;
+		*corpus = tr->words;
+		tr->strtab = NULL;
+		tr->words.w = NULL;
+	} else {
+		if ((*strtab = strt_new(NULL, 0)) == NULL)
+			goto end;
+		if (tokenize_parallel(*strtab, corpus, tr, ntr, count, files)
+		    == -1)
 			goto end;
-		fclose(input);
 	}
-	if (generate(mrkvtab, strtab, pref) == -1)
-		goto end;
 	ret = 0;
 end:
+	for (i = 0; i < ntr; i++) {
+		strt_free(tr[i].strtab);
+		free(tr[i].words.w);
+	}
+	free(tr);
 	return (ret);
 }
 
-/* body_work: do the bulk of do_work's work
+/* tokenize_parallel: tokenize count files with ntr trainers
+ * See tokenize, the strings are merged into strtab and the words into corpus.
  *
  * Returns -1 on error.
  */
 static int
-body_work(FILE *input, struct mrkvtable *mrkvtab, struct strtable *strtab,
-    const char **pref)
+tokenize_parallel(struct strtable *strtab, struct wordvec *corpus,
+    struct trainer *tr, size_t ntr, size_t count, const char *files[])
 {
-	const char *w;
-	struct mrkvstate *state;
-	while ((w = readword(input)) != NULL) {
-		if (strt_addstr(strtab, &w) == -1)
+	struct merger *mg = NULL;
+	struct strlist ***remap = NULL;
+	struct strlist *lp;
+	pthread_t *tid;
+	struct stat sb;
+	off_t *size = NULL;
+	off_t total, sum;
+	size_t i, j, start, nthr, nstr, nres;
+	int ret = -1;
+
+	if ((tid = calloc(ntr, sizeof(*tid))) == NULL)
+		return (-1);
+	if ((size = calloc(count, sizeof(*size))) == NULL)
+		goto end;
+	for (i = 0, total = 0; i < count; i++) {
+		/* A file that can't be stat()ed fails to open later. */
+		size[i] = stat(files[i], &sb) == -1 ? 0 : sb.st_size;
+		total += size[i];
+	}
+	for (i = 0, j = 0, sum = 0; i < ntr; i++) {
+		/* Leave a file for every trainer after this one. */
+		for (start = j; j < count - (ntr - 1 - i); j++) {
+			if (j > start && sum + size[j] / 2 >
+			    total / (off_t)ntr * (off_t)(i + 1))
+				break;
+			sum += size[j];
+		}
+		tr[i].files = files + start;
+		tr[i].nfiles = j - start;
+	}
+
+	for (nthr = 0; nthr < ntr; nthr++)
+		if ((errno = pthread_create(&tid[nthr], NULL, do_work_thread,
+		    &tr[nthr])) != 0)
+			break;
+	for (i = 0; i < nthr; i++)
+		pthread_join(tid[i], NULL);
+	if (nthr < ntr)
+		goto end;
+	for (i = 0; i < ntr; i++) {
+		if (tr[i].ret == -1) {
+			errno = tr[i].error;
 			goto end;
-		if (*pref != NULL) {
-			if ((state = mrkv_lookup(mrkvtab, pref, 1)) == NULL)
-				goto end;
-			if (mrkv_sufadd(state, w) == -1)
-				goto end;
 		}
-		memmove(pref, pref + 1, (mrkvtab->npref - 1) * sizeof(*pref));
-		pref[mrkvtab->npref - 1] = w;
 	}
 
+	/* Merge the strings, strtab is grown beforehand so it doesn't grow
+	 * under the mergers. */
+	if ((remap = calloc(ntr, sizeof(*remap))) == NULL)
+		goto end;
+	for (i = nstr = 0; i < ntr; i++) {
+		if ((remap[i] = calloc(tr[i].strtab->nmemb, sizeof(**remap)))
+		    == NULL)
+			goto end;
+		nstr += tr[i].strtab->nmemb;
+	}
+	if (strt_resize(strtab, pow2(nstr / MAXLOAD)) == -1)
+		goto end;
+	if (strt_growstrs(strtab, nstr) == -1)
+		goto end;
+	nres = strtab->bufnmemb;
+	for (i = 0; i < ntr; i++)
+		nres = MIN(nres, tr[i].strtab->bufnmemb);
+	if ((mg = calloc(ntr, sizeof(*mg))) == NULL)
+		goto end;
+	for (i = 0; i < ntr; i++) {
+		mg[i].strtab = strtab;
+		mg[i].tr = tr;
+		mg[i].nsrc = ntr;
+		mg[i].remap = remap;
+		mg[i].nres = nres;
+	}
+	if (runmergers(mg, ntr, mergestrings) == -1)
+		goto end;
+
+	/* Number the strings in the order they were first read. */
+	for (i = 0; i < ntr; i++) {
+		for (j = 0; j < tr[i].strtab->nmemb; j++) {
+			lp = remap[i][j];
+			if (lp->id == NOID) {
+				lp->id = strtab->nmemb++;
+				strtab->strs[lp->id] = lp->str;
+			}
+		}
+	}
+
+	for (i = corpus->n = 0; i < ntr; i++)
+		corpus->n += tr[i].words.n;
+	if ((corpus->w = reallocarray(NULL, corpus->n, sizeof(*corpus->w)))
+	    == NULL)
+		goto end;
+	corpus->max = corpus->n;
+	for (i = j = 0; i < ntr; i++) {
+		mg[i].tr = &tr[i];
+		mg[i].remap = &remap[i];
+		mg[i].corpus = corpus->w + j;
+		j += tr[i].words.n;
+	}
+	if (runmergers(mg, ntr, mergewords) == -1)
+		goto end;
+	ret = 0;
 end:
-	free((void *)w);
-	return (feof(input) ? 0 : -1);
+	if (remap != NULL)
+		for (i = 0; i < ntr; i++)
+			free(remap[i]);
+	free(remap);
+	free(mg);
+	free(size);
+	free(tid);
+	return (ret);
+}
+
+/* do_work_thread: pthread_create wrapper for do_work */
+static void *
+do_work_thread(void *tr)
+{
+	struct trainer *t = tr;
+	if ((t->ret = do_work(t)) == -1)
+		t->error = errno;
+	return (NULL);
 }
 
+/* do_work: do the bulk of the program's work
+ * Builds up tr's string table and words out of its files.
+ */
 static int
-generate(struct mrkvtable *mrkvtab, struct strtable *strtab, const char **pref)
+do_work(struct trainer *tr)
 {
 	size_t i;
+	FILE *input = NULL;
 	int ret = -1;
-	struct mrkvstate *state;
-	const size_t lastpref = mrkvtab->npref - 1;
-
-	mrkv_prefixrand(mrkvtab, pref);
-	for (i = 0; i < mrkvtab->npref; i++)
-		if (printf("%s\n", pref[i]) < 0)
+	for (i = 0; i < tr->nfiles; i++) {
+		if ((input = fopen(tr->files[i], "rb")) == NULL)
 			goto end;
-
-	for (/* i from previous loop */; i < cflag; i++) {
-		state = mrkv_lookup(mrkvtab, pref, 0);
-		memmove(pref, pref + 1, lastpref * sizeof(*pref));
-		pref[lastpref] = mrkv_sufrand(state);
-		if (printf("%s\n", pref[lastpref]) < 0)
+		if (body_work(input, tr) == -1)
 			goto end;
+		fclose(input);
+		input = NULL;
 	}
 	ret = 0;
 end:
+	if (input != NULL)
+		fclose(input);
 	return (ret);
 }
 
-/* mrkv_prefixrand: set pref to a random prefix from tab */
-static void
-mrkv_prefixrand(const struct mrkvtable *tab, const char **pref)
-{
-	size_t i;
-	struct mrkvstate *sp, *retsp;
-	arc4random_buf(&i, sizeof(i));
-
-	while(tab->tab[i %= tab->bufnmemb] == NULL)
-		i++;
-	sp = tab->tab[i];
-	for (i = 0, retsp = sp; sp->next != NULL; sp = sp->next)
-		if (arc4random() % ++i == 0)
-			retsp = sp;
-	memcpy(pref, retsp->pref, sizeof(*pref) * tab->npref);
-}
-
-/* mrkv_sufrand get random string from state's suffix list */
-static const char *
-mrkv_sufrand(const struct mrkvstate *state)
-{
-	size_t nfound;
-	const struct mrkvsuffix *suf, *tsp;
-	nfound = 0;
-	for (suf = tsp = state->suf; tsp->next != NULL; tsp = tsp->next)
-		if (arc4random() % ++nfound == 0)
-			suf = tsp;
-	return (suf->word);
-}
-/* readword: read word from FILE stream, skipping a whitespace prefix
- * The returned pointer to the word can be free()d.
+/* body_work: do the bulk of do_work's work
  *
- * Return NULL if EOF with no data read.
- * Return NULL on error, with some data lost.
+ * Returns -1 on error.
  */
-static const char *
-readword(FILE *input)
+static int
+body_work(FILE *input, struct trainer *tr)
 {
-	char *str;
-	const size_t bufsz = MAXWORDLEN;
-	int c;
-	size_t i;
-	if ((str = malloc(bufsz)) == NULL)
-		goto err;
-	if (skipspace(input) != 0)
-		goto err;
-	for (i = 0; i < bufsz - 1; i++) {
-		if ((c = fgetc(input)) == EOF) {
-			if (ferror(input))
-				goto err;
-			else if (feof(input))
-				break;
-		}
-		if (isspace(c)) {
-			if (ungetc(c, input) == EOF)
-				goto err;
-			break;
-		}
-		str[i] = c;
+	const char *w;
+	uint32_t id;
+	while ((w = readword(input)) != NULL) {
+		if (strt_addstr(tr->strtab, &w, &id) == -1)
+			goto end;
+		if (wordvec_add(&tr->words, id) == -1)
+			return (-1);
 	}
-	str[i] = '\0';
-	return (str);
-err:
-	free(str);
-	return (NULL);
+
+end:
+	free((void *)w);
+	return (feof(input) ? 0 : -1);
 }
 
-/* skipspace: skip whitespace in input
- * Return last character read if it can't be ungetc'd
- * Return 0 on success
- * Return EOF on error or EOF
+/* build: build a frozen chain of npref word prefixes out of corpus
+ * With more than one thread, the corpus is split between the threads, and the
+ * states of each thread are then merged into one table.
+ *
+ * Returns -1 on error.
  */
 static int
-skipspace(FILE *input)
-{
-	int c;
-	while ((c = fgetc(input)) != EOF)
-		if (!isspace(c))
-			return (ungetc(c, input) == c ? 0 : c);
-	return (EOF);
-}
-
-/* strt_lookup: look up str in table
- * If create is true, create the hash table entry if it's not found.
- * str becomes property of this function if a new list is created. A new list
- * was created if the returned list's str member is equal to the str argument of
- * this function in a pointer comparison.
- * Returns NULL if the entry is not found.
- * Returns NULL if create is true and creation fails. */
-static struct strlist *
-strt_lookup(struct strtable *table, const char *str, int create)
+build(struct mrkvtable **mrkvtab, const struct wordvec *corpus, size_t npref)
 {
-	struct strlist *listp;
-	strt_hash hash;
-	hash = strt_hashstr(table, str);
+	struct builder *bl;
+	size_t i, nbl;
+	int ret = -1;
 
-	for (listp = table->tab[hash]; listp != NULL; listp = listp->next)
-		if (strcmp(str, listp->str) == 0)
+	nbl = corpus->n > npref ? MIN((size_t)jflag, corpus->n - npref) : 1;
+	if ((bl = calloc(nbl, sizeof(*bl))) == NULL)
+		return (-1);
+	for (i = 0; i < nbl; i++) {
+		if ((bl[i].mrkvtab = mrkv_tablenew(nflag / nbl, npref)) == NULL)
 			goto end;
-	if (create) {
-		if ((listp = strl_new(NULL, str)) == NULL)
+		bl[i].corpus = corpus->w;
+		bl[i].lo = npref + (corpus->n - npref) / nbl * i;
+		bl[i].hi = i == nbl - 1 ? corpus->n :
+		    npref + (corpus->n - npref) / nbl * (i + 1);
+	}
+	if (nbl == 1) {
+		if (corpus->n > npref && body_build(bl) == -1)
+			goto end;
+		*mrkvtab = bl->mrkvtab;
+		bl->mrkvtab = NULL;
+	} else {
+		if ((*mrkvtab = mrkv_tablenew(0, npref)) == NULL)
+			goto end;
+		if (build_parallel(*mrkvtab, bl, nbl) == -1)
 			goto end;
-		listp->next = table->tab[hash];
-		table->tab[hash] = listp;
-		table->nmemb++;
 	}
+	mrkv_tablefreeze(*mrkvtab);
+	ret = 0;
 end:
-	return (listp);
+	for (i = 0; i < nbl; i++)
+		mrkv_tablefree(bl[i].mrkvtab);
+	free(bl);
+	return (ret);
 }
 
-/* strt_addstr: add single string to strtab
- * The pointer to the string may change, the string is the strtab's property
- * unless there's an error.
+/* build_parallel: run the nbl builders in bl and merge their states
+ * into mrkvtab
+ * mrkvtab is grown to fit all of the states beforehand, so neither its
+ * buckets nor its array of slabs grow while merging.
  *
  * Returns -1 on error.
  */
 static int
-strt_addstr(struct strtable *strtab, const char **str)
+build_parallel(struct mrkvtable *mrkvtab, struct builder *bl, size_t nbl)
 {
-	struct strlist *sp;
+	struct merger *mg = NULL;
+	pthread_t *tid;
+	size_t i, nthr, nstate, nres;
 	int ret = -1;
-	if ((sp = strt_lookup(strtab, *str, 1)) == NULL)
+
+	if ((tid = calloc(nbl, sizeof(*tid))) == NULL)
+		return (-1);
+	for (nthr = 0; nthr < nbl; nthr++)
+		if ((errno = pthread_create(&tid[nthr], NULL, body_build_thread,
+		    &bl[nthr])) != 0)
+			break;
+	for (i = 0; i < nthr; i++)
+		pthread_join(tid[i], NULL);
+	if (nthr < nbl)
 		goto end;
-	if (sp->str != *str) {
-		free((void *)*str);
-		*str = sp->str;
+	for (i = nstate = 0; i < nbl; i++) {
+		if (bl[i].ret == -1) {
+			errno = bl[i].error;
+			goto end;
+		}
+		nstate += bl[i].mrkvtab->nmemb;
+	}
+
+	if (mrkv_resize(mrkvtab, pow2(nstate / MAXLOAD)) == -1)
+		goto end;
+	/* Every merger may leave a slab partly used. */
+	if (mrkv_reserve(mrkvtab, nstate + nbl * SLABNMEMB) == -1)
+		goto end;
+	nres = mrkvtab->bufnmemb;
+	for (i = 0; i < nbl; i++)
+		nres = MIN(nres, bl[i].mrkvtab->bufnmemb);
+	if ((mg = calloc(nbl, sizeof(*mg))) == NULL)
+		goto end;
+	for (i = 0; i < nbl; i++) {
+		mg[i].mrkvtab = mrkvtab;
+		mg[i].bl = bl;
+		mg[i].nsrc = nbl;
+		mg[i].nres = nres;
 	}
+	if (runmergers(mg, nbl, mergestates) == -1)
+		goto end;
 	ret = 0;
 end:
+	free(mg);
+	free(tid);
 	return (ret);
 }
 
-/* strt_new: allocate a struct strtable.
- * If table isn't null, use the buffer it points to, otherwise allocate it.
- * The buffer's contents are undefined on failure. */
-static struct strtable *
-strt_new(struct strtable *table)
+/* body_build_thread: pthread_create wrapper for body_build */
+static void *
+body_build_thread(void *bl)
 {
-	struct strtable *alloc = NULL;
-	if (table == NULL)
-		if ((alloc = table = malloc(sizeof(*table))) == NULL)
-			return (NULL);
-	table->nmemb = 0;
-	table->bufnmemb = STRTABLEBUFNMEMB;
-	if ((table->tab = calloc(table->bufnmemb, sizeof(*table->tab))) == NULL)
-		goto err;
-	return (table);
-err:
+	struct builder *b = bl;
+	if ((b->ret = body_build(b)) == -1)
+		b->error = errno;
+	return (NULL);
+}
+
+/* body_build: add bl's share of the corpus to its table
+ *
+ * Returns -1 on error.
+ */
+static int
+body_build(struct builder *bl)
+{
+	struct mrkvstate *state;
+	const size_t npref = bl->mrkvtab->npref;
+	size_t i;
+
+	for (i = bl->lo; i < bl->hi; i++) {
+		if ((state = mrkv_lookup(bl->mrkvtab, bl->corpus + i - npref, 1))
+		    == NULL)
+			return (-1);
+		if (mrkv_sufadd(state, bl->corpus[i], 1) == -1)
+			return (-1);
+	}
+	return (0);
+}
+
+/* runmergers: run fn on a thread for each of the n mergers in mg
+ * Sets the thread's share of the work, and adds the states each thread merged
+ * to the table it merged into.
+ *
+ * Returns -1 on error.
+ */
+static int
+runmergers(struct merger *mg, size_t n, void *(*fn)(void *))
+{
+	pthread_t *tid;
+	size_t i, nthr;
+	int ret = -1;
+
+	if ((tid = calloc(n, sizeof(*tid))) == NULL)
+		return (-1);
+	for (nthr = 0; nthr < n; nthr++) {
+		mg[nthr].first = nthr;
+		mg[nthr].step = n;
+		mg[nthr].nmemb = 0;
+		mg[nthr].cur = (struct slabcursor){0, 0};
+		if ((errno = pthread_create(&tid[nthr], NULL, fn, &mg[nthr]))
+		    != 0)
+			break;
+	}
+	for (i = 0; i < nthr; i++)
+		pthread_join(tid[i], NULL);
+	if (nthr < n)
+		goto end;
+	for (i = 0; i < n; i++) {
+		if (mg[i].ret == -1) {
+			errno = mg[i].error;
+			goto end;
+		}
+		if (fn == mergestates)
+			mg[i].mrkvtab->nmemb += mg[i].nmemb;
+	}
+	ret = 0;
+end:
+	free(tid);
+	return (ret);
+}
+
+/* mergestrings: move the strings of mg's share of the buckets into mg->strtab
+ * Strings already in mg->strtab stay in their table. Moved strings are left
+ * with NOID for their id, and mg->remap gets the string each id became.
+ */
+static void *
+mergestrings(void *_mg)
+{
+	struct merger *mg = _mg;
+	struct strtable *dst = mg->strtab;
+	struct strtable *src;
+	struct strlist *lp, *dp, **lpp;
+	size_t i, r, b, db;
+
+	for (r = mg->first; r < mg->nres; r += mg->step) {
+		for (i = 0; i < mg->nsrc; i++) {
+			src = mg->tr[i].strtab;
+			for (b = r; b < src->bufnmemb; b += mg->nres) {
+				for (lpp = &src->tab[b]; *lpp != NULL;) {
+					lp = *lpp;
+					db = lp->hash & (dst->bufnmemb - 1);
+					for (dp = dst->tab[db]; dp != NULL;
+					    dp = dp->next)
+						if (dp->hash == lp->hash &&
+						    strcmp(dp->str, lp->str) == 0)
+							break;
+					if (dp != NULL) {
+						mg->remap[i][lp->id] = dp;
+						lpp = &lp->next;
+						continue;
+					}
+					mg->remap[i][lp->id] = lp;
+					lp->id = NOID;
+					*lpp = lp->next;
+					lp->next = dst->tab[db];
+					dst->tab[db] = lp;
+				}
+			}
+		}
+	}
+	mg->ret = 0;
+	return (NULL);
+}
+
+/* mergewords: put mg->tr's words into mg->corpus with their merged ids */
+static void *
+mergewords(void *_mg)
+{
+	struct merger *mg = _mg;
+	const struct wordvec *words = &mg->tr->words;
+	struct strlist **remap = *mg->remap;
+	size_t i;
+
+	for (i = 0; i < words->n; i++)
+		mg->corpus[i] = remap[words->w[i]]->id;
+	mg->ret = 0;
+	return (NULL);
+}
+
+/* mergestates: move the states of mg's share of the buckets into mg->mrkvtab
+ * Merged states are frozen.
+ */
+static void *
+mergestates(void *_mg)
+{
+	struct merger *mg = _mg;
+	struct mrkvtable *dst = mg->mrkvtab;
+	struct mrkvtable *src;
+	struct mrkvstate *sp, *dp;
+	size_t i, r, b, db;
+	uint32_t j;
+
+	mg->ret = -1;
+	for (r = mg->first; r < mg->nres; r += mg->step) {
+		for (i = 0; i < mg->nsrc; i++) {
+			src = mg->bl[i].mrkvtab;
+			for (b = r; b < src->bufnmemb; b += mg->nres) {
+				while ((j = src->tab[b]) != NOSTATE) {
+					sp = mrkv_state(src, j);
+					src->tab[b] = sp->next;
+					if (mergestate(dst, &mg->cur, sp,
+					    &mg->nmemb) == -1)
+						goto err;
+				}
+			}
+		}
+		for (db = r; db < dst->bufnmemb; db += mg->nres) {
+			for (j = dst->tab[db]; j != NOSTATE; j = dp->next) {
+				dp = mrkv_state(dst, j);
+				mrkv_statefreeze(dp);
+			}
+		}
+	}
+	mg->ret = 0;
+	return (NULL);
+err:
+	mg->error = errno;
+	return (NULL);
+}
+
+/* mergestate: move sp into dst, or add its suffixes to dst's equal state
+ * Moved states are copied into dst's slabs from cur, and *nmemb is
+ * incremented. Either way, sp's slot is left for its table to free, and its
+ * suffixes are moved or freed.
+ *
+ * Returns -1 on error.
+ */
+static int
+mergestate(struct mrkvtable *dst, struct slabcursor *cur,
+    struct mrkvstate *sp, size_t *nmemb)
+{
+	struct mrkvstate *dp;
+	size_t db;
+	uint32_t i, j;
+	int ret = -1;
+
+	db = sp->hash & (dst->bufnmemb - 1);
+	for (i = dst->tab[db]; i != NOSTATE; i = dp->next) {
+		dp = mrkv_state(dst, i);
+		if (dp->hash == sp->hash && mrkv_prefcmp(dst, dp->pref,
+		    sp->pref) == 0)
+			break;
+	}
+	if (i == NOSTATE) {
+		if ((i = mrkv_statenew(dst, cur, sp->pref)) == NOSTATE)
+			goto end;
+		dp = mrkv_state(dst, i);
+		dp->onesuf = sp->onesuf;
+		dp->suf = sp->suf == &sp->onesuf ? &dp->onesuf : sp->suf;
+		dp->nsuf = sp->nsuf;
+		dp->maxsuf = sp->maxsuf;
+		dp->total = sp->total;
+		dp->frozen = sp->frozen;
+		dp->hash = sp->hash;
+		dp->next = dst->tab[db];
+		dst->tab[db] = i;
+		(*nmemb)++;
+		return (0);
+	}
+	for (j = 0; j < sp->nsuf; j++)
+		if (mrkv_sufadd(dp, sp->suf[j].word, sp->suf[j].count) == -1)
+			goto end;
+	ret = 0;
+end:
+	mrkv_suffree(sp);
+	return (ret);
+}
+
+/* emit: generate text from model to stdout, or what -b or -r ask for
+ *
+ * Returns -1 on error.
+ */
+static int
+emit(struct mrkvmodel *model, struct rng *rng)
+{
+	struct outbuf ob;
+	int ret = -1;
+
+	if (rflag)
+		return (batch(model));
+	if (bflag)
+		return (bench(model, rng));
+	if (outbuf_init(&ob, STDOUT_FILENO, OUTBUFSIZE) == -1)
+		return (-1);
+	if (generate(model, rng, &ob, NULL, cflag, NULL) == -1)
+		goto end;
+	if (outbuf_flush(&ob) == -1)
+		goto end;
+	ret = 0;
+end:
+	outbuf_free(&ob);
+	return (ret);
+}
+
+/* generate: append count words from model to ob, one per line, drawing from rng
+ * The words start with start, whose last npref words must be the prefix of a
+ * state, or with a random prefix if start is NULL. Less words are appended if
+ * the chain reaches the end of its input. If ngen isn't NULL, it's set to the
+ * number of words appended.
+ *
+ * Returns -1 on error.
+ */
+static int
+generate(const struct mrkvmodel *model, struct rng *rng, struct outbuf *ob,
+    const struct wordvec *start, long count, long *ngen)
+{
+	size_t i;
+	int ret = -1;
+	const uint32_t *state;
+	uint32_t *pref;
+	const size_t npref = model->hdr->npref;
+	const size_t lastpref = npref - 1;
+
+	if (ngen != NULL)
+		*ngen = 0;
+	if (model->hdr->nstate == 0)
+		return (0);
+	if ((pref = calloc(npref, sizeof(*pref))) == NULL)
+		return (-1);
+	if (start != NULL) {
+		for (i = 0; i < start->n; i++)
+			if (outbuf_addword(ob, model_str(model, start->w[i]),
+			    model_strlen(model, start->w[i])) == -1)
+				goto end;
+		memcpy(pref, start->w + start->n - npref,
+		    npref * sizeof(*pref));
+	} else {
+		model_prefixrand(model, rng, pref);
+		for (i = 0; i < npref; i++)
+			if (outbuf_addword(ob, model_str(model, pref[i]),
+			    model_strlen(model, pref[i])) == -1)
+				goto end;
+	}
+
+	for (/* i from previous loop */; i < (size_t)count; i++) {
+		/* The prefix at the end of the input has no suffixes. */
+		if ((state = model_lookup(model, pref)) == NULL)
+			break;
+		memmove(pref, pref + 1, lastpref * sizeof(*pref));
+		pref[lastpref] = model_sufrand(model, rng, state);
+		if (outbuf_addword(ob, model_str(model, pref[lastpref]),
+		    model_strlen(model, pref[lastpref])) == -1)
+			goto end;
+	}
+	if (ngen != NULL)
+		*ngen = i;
+	ret = 0;
+end:
+	free(pref);
+	return (ret);
+}
+
+/* bench: time generating cflag words from model to /dev/null
+ * Generating starts over from a random prefix whenever the chain reaches the
+ * end of its input. Prints the speed to stderr.
+ *
+ * Returns -1 on error.
+ */
+static int
+bench(const struct mrkvmodel *model, struct rng *rng)
+{
+	struct timespec start, stop;
+	struct outbuf ob = {0};
+	double secs;
+	long total, n;
+	int fd;
+	int ret = -1;
+
+	if ((fd = open("/dev/null", O_WRONLY)) == -1)
+		return (-1);
+	if (outbuf_init(&ob, fd, OUTBUFSIZE) == -1)
+		goto end;
+	if (clock_gettime(CLOCK_MONOTONIC, &start) == -1)
+		goto end;
+	for (total = 0; total < cflag; total += n) {
+		if (generate(model, rng, &ob, NULL, cflag - total, &n) == -1)
+			goto end;
+		if (n == 0)
+			break;
+	}
+	if (outbuf_flush(&ob) == -1)
+		goto end;
+	if (clock_gettime(CLOCK_MONOTONIC, &stop) == -1)
+		goto end;
+	secs = (stop.tv_sec - start.tv_sec) +
+	    (stop.tv_nsec - start.tv_nsec) / 1e9;
+	fprintf(stderr, "%s: %ld words in %.3fs, %.0f words/s, %.1f ns/word\n",
+	    rng->name, total, secs, total / secs, secs * 1e9 / MAX(total, 1));
+	ret = 0;
+end:
+	outbuf_free(&ob);
+	close(fd);
+	return (ret);
+}
+
+/* batch: generate a text for each request read from stdin to stdout
+ * A request is a line with the number of words of the text, optionally followed
+ * by words to start it with. A text whose words aren't all in the model, are
+ * fewer than npref, or whose last npref words aren't the prefix of a state is
+ * empty, and so is that of a line without a valid count. Blank lines are
+ * skipped. Texts are written in the order of their requests, each followed by
+ * an empty line.
+ * Requests are read BATCHNREQ at a time and spread over jflag threads. Each
+ * text gets its own seed off of sflag, so the texts don't depend on jflag.
+ *
+ * Returns -1 on error.
+ */
+static int
+batch(struct mrkvmodel *model)
+{
+	struct request *req;
+	struct batcher *bt = NULL;
+	struct iovec *iov = NULL;
+	pthread_t *tid = NULL;
+	char *line = NULL;
+	size_t linesize = 0;
+	size_t i, nreq, nbt, nthr;
+	ssize_t total;
+	uint64_t seed;
+	int r, eof;
+	int ret = -1;
+
+	if (model_strindex(model) == -1)
+		return (-1);
+	if ((req = calloc(BATCHNREQ, sizeof(*req))) == NULL)
+		return (-1);
+	nbt = MIN((size_t)jflag, BATCHNREQ);
+	if ((bt = calloc(nbt, sizeof(*bt))) == NULL ||
+	    (tid = calloc(nbt, sizeof(*tid))) == NULL ||
+	    (iov = calloc(BATCHNREQ, sizeof(*iov))) == NULL)
+		goto end;
+	for (i = 0; i < nbt; i++)
+		if (outbuf_init(&bt[i].ob, -1, OUTBUFSIZE) == -1)
+			goto end;
+	if (sflag == -1)
+		arc4random_buf(&seed, sizeof(seed));
+	else
+		seed = sflag;
+
+	for (eof = 0; !eof;) {
+		for (nreq = 0; nreq < BATCHNREQ; nreq++) {
+			if ((r = readrequest(model, &req[nreq], &line,
+			    &linesize)) == -1)
+				goto end;
+			if (r == 0) {
+				eof = 1;
+				break;
+			}
+			req[nreq].seed = splitmix64(&seed) & LLONG_MAX;
+		}
+		if (nreq == 0)
+			break;
+
+		for (nthr = 0; nthr < MIN(nbt, nreq); nthr++) {
+			bt[nthr].model = model;
+			bt[nthr].req = req;
+			bt[nthr].nreq = nreq;
+			bt[nthr].first = nthr;
+			bt[nthr].step = MIN(nbt, nreq);
+			bt[nthr].ob.len = 0;
+			if ((errno = pthread_create(&tid[nthr], NULL,
+			    body_batch_thread, &bt[nthr])) != 0)
+				break;
+		}
+		for (i = 0; i < nthr; i++)
+			pthread_join(tid[i], NULL);
+		if (nthr < MIN(nbt, nreq))
+			goto end;
+		for (i = 0; i < nthr; i++) {
+			if (bt[i].ret == -1) {
+				errno = bt[i].error;
+				goto end;
+			}
+		}
+
+		for (i = total = 0; i < nreq; i++) {
+			iov[i].iov_base = bt[i % nthr].ob.buf + req[i].off;
+			iov[i].iov_len = req[i].len;
+			total += req[i].len;
+		}
+		if (nwritev(STDOUT_FILENO, iov, nreq) != total)
+			goto end;
+	}
+	if (ferror(stdin))
+		goto end;
+	ret = 0;
+end:
+	for (i = 0; i < BATCHNREQ; i++)
+		free(req[i].words.w);
+	free(req);
+	for (i = 0; bt != NULL && i < nbt; i++)
+		outbuf_free(&bt[i].ob);
+	free(bt);
+	free(tid);
+	free(iov);
+	free(line);
+	return (ret);
+}
+
+/* readrequest: read a request for batch from stdin into req
+ * req's words are looked up in model, which needs model_strindex. req->known
+ * is cleared if they aren't all in it, if there are fewer than npref of them,
+ * or if the last npref aren't the prefix of a state, and for a line without a
+ * valid count, for an empty text. Blank lines are skipped.
+ *
+ * Returns 0 on EOF, -1 on error.
+ */
+static int
+readrequest(const struct mrkvmodel *model, struct request *req, char **line,
+    size_t *linesize)
+{
+	const char *errstr;
+	char *word, *last;
+	size_t nword;
+	uint32_t id;
+
+	do
+		if (getline(line, linesize, stdin) == -1)
+			return (0);
+	while ((word = strtok_r(*line, " \t\n", &last)) == NULL);
+	req->words.n = 0;
+	req->known = 1;
+	req->count = strtonum(word, 0, LONG_MAX, &errstr);
+	if (errstr != NULL) {
+		req->known = 0;
+		return (1);
+	}
+	for (nword = 0; (word = strtok_r(NULL, " \t\n", &last)) != NULL;
+	    nword++) {
+		if ((id = model_strlookup(model, word)) == NOID)
+			req->known = 0;
+		else if (wordvec_add(&req->words, id) == -1)
+			return (-1);
+	}
+	/* Too few words to start from are an unknown prefix too. */
+	if (nword > 0 && nword < model->hdr->npref)
+		req->known = 0;
+	if (req->known && req->words.n > 0 && model_lookup(model,
+	    req->words.w + req->words.n - model->hdr->npref) == NULL)
+		req->known = 0;
+	return (1);
+}
+
+/* body_batch_thread: pthread_create wrapper for body_batch */
+static void *
+body_batch_thread(void *bt)
+{
+	struct batcher *b = bt;
+	if ((b->ret = body_batch(b)) == -1)
+		b->error = errno;
+	return (NULL);
+}
+
+/* body_batch: generate bt's share of the requests into its buffer
+ *
+ * Returns -1 on error.
+ */
+static int
+body_batch(struct batcher *bt)
+{
+	struct request *req;
+	size_t i;
+
+	for (i = bt->first; i < bt->nreq; i += bt->step) {
+		req = &bt->req[i];
+		req->off = bt->ob.len;
+		if (req->known) {
+			rng_init(&bt->rng, req->seed, aflag);
+			if (generate(bt->model, &bt->rng, &bt->ob,
+			    req->words.n > 0 ? &req->words : NULL, req->count,
+			    NULL) == -1)
+				return (-1);
+		}
+		if (outbuf_addword(&bt->ob, "", 0) == -1)
+			return (-1);
+		req->len = bt->ob.len - req->off;
+	}
+	return (0);
+}
+
+/* rng_init: make rng draw from arc4random if arc4 is true, otherwise from
+ * xoshiro256** started from seed, or from a random seed if seed is -1
+ * The four words of xoshiro's state are spread out of the seed by splitmix64,
+ * which never makes them all 0.
+ */
+static void
+rng_init(struct rng *rng, long long seed, int arc4)
+{
+	uint64_t x;
+	size_t i;
+
+	if (arc4) {
+		rng->next = rng_arc4random;
+		rng->name = "arc4random";
+		return;
+	}
+	rng->next = rng_xoshiro;
+	rng->name = "xoshiro256**";
+	if (seed == -1)
+		arc4random_buf(&x, sizeof(x));
+	else
+		x = seed;
+	for (i = 0; i < 4; i++)
+		rng->s[i] = splitmix64(&x);
+}
+
+/* rng_uniform: return a uniformly distributed random number in [0, n)
+ * Lemire's multiply and shift, drawing again in the rare case that the low
+ * half of the product lands in the biased part of its range.
+ * n must not be 0.
+ */
+static uint32_t
+rng_uniform(struct rng *rng, uint32_t n)
+{
+	uint64_t m;
+	uint32_t low, threshold;
+
+	m = (uint64_t)rng->next(rng) * n;
+	low = m;
+	if (low < n) {
+		threshold = -n % n;
+		while (low < threshold) {
+			m = (uint64_t)rng->next(rng) * n;
+			low = m;
+		}
+	}
+	return (m >> 32);
+}
+
+#define ROTL(x, k) ((x) << (k) | (x) >> (64 - (k)))
+
+/* rng_xoshiro: xoshiro256** by Blackman and Vigna, returning the high half of
+ * its output, whose bits are the best
+ */
+static uint32_t
+rng_xoshiro(struct rng *rng)
+{
+	uint64_t *s = rng->s;
+	const uint64_t r = ROTL(s[1] * 5, 7) * 9;
+	const uint64_t t = s[1] << 17;
+
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = ROTL(s[3], 45);
+	return (r >> 32);
+}
+
+/* rng_arc4random: struct rng wrapper for arc4random */
+static uint32_t
+rng_arc4random(struct rng *rng)
+{
+	(void)rng;
+	return (arc4random());
+}
+
+/* splitmix64: advance *x and return the next output of splitmix64 */
+static uint64_t
+splitmix64(uint64_t *x)
+{
+	uint64_t z;
+
+	z = (*x += 0x9e3779b97f4a7c15);
+	z = (z ^ z >> 30) * 0xbf58476d1ce4e5b9;
+	z = (z ^ z >> 27) * 0x94d049bb133111eb;
+	return (z ^ z >> 31);
+}
+
+/* stream: train a chain on stdin as it's read, and generate from it
+ * cflag words are generated to stdout from the tables as they are whenever
+ * SIGUSR1 is caught, and once more at EOF. SIGUSR1 is only let through while
+ * waiting for input, so it's handled between two reads.
+ * With lflag, the tables are kept under lflag bytes, see stream_evict. Every
+ * state's counts are halved when they would overflow 32 bits.
+ *
+ * Returns -1 on error.
+ */
+static int
+stream(struct rng *rng)
+{
+	struct live lv = {0};
+	struct sigaction sa;
+	sigset_t usr1, omask;
+	fd_set rfds;
+	char *buf = NULL;
+	char word[MAXWORDLEN];
+	size_t bufsize, wlen, i;
+	ssize_t nr;
+	int ret = -1;
+
+	if ((lv.strtab = strt_new(NULL, nflag)) == NULL ||
+	    (lv.mrkvtab = mrkv_tablenew(nflag, pflag[0])) == NULL)
+		goto end;
+	lv.maxbytes = lflag != 0 ? lflag : SIZE_MAX;
+	bufsize = getfdblksize(STDIN_FILENO);
+	if ((buf = malloc(bufsize)) == NULL)
+		goto end;
+	sigemptyset(&usr1);
+	sigaddset(&usr1, SIGUSR1);
+	if (sigprocmask(SIG_BLOCK, &usr1, &omask) == -1)
+		goto end;
+	sa.sa_handler = stream_onusr1;
+	sa.sa_flags = 0;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGUSR1, &sa, NULL) == -1)
+		goto end;
+
+	for (wlen = 0;;) {
+		FD_ZERO(&rfds);
+		FD_SET(STDIN_FILENO, &rfds);
+		if (pselect(STDIN_FILENO + 1, &rfds, NULL, NULL, NULL, &omask)
+		    == -1 && errno != EINTR)
+			goto end;
+		if (gotusr1) {
+			gotusr1 = 0;
+			if (stream_emit(&lv, rng) == -1)
+				goto end;
+			continue;
+		}
+		if ((nr = read(STDIN_FILENO, buf, bufsize)) == -1)
+			goto end;
+		if (nr == 0)
+			break;
+		/* Words are split like readword splits them. */
+		for (i = 0; i < (size_t)nr; i++) {
+			if (!isspace((unsigned char)buf[i])) {
+				word[wlen++] = buf[i];
+				if (wlen < MAXWORDLEN - 1)
+					continue;
+			} else if (wlen == 0) {
+				continue;
+			}
+			word[wlen] = '\0';
+			wlen = 0;
+			if (stream_addword(&lv, word) == -1)
+				goto end;
+		}
+	}
+	if (wlen > 0) {
+		word[wlen] = '\0';
+		if (stream_addword(&lv, word) == -1)
+			goto end;
+	}
+	if (stream_emit(&lv, rng) == -1)
+		goto end;
+	if (vflag) {
+		strt_stats(lv.strtab);
+		mrkv_stats(lv.mrkvtab);
+		fprintf(stderr, "live: %zu bytes\n", lv.bytes);
+	}
+	ret = 0;
+end:
+	free(buf);
+	strt_free(lv.strtab);
+	mrkv_tablefree(lv.mrkvtab);
+	return (ret);
+}
+
+/* stream_onusr1: SIGUSR1 handler of stream */
+static void
+stream_onusr1(int sig)
+{
+	(void)sig;
+	gotusr1 = 1;
+}
+
+/* stream_addword: add word to lv after the last npref words
+ *
+ * Returns -1 on error.
+ */
+static int
+stream_addword(struct live *lv, const char *word)
+{
+	struct mrkvstate *state;
+	const size_t npref = lv->mrkvtab->npref;
+	const char *str;
+	size_t nmemb, nstate, maxsuf;
+	uint32_t id;
+
+	if ((str = strdup(word)) == NULL)
+		return (-1);
+	nmemb = lv->strtab->nmemb;
+	if (strt_addstr(lv->strtab, &str, &id) == -1) {
+		free((void *)str);
+		return (-1);
+	}
+	if (lv->strtab->nmemb > nmemb)
+		lv->bytes += stream_strbytes(str);
+
+	if (lv->nword == npref) {
+		nstate = lv->mrkvtab->nmemb;
+		if ((state = mrkv_lookup(lv->mrkvtab, lv->pref, 1)) == NULL)
+			return (-1);
+		if (lv->mrkvtab->nmemb > nstate)
+			lv->bytes += stream_statebytes(lv, state);
+		/* Merging the duplicates keeps suf from growing with every
+		 * word, like freezing would. */
+		if (state->nsuf == state->maxsuf)
+			stream_freeze(lv, state);
+		if (state->total >= UINT32_MAX)
+			stream_halve(lv, state);
+		maxsuf = state->maxsuf;
+		if (mrkv_sufadd(state, id, 1) == -1)
+			return (-1);
+		lv->bytes += (state->maxsuf - maxsuf) * sizeof(*state->suf);
+		state->used = 1;
+		memmove(lv->pref, lv->pref + 1,
+		    (npref - 1) * sizeof(*lv->pref));
+		lv->pref[npref - 1] = id;
+	} else {
+		lv->pref[lv->nword++] = id;
+	}
+	return (stream_evict(lv));
+}
+
+/* stream_evict: evict states from lv until it's under lv->maxbytes
+ * A clock hand goes around the buckets, evicting the states that weren't
+ * trained since it last passed them, so the rarest states go first. Strings no
+ * state refers to anymore are removed each time the hand has gone all the way
+ * around.
+ *
+ * Returns -1 on error.
+ */
+static int
+stream_evict(struct live *lv)
+{
+	struct mrkvtable *tab = lv->mrkvtab;
+	struct mrkvstate *sp;
+	uint32_t i, *ip;
+
+	while (lv->bytes > lv->maxbytes && tab->nmemb > 0) {
+		for (ip = &tab->tab[lv->hand]; (i = *ip) != NOSTATE;) {
+			sp = mrkv_state(tab, i);
+			if (sp->used) {
+				sp->used = 0;
+				ip = &sp->next;
+				continue;
+			}
+			*ip = sp->next;
+			lv->bytes -= stream_statebytes(lv, sp);
+			mrkv_statefree(tab, i);
+			tab->nmemb--;
+		}
+		if (++lv->hand == tab->bufnmemb) {
+			lv->hand = 0;
+			if (stream_collect(lv) == -1)
+				return (-1);
+		}
+	}
+	return (0);
+}
+
+/* stream_collect: remove the strings of lv that no state or prefix refers to
+ *
+ * Returns -1 on error.
+ */
+static int
+stream_collect(struct live *lv)
+{
+	struct strtable *strtab = lv->strtab;
+	const struct mrkvtable *tab = lv->mrkvtab;
+	const struct mrkvstate *sp;
+	char *mark;
+	size_t i, j, nid;
+	uint32_t k;
+	int ret = -1;
+
+	nid = strtab->nmemb + strtab->freeids.n;
+	if ((mark = calloc(MAX(nid, 1), sizeof(*mark))) == NULL)
+		return (-1);
+	for (i = 0; i < tab->bufnmemb; i++) {
+		for (k = tab->tab[i]; k != NOSTATE; k = sp->next) {
+			sp = mrkv_state(tab, k);
+			for (j = 0; j < tab->npref; j++)
+				mark[sp->pref[j]] = 1;
+			for (j = 0; j < sp->nsuf; j++)
+				mark[sp->suf[j].word] = 1;
+		}
+	}
+	for (i = 0; i < lv->nword; i++)
+		mark[lv->pref[i]] = 1;
+	for (i = 0; i < nid; i++) {
+		if (mark[i] || strtab->strs[i] == NULL)
+			continue;
+		lv->bytes -= stream_strbytes(strtab->strs[i]);
+		if (strt_remove(strtab, i) == -1)
+			goto end;
+	}
+	ret = 0;
+end:
+	free(mark);
+	return (ret);
+}
+
+/* stream_freeze: mrkv_statefreeze state, keeping lv->bytes up to date */
+static void
+stream_freeze(struct live *lv, struct mrkvstate *state)
+{
+	lv->bytes -= stream_statebytes(lv, state);
+	mrkv_statefreeze(state);
+	lv->bytes += stream_statebytes(lv, state);
+}
+
+/* stream_halve: halve the counts of state's suffixes, rounding up */
+static void
+stream_halve(struct live *lv, struct mrkvstate *state)
+{
+	size_t i;
+
+	stream_freeze(lv, state);
+	mrkv_statethaw(state);
+	for (i = state->total = 0; i < state->nsuf; i++) {
+		state->suf[i].count = (state->suf[i].count + 1) / 2;
+		state->total += state->suf[i].count;
+	}
+}
+
+/* stream_emit: generate cflag words from lv to stdout
+ *
+ * Returns -1 on error.
+ */
+static int
+stream_emit(struct live *lv, struct rng *rng)
+{
+	struct outbuf ob;
+	int ret = -1;
+
+	if (outbuf_init(&ob, STDOUT_FILENO, OUTBUFSIZE) == -1)
+		return (-1);
+	if (stream_generate(lv, rng, &ob, cflag) == -1)
+		goto end;
+	if (outbuf_flush(&ob) == -1)
+		goto end;
+	ret = 0;
+end:
+	outbuf_free(&ob);
+	return (ret);
+}
+
+/* stream_generate: append count words from lv's tables to ob, like generate
+ * The first state is drawn by stream_start, and so is a new one whenever the
+ * prefix was evicted or has no suffixes, until count words are out. The states
+ * that are used are frozen.
+ *
+ * Returns -1 on error.
+ */
+static int
+stream_generate(struct live *lv, struct rng *rng, struct outbuf *ob,
+    long count)
+{
+	const struct mrkvtable *tab = lv->mrkvtab;
+	const char **strs = lv->strtab->strs;
+	struct mrkvstate *sp;
+	uint32_t pref[MAXNPREF];
+	const size_t npref = tab->npref;
+	size_t i, k, r, lo, hi, mid;
+
+	if (tab->nmemb == 0)
+		return (0);
+	for (i = 0; i < (size_t)count;) {
+		/* Evicted prefixes, and the one at the end of the input, have
+		 * no suffixes to go on with.
+		 */
+		if (i == 0 || (sp = mrkv_lookup(lv->mrkvtab, pref, 0)) ==
+		    NULL || sp->nsuf == 0) {
+			stream_start(lv, rng, pref);
+			for (k = 0; k < npref && i < (size_t)count; k++, i++)
+				if (outbuf_addword(ob, strs[pref[k]],
+				    strlen(strs[pref[k]])) == -1)
+					return (-1);
+			continue;
+		}
+		stream_freeze(lv, sp);
+		r = rng_uniform(rng, sp->total);
+		/* Find the first suffix whose cumulative count is above r. */
+		for (lo = 0, hi = sp->nsuf - 1; lo < hi;) {
+			mid = lo + (hi - lo) / 2;
+			if (sp->suf[mid].count > r)
+				hi = mid;
+			else
+				lo = mid + 1;
+		}
+		memmove(pref, pref + 1, (npref - 1) * sizeof(*pref));
+		pref[npref - 1] = sp->suf[lo].word;
+		if (outbuf_addword(ob, strs[pref[npref - 1]],
+		    strlen(strs[pref[npref - 1]])) == -1)
+			return (-1);
+		i++;
+	}
+	return (0);
+}
+
+/* stream_start: set pref to the prefix of a random state of lv's table, which
+ * mustn't be empty
+ * The state is drawn from a random bucket, so states in short chains are a bit
+ * likelier to be drawn.
+ */
+static void
+stream_start(const struct live *lv, struct rng *rng, uint32_t pref[])
+{
+	const struct mrkvtable *tab = lv->mrkvtab;
+	const struct mrkvstate *sp = NULL;
+	size_t n, b;
+	uint32_t j;
+
+	do
+		b = rng_uniform(rng, MIN(tab->bufnmemb, UINT32_MAX));
+	while (tab->tab[b] == NOSTATE);
+	for (n = 0, j = tab->tab[b]; j != NOSTATE; j = sp->next, n++)
+		sp = mrkv_state(tab, j);
+	for (n = rng_uniform(rng, n), j = tab->tab[b];; n--) {
+		sp = mrkv_state(tab, j);
+		if (n == 0)
+			break;
+		j = sp->next;
+	}
+	memcpy(pref, sp->pref, tab->npref * sizeof(*pref));
+}
+
+/* stream_strbytes: approximate size of str in a struct strtable */
+static size_t
+stream_strbytes(const char *str)
+{
+	return (sizeof(struct strlist) + sizeof(str) + strlen(str) + 1);
+}
+
+/* stream_statebytes: approximate size of state in lv's struct mrkvtable */
+static size_t
+stream_statebytes(const struct live *lv, const struct mrkvstate *state)
+{
+	return (lv->mrkvtab->stride + sizeof(*lv->mrkvtab->tab) +
+	    (state->suf != &state->onesuf ? state->maxsuf *
+	    sizeof(*state->suf) : 0));
+}
+
+/* readword: read word from FILE stream, skipping a whitespace prefix
+ * The returned pointer to the word can be free()d.
+ *
+ * Return NULL if EOF with no data read.
+ * Return NULL on error, with some data lost.
+ */
+static const char *
+readword(FILE *input)
+{
+	char *str;
+	const size_t bufsz = MAXWORDLEN;
+	int c;
+	size_t i;
+	if ((str = malloc(bufsz)) == NULL)
+		goto err;
+	if (skipspace(input) != 0)
+		goto err;
+	for (i = 0; i < bufsz - 1; i++) {
+		if ((c = fgetc(input)) == EOF) {
+			if (ferror(input))
+				goto err;
+			else if (feof(input))
+				break;
+		}
+		if (isspace(c)) {
+			if (ungetc(c, input) == EOF)
+				goto err;
+			break;
+		}
+		str[i] = c;
+	}
+	str[i] = '\0';
+	return (str);
+err:
+	free(str);
+	return (NULL);
+}
+
+/* skipspace: skip whitespace in input
+ * Return last character read if it can't be ungetc'd
+ * Return 0 on success
+ * Return EOF on error or EOF
+ */
+static int
+skipspace(FILE *input)
+{
+	int c;
+	while ((c = fgetc(input)) != EOF)
+		if (!isspace(c))
+			return (ungetc(c, input) == c ? 0 : c);
+	return (EOF);
+}
+
+/* strt_lookup: look up str in table
+ * If create is true, create the hash table entry if it's not found, with the
+ * next id.
+ * str becomes property of this function if a new list is created. A new list
+ * was created if the returned list's str member is equal to the str argument of
+ * this function in a pointer comparison.
+ * Returns NULL if the entry is not found.
+ * Returns NULL if create is true and creation fails, with errno set to
+ * EOVERFLOW if the table ran out of ids. */
+static struct strlist *
+strt_lookup(struct strtable *table, const char *str, int create)
+{
+	struct strlist *listp;
+	strt_hash hash;
+	size_t b;
+	hash = strt_hashstr(str);
+	b = hash & (table->bufnmemb - 1);
+
+	for (listp = table->tab[b]; listp != NULL; listp = listp->next)
+		if (listp->hash == hash && strcmp(str, listp->str) == 0)
+			goto end;
+	if (create) {
+		if (table->freeids.n == 0 && table->nmemb == table->maxstrs &&
+		    strt_growstrs(table, table->maxstrs * 2) == -1)
+			goto end;
+		if ((listp = strl_new(NULL, str)) == NULL)
+			goto end;
+		listp->id = table->freeids.n > 0 ?
+		    table->freeids.w[--table->freeids.n] : table->nmemb;
+		table->strs[listp->id] = str;
+		listp->hash = hash;
+		listp->next = table->tab[b];
+		table->tab[b] = listp;
+		table->nmemb++;
+		/* If the table can't grow, its chains just get longer. */
+		if (table->nmemb > table->bufnmemb * MAXLOAD)
+			strt_resize(table, table->bufnmemb * 2);
+	}
+end:
+	return (listp);
+}
+
+/* strt_addstr: add single string to strtab, set id to its id
+ * The pointer to the string may change, the string is the strtab's property
+ * unless there's an error.
+ *
+ * Returns -1 on error.
+ */
+static int
+strt_addstr(struct strtable *strtab, const char **str, uint32_t *id)
+{
+	struct strlist *sp;
+	int ret = -1;
+	if ((sp = strt_lookup(strtab, *str, 1)) == NULL)
+		goto end;
+	if (sp->str != *str) {
+		free((void *)*str);
+		*str = sp->str;
+	}
+	*id = sp->id;
+	ret = 0;
+end:
+	return (ret);
+}
+
+/* strt_remove: remove the string with id from table, and free it
+ * Its id goes to the next string added.
+ *
+ * Returns -1 on error.
+ */
+static int
+strt_remove(struct strtable *table, uint32_t id)
+{
+	struct strlist *lp, **lpp;
+
+	if (wordvec_add(&table->freeids, id) == -1)
+		return (-1);
+	lpp = &table->tab[strt_hashstr(table->strs[id]) &
+	    (table->bufnmemb - 1)];
+	while ((lp = *lpp)->id != id)
+		lpp = &lp->next;
+	*lpp = lp->next;
+	lp->next = NULL;
+	strl_free(lp);
+	table->strs[id] = NULL;
+	table->nmemb--;
+	return (0);
+}
+
+/* strt_new: allocate a struct strtable with room for about nmemb strings.
+ * The table grows as needed, nmemb can be 0.
+ * If table isn't null, use the buffer it points to, otherwise allocate it.
+ * The buffer's contents are undefined on failure. */
+static struct strtable *
+strt_new(struct strtable *table, size_t nmemb)
+{
+	struct strtable *alloc = NULL;
+	if (table == NULL)
+		if ((alloc = table = malloc(sizeof(*table))) == NULL)
+			return (NULL);
+	table->nmemb = 0;
+	table->freeids = (struct wordvec){0};
+	table->bufnmemb = pow2(MAX(nmemb / MAXLOAD, STRTABLEBUFNMEMB));
+	table->maxstrs = table->bufnmemb;
+	table->strs = NULL;
+	if ((table->tab = calloc(table->bufnmemb, sizeof(*table->tab))) == NULL)
+		goto err;
+	if ((table->strs = calloc(table->maxstrs, sizeof(*table->strs)))
+	    == NULL)
+		goto err;
+	return (table);
+err:
 	free(table->tab);
 	if (alloc != NULL)
 		free(table);
 	return (NULL);
 }
 
+/* strt_resize: move table's strings into bufnmemb buckets
+ * bufnmemb must be a power of 2. The table never shrinks.
+ *
+ * Returns -1 on malloc error, the table is left as it was.
+ */
+static int
+strt_resize(struct strtable *table, size_t bufnmemb)
+{
+	struct strlist **tab;
+	struct strlist *listp, *next;
+	size_t i, b;
+
+	if (bufnmemb <= table->bufnmemb)
+		return (0);
+	if ((tab = calloc(bufnmemb, sizeof(*tab))) == NULL)
+		return (-1);
+	for (i = 0; i < table->bufnmemb; i++) {
+		for (listp = table->tab[i]; listp != NULL; listp = next) {
+			next = listp->next;
+			b = listp->hash & (bufnmemb - 1);
+			listp->next = tab[b];
+			tab[b] = listp;
+		}
+	}
+	free(table->tab);
+	table->tab = tab;
+	table->bufnmemb = bufnmemb;
+	return (0);
+}
+
+/* strt_growstrs: make room for maxstrs ids in table
+ *
+ * Returns -1 on error, with errno set to EOVERFLOW if maxstrs is more ids than
+ * there are.
+ */
+static int
+strt_growstrs(struct strtable *table, size_t maxstrs)
+{
+	void *tp;
+
+	if (maxstrs <= table->maxstrs)
+		return (0);
+	if (maxstrs > NOID) {
+		if (table->maxstrs == NOID) {
+			errno = EOVERFLOW;
+			return (-1);
+		}
+		maxstrs = NOID;
+	}
+	if ((tp = reallocarray(table->strs, maxstrs, sizeof(*table->strs)))
+	    == NULL)
+		return (-1);
+	table->strs = tp;
+	table->maxstrs = maxstrs;
+	return (0);
+}
+
+/* strt_stats: print the chain lengths and the memory use of table to stderr */
+static void
+strt_stats(const struct strtable *table)
+{
+	size_t hist[CHAINHIST] = {0};
+	const struct strlist *listp;
+	size_t i, len, maxlen, bytes;
+
+	bytes = table->bufnmemb * sizeof(*table->tab) +
+	    table->maxstrs * sizeof(*table->strs);
+	for (i = maxlen = 0; i < table->bufnmemb; i++) {
+		for (len = 0, listp = table->tab[i]; listp != NULL;
+		    listp = listp->next) {
+			bytes += sizeof(*listp) + strlen(listp->str) + 1;
+			len++;
+		}
+		hist[MIN(len, CHAINHIST - 1)]++;
+		maxlen = MAX(maxlen, len);
+	}
+	printchains("strings", table->nmemb, table->bufnmemb, hist, maxlen);
+	fprintf(stderr, "strings: %zu bytes, %.1f per string\n", bytes,
+	    (double)bytes / MAX(table->nmemb, 1));
+}
+
 /* strt_free: free table and all of its contents
  * Also accepts a NULL pointer.
  */
@@ -400,6 +2240,8 @@ strt_free(struct strtable *table)
 	for (i = 0; i < table->bufnmemb; i++)
 		strl_free(table->tab[i]);
 	free(table->tab);
+	free(table->strs);
+	free(table->freeids.w);
 	free(table);
 }
 
@@ -432,28 +2274,67 @@ strl_free(struct strlist *list)
 	}
 }
 
-/* strt_hashstr: hash str for table */
+/* strt_hashstr: hash str, the bucket is the hash modulo the table's size */
 static strt_hash
-strt_hashstr(const struct strtable *table, const char *str)
+strt_hashstr(const char *str)
 {
 	strt_hash hash;
 	for (hash = 0; *str != '\0'; str++)
-		hash *= hash * (unsigned int)OPTMULT + *str;
-	return (hash % table->bufnmemb);
+		hash = hash * OPTMULT + (unsigned char)*str;
+	return (hash);
+}
+
+/* wordvec_add: append id to vec
+ *
+ * Returns -1 on malloc error.
+ */
+static int
+wordvec_add(struct wordvec *vec, uint32_t id)
+{
+	void *tp;
+	size_t max;
+
+	if (vec->n == vec->max) {
+		max = vec->max == 0 ? BUFSIZ : vec->max * 2;
+		if ((tp = reallocarray(vec->w, max, sizeof(*vec->w))) == NULL)
+			return (-1);
+		vec->w = tp;
+		vec->max = max;
+	}
+	vec->w[vec->n++] = id;
+	return (0);
 }
 
-/* mrkv_tablenew: malloc new mrkvtable */
+/* mrkv_tablenew: malloc new mrkvtable of npref word prefixes with room for
+ * about nmemb states
+ * The table grows as needed, nmemb can be 0.
+ */
 static struct mrkvtable *
-mrkv_tablenew(void)
+mrkv_tablenew(size_t nmemb, size_t npref)
 {
 	struct mrkvtable *table;
+	size_t i;
 	if ((table = malloc(sizeof(*table))) == NULL)
 		goto err;
-	table->bufnmemb = MRKVTABLEBUFNMEMB;
+	table->bufnmemb = pow2(MAX(nmemb / MAXLOAD, MRKVTABLEBUFNMEMB));
 	table->nmemb = 0;
-	table->npref = NPREF;
-	if ((table->tab = calloc(table->bufnmemb, sizeof(*table->tab))) == NULL)
+	table->npref = npref;
+	table->slabs = NULL;
+	table->nslab = table->maxslab = 0;
+	/* Keep every state's suf pointer aligned. */
+	table->stride = ALIGN(sizeof(struct mrkvstate) + npref *
+	    sizeof(uint32_t), sizeof(struct mrkvsuffix *));
+	table->cur = (struct slabcursor){0, 0};
+	table->freelist = NOSTATE;
+	if ((table->tab = reallocarray(NULL, table->bufnmemb,
+	    sizeof(*table->tab))) == NULL)
+		goto err;
+	for (i = 0; i < table->bufnmemb; i++)
+		table->tab[i] = NOSTATE;
+	if ((errno = pthread_mutex_init(&table->lock, NULL)) != 0) {
+		free(table->tab);
 		goto err;
+	}
 
 	return (table);
 err:
@@ -461,102 +2342,376 @@ err:
 	return (NULL);
 }
 
+/* mrkv_resize: move table's states into bufnmemb buckets
+ * bufnmemb must be a power of 2. The table never shrinks.
+ *
+ * Returns -1 on malloc error, the table is left as it was.
+ */
+static int
+mrkv_resize(struct mrkvtable *table, size_t bufnmemb)
+{
+	struct mrkvstate *sp;
+	uint32_t *tab;
+	uint32_t j, next;
+	size_t i, b;
+
+	if (bufnmemb <= table->bufnmemb)
+		return (0);
+	if ((tab = reallocarray(NULL, bufnmemb, sizeof(*tab))) == NULL)
+		return (-1);
+	for (i = 0; i < bufnmemb; i++)
+		tab[i] = NOSTATE;
+	for (i = 0; i < table->bufnmemb; i++) {
+		for (j = table->tab[i]; j != NOSTATE; j = next) {
+			sp = mrkv_state(table, j);
+			next = sp->next;
+			b = sp->hash & (bufnmemb - 1);
+			sp->next = tab[b];
+			tab[b] = j;
+		}
+	}
+	free(table->tab);
+	table->tab = tab;
+	table->bufnmemb = bufnmemb;
+	return (0);
+}
+
+/* mrkv_stats: print the chain lengths and the memory use of table to stderr
+ * Suffixes kept in their state are counted as part of the state.
+ */
+static void
+mrkv_stats(const struct mrkvtable *table)
+{
+	size_t hist[CHAINHIST] = {0};
+	const struct mrkvstate *sp;
+	size_t i, len, maxlen, nsuf, nsufout, statebytes, sufbytes;
+	uint32_t j;
+
+	nsuf = nsufout = sufbytes = 0;
+	for (i = maxlen = 0; i < table->bufnmemb; i++) {
+		for (len = 0, j = table->tab[i]; j != NOSTATE; j = sp->next) {
+			sp = mrkv_state(table, j);
+			nsuf += sp->nsuf;
+			if (sp->suf != &sp->onesuf) {
+				nsufout += sp->nsuf;
+				sufbytes += sp->maxsuf * sizeof(*sp->suf);
+			}
+			len++;
+		}
+		hist[MIN(len, CHAINHIST - 1)]++;
+		maxlen = MAX(maxlen, len);
+	}
+	printchains("states", table->nmemb, table->bufnmemb, hist, maxlen);
+	statebytes = table->nslab * SLABNMEMB * table->stride +
+	    table->bufnmemb * sizeof(*table->tab);
+	fprintf(stderr, "states: %zu bytes in slabs and buckets, %.1f per "
+	    "state\n", statebytes, (double)statebytes / MAX(table->nmemb, 1));
+	fprintf(stderr, "suffixes: %zu, %zu in %zu bytes outside of their "
+	    "state, %.1f per suffix\n", nsuf, nsufout, sufbytes,
+	    (double)sufbytes / MAX(nsufout, 1));
+}
+
 /* mrkv_tablefree: free mrkv_table
  * table can be NULL
  */
 static void
 mrkv_tablefree(struct mrkvtable *table)
 {
-	struct mrkvstate **tabp;
+	struct mrkvstate *sp;
 	size_t i;
+	uint32_t j;
 	if (table == NULL)
 		return;
-	for (i = 0, tabp = table->tab; i < table->nmemb; i++, tabp++)
-		mrkv_statefree(*tabp);
+	for (i = 0; i < table->bufnmemb; i++) {
+		for (j = table->tab[i]; j != NOSTATE; j = sp->next) {
+			sp = mrkv_state(table, j);
+			mrkv_suffree(sp);
+		}
+	}
+	for (i = 0; i < table->nslab; i++)
+		free(table->slabs[i]);
+	free(table->slabs);
 	free(table->tab);
+	pthread_mutex_destroy(&table->lock);
 	free(table);
 }
 
-/* mrkv_suffixnew: new suffix for markov chain holding word */
-static struct mrkvsuffix *
-mrkv_suffixnew(const char *word)
+/* mrkv_tablefreeze: freeze every state in table, see mrkv_statefreeze */
+static void
+mrkv_tablefreeze(struct mrkvtable *table)
 {
-	struct mrkvsuffix *suf;
-	if ((suf = malloc(sizeof(*suf))) == NULL)
-		return (NULL);
-	suf->word = word;
-	suf->next = NULL;
-	return (suf);
+	struct mrkvstate *sp;
+	size_t i;
+	uint32_t j;
+	for (i = 0; i < table->bufnmemb; i++) {
+		for (j = table->tab[i]; j != NOSTATE; j = sp->next) {
+			sp = mrkv_state(table, j);
+			mrkv_statefreeze(sp);
+		}
+	}
 }
 
-/* mrkv_sufadd: add word to state's list of suffixes
+/* mrkv_sufadd: add count occurrences of word to state's suffixes
+ * Consecutive repeats of a word are counted in place, other duplicates are
+ * merged when the state is frozen.
  *
- * Returns -1 on error.
+ * Returns -1 on error, with EOVERFLOW if the total count wouldn't fit in 32
+ * bits.
  */
 static int
-mrkv_sufadd(struct mrkvstate *state, const char *word)
+mrkv_sufadd(struct mrkvstate *state, uint32_t word, uint32_t count)
 {
-	struct mrkvsuffix *suffix;
-	if ((suffix = mrkv_suffixnew(word)) == NULL)
+	struct mrkvsuffix *last, *tp;
+
+	if (count > UINT32_MAX - state->total) {
+		errno = EOVERFLOW;
 		return (-1);
-	suffix->next = state->suf;
-	state->suf = suffix;
+	}
+	/* Undo the cumulative counts, we're about to append. */
+	mrkv_statethaw(state);
+	last = state->nsuf > 0 ? &state->suf[state->nsuf - 1] : NULL;
+	if (last != NULL && last->word == word) {
+		last->count += count;
+	} else {
+		if (state->nsuf == state->maxsuf) {
+			if (state->maxsuf > UINT32_MAX / 2) {
+				errno = EOVERFLOW;
+				return (-1);
+			}
+			if (state->suf == &state->onesuf) {
+				if ((tp = reallocarray(NULL, state->maxsuf * 2,
+				    sizeof(*tp))) == NULL)
+					return (-1);
+				tp[0] = state->onesuf;
+			} else if ((tp = reallocarray(state->suf,
+			    state->maxsuf * 2, sizeof(*tp))) == NULL) {
+				return (-1);
+			}
+			state->suf = tp;
+			state->maxsuf *= 2;
+		}
+		state->suf[state->nsuf].word = word;
+		state->suf[state->nsuf].count = count;
+		state->nsuf++;
+	}
+	state->total += count;
+	return (0);
+}
+
+/* mrkv_statecmp: qsort comparison function for pointers to struct mrkvstate
+ * Orders by the prefixes' ids, statecmp_npref of them.
+ */
+static int
+mrkv_statecmp(const void *a, const void *b)
+{
+	const struct mrkvstate *sa = *(const struct mrkvstate **)a;
+	const struct mrkvstate *sb = *(const struct mrkvstate **)b;
+	size_t i;
+
+	for (i = 0; i < statecmp_npref; i++)
+		if (sa->pref[i] != sb->pref[i])
+			return (sa->pref[i] < sb->pref[i] ? -1 : 1);
 	return (0);
 }
 
-/* mrkv_suffixfree: free markov suffix
- * suf can be NULL.
+/* mrkv_sufcmp: qsort comparison function for struct mrkvsuffix */
+static int
+mrkv_sufcmp(const void *a, const void *b)
+{
+	const struct mrkvsuffix *sa = a, *sb = b;
+	return (sa->word < sb->word ? -1 : sa->word > sb->word);
+}
+
+/* mrkv_statefreeze: make state ready for model_compile
+ * Sorts and merges duplicate suffixes, then makes the counts cumulative.
+ * Freezing a frozen state does nothing, and the state can keep being trained
+ * afterwards at the cost of another freeze.
  */
 static void
-mrkv_suffixfree(struct mrkvsuffix *suf)
+mrkv_statefreeze(struct mrkvstate *state)
 {
-	struct mrkvsuffix *next;
-	while (suf != NULL) {
-		next = suf->next;
-		free(suf);
-		suf = next;
+	size_t i, j;
+	void *tp;
+
+	if (state->frozen || state->nsuf == 0)
+		return;
+	qsort(state->suf, state->nsuf, sizeof(*state->suf), mrkv_sufcmp);
+	for (i = 0, j = 1; j < state->nsuf; j++) {
+		if (state->suf[j].word == state->suf[i].word)
+			state->suf[i].count += state->suf[j].count;
+		else
+			state->suf[++i] = state->suf[j];
 	}
+	state->nsuf = i + 1;
+	for (i = 1; i < state->nsuf; i++)
+		state->suf[i].count += state->suf[i - 1].count;
+	if (state->suf == &state->onesuf) {
+		/* Already as small as it gets. */
+	} else if (state->nsuf == 1) {
+		state->onesuf = state->suf[0];
+		free(state->suf);
+		state->suf = &state->onesuf;
+		state->maxsuf = 1;
+	} else if ((tp = reallocarray(state->suf, state->nsuf,
+	    sizeof(*state->suf))) != NULL) {
+		/* Shrinking can't really fail, and if it does suf is still
+		 * good. */
+		state->suf = tp;
+		state->maxsuf = state->nsuf;
+	}
+	state->frozen = 1;
 }
 
-/* mrkv_statenew: new markov state */
-static struct mrkvstate *
-mrkv_statenew(const char *pref[])
+/* mrkv_statethaw: undo the cumulative counts of a frozen state */
+static void
+mrkv_statethaw(struct mrkvstate *state)
+{
+	size_t i;
+
+	if (!state->frozen)
+		return;
+	for (i = state->nsuf - 1; i > 0; i--)
+		state->suf[i].count -= state->suf[i - 1].count;
+	state->frozen = 0;
+}
+
+/* mrkv_statenew: new markov state of tab's npref word prefix pref
+ * The state is taken from tab's freed states, or else from cur, which gets a
+ * new slab when it runs out. Only states from cur can be added by several
+ * threads at once.
+ *
+ * Returns the state's index, or NOSTATE on error.
+ */
+static uint32_t
+mrkv_statenew(struct mrkvtable *tab, struct slabcursor *cur,
+    const uint32_t *pref)
 {
 	struct mrkvstate *state;
-	if ((state = malloc((sizeof(*state)))) == NULL)
-		return (NULL);
-	memcpy(state->pref, pref, sizeof(state->pref));
-	state->next = NULL;
-	state->suf = NULL;
-	return (state);
+	uint32_t i;
+
+	if (tab->freelist != NOSTATE) {
+		i = tab->freelist;
+		tab->freelist = mrkv_state(tab, i)->next;
+	} else {
+		if (cur->next == cur->end && mrkv_slabnew(tab, cur) == -1)
+			return (NOSTATE);
+		i = cur->next++;
+	}
+	state = mrkv_state(tab, i);
+	memcpy(state->pref, pref, tab->npref * sizeof(*pref));
+	state->next = NOSTATE;
+	state->suf = &state->onesuf;
+	state->nsuf = 0;
+	state->maxsuf = 1;
+	state->total = 0;
+	state->frozen = 0;
+	state->used = 0;
+	return (i);
 }
 
-/* mrkv_statefree: free struct mrkvstate
- * state can be NULL
+/* mrkv_statefree: free tab's state i, which must not be in a bucket
+ * Its slot goes to the next new state.
  */
 static void
-mrkv_statefree(struct mrkvstate *state)
+mrkv_statefree(struct mrkvtable *tab, uint32_t i)
+{
+	struct mrkvstate *state = mrkv_state(tab, i);
+	mrkv_suffree(state);
+	state->next = tab->freelist;
+	tab->freelist = i;
+}
+
+/* mrkv_suffree: free state's suffixes, leaving it with none */
+static void
+mrkv_suffree(struct mrkvstate *state)
+{
+	if (state->suf != &state->onesuf)
+		free(state->suf);
+	state->suf = &state->onesuf;
+	state->nsuf = 0;
+	state->maxsuf = 1;
+	state->total = 0;
+}
+
+/* mrkv_state: get the state with index i in tab */
+static struct mrkvstate *
+mrkv_state(const struct mrkvtable *tab, uint32_t i)
+{
+	return ((struct mrkvstate *)(tab->slabs[i / SLABNMEMB] +
+	    i % SLABNMEMB * tab->stride));
+}
+
+/* mrkv_slabnew: add a slab to tab and point cur to its states
+ * Several threads can add slabs at once as long as slabs doesn't need to grow,
+ * see mrkv_reserve.
+ *
+ * Returns -1 on error.
+ */
+static int
+mrkv_slabnew(struct mrkvtable *tab, struct slabcursor *cur)
 {
-	struct mrkvstate *next;
-	while (state != NULL) {
-		next = state->next;
-		mrkv_suffixfree(state->suf);
-		free(state);
-		state = next;
+	char *slab;
+	int ret = -1;
+
+	if ((slab = reallocarray(NULL, SLABNMEMB, tab->stride)) == NULL)
+		return (-1);
+	if ((errno = pthread_mutex_lock(&tab->lock)) != 0) {
+		free(slab);
+		return (-1);
+	}
+	/* NOSTATE must never be an index. */
+	if (tab->nslab >= NOSTATE / SLABNMEMB) {
+		errno = EOVERFLOW;
+		goto end;
 	}
+	if (tab->nslab == tab->maxslab && mrkv_reserve(tab, SLABNMEMB) == -1)
+		goto end;
+	tab->slabs[tab->nslab] = slab;
+	cur->next = tab->nslab * SLABNMEMB;
+	cur->end = cur->next + SLABNMEMB;
+	tab->nslab++;
+	slab = NULL;
+	ret = 0;
+end:
+	pthread_mutex_unlock(&tab->lock);
+	free(slab);
+	return (ret);
+}
+
+/* mrkv_reserve: make room in tab's array of slabs for nmemb more states
+ *
+ * Returns -1 on error.
+ */
+static int
+mrkv_reserve(struct mrkvtable *tab, size_t nmemb)
+{
+	size_t maxslab;
+	void *tp;
+
+	maxslab = tab->nslab + (nmemb + SLABNMEMB - 1) / SLABNMEMB;
+	if (maxslab <= tab->maxslab)
+		return (0);
+	maxslab = MAX(maxslab, tab->maxslab * 2);
+	if ((tp = reallocarray(tab->slabs, maxslab, sizeof(*tab->slabs)))
+	    == NULL)
+		return (-1);
+	tab->slabs = tp;
+	tab->maxslab = maxslab;
+	return (0);
 }
 
-/* mrkv_hashstate: hash markov prefix */
+/* mrkv_hashstate: hash markov prefix
+ * The bucket is the hash modulo the table's size.
+ */
 static mrkv_hash
-mrkv_hashstate(const struct mrkvtable *tab, const char *pref[])
+mrkv_hashstate(const struct mrkvtable *tab, const uint32_t *pref)
 {
 	size_t i;
-	const char *sp;
-	mrkv_hash hash = 0;
+	uint64_t hash = 0;
 	for (i = 0; i < tab->npref; i++)
-		for (sp = pref[i]; *sp != '\0'; sp++)
-			hash *= hash * (unsigned int)OPTMULT + *sp;
-	return (hash % tab->bufnmemb);
+		hash = (hash ^ pref[i]) * UINT64_C(0x9e3779b97f4a7c15);
+	/* The bucket comes from the low bits, give them the high ones. */
+	return (hash ^ hash >> 32);
 }
 
 /* mrkv_lookup: lookup prefix in mrkvtable
@@ -566,37 +2721,431 @@ mrkv_hashstate(const struct mrkvtable *tab, const char *pref[])
  * Returns NULL if create is true and fails
  */
 static struct mrkvstate *
-mrkv_lookup(struct mrkvtable *tab, const char *prefix[], int create)
+mrkv_lookup(struct mrkvtable *tab, const uint32_t *prefix, int create)
 {
 	mrkv_hash hash;
 	struct mrkvstate *sp;
-	struct mrkvstate *state;
+	size_t b;
+	uint32_t i;
 	hash = mrkv_hashstate(tab, prefix);
+	b = hash & (tab->bufnmemb - 1);
 
-	for (sp = tab->tab[hash]; sp != NULL; sp = sp->next)
-		if (mrkv_prefcmp(tab, prefix, sp->pref) == 0)
-			goto end;
+	for (i = tab->tab[b]; i != NOSTATE; i = sp->next) {
+		sp = mrkv_state(tab, i);
+		if (sp->hash == hash && mrkv_prefcmp(tab, prefix, sp->pref) == 0)
+			return (sp);
+	}
 
 	if (create) {
-		if ((state = mrkv_statenew(prefix)) == NULL)
-			goto end;
-		state->next = tab->tab[hash];
-		tab->tab[hash] = state;
-		return (state);
+		if ((i = mrkv_statenew(tab, &tab->cur, prefix)) == NOSTATE)
+			return (NULL);
+		sp = mrkv_state(tab, i);
+		sp->hash = hash;
+		sp->next = tab->tab[b];
+		tab->tab[b] = i;
+		tab->nmemb++;
+		/* If the table can't grow, its chains just get longer. */
+		if (tab->nmemb > tab->bufnmemb * MAXLOAD)
+			mrkv_resize(tab, tab->bufnmemb * 2);
+		return (sp);
+	}
+	return (NULL);
+}
+
+/* mrkv_prefcmp: memcmp an entire struct mrkvtable prefix */
+static int
+mrkv_prefcmp(const struct mrkvtable *tab, const uint32_t *apref,
+    const uint32_t *bpref)
+{
+	return (memcmp(apref, bpref, tab->npref * sizeof(*apref)));
+}
+
+/* pow2: return the smallest power of 2 that's at least n, or 1 */
+static size_t
+pow2(size_t n)
+{
+	size_t p;
+	for (p = 1; p < n; p *= 2)
+		;
+	return (p);
+}
+
+/* printchains: print the statistics of a hash table to stderr
+ * hist holds the number of chains of each length, see CHAINHIST.
+ */
+static void
+printchains(const char *name, size_t nmemb, size_t nbucket,
+    const size_t hist[], size_t maxlen)
+{
+	size_t i;
+
+	fprintf(stderr, "%s: %zu in %zu buckets, load %.2f, longest chain %zu"
+	    ", mean nonempty chain %.2f\n", name, nmemb, nbucket,
+	    (double)nmemb / nbucket, maxlen, nbucket == hist[0] ? 0.0 :
+	    (double)nmemb / (nbucket - hist[0]));
+	fprintf(stderr, "%s: chains of length", name);
+	for (i = 0; i < CHAINHIST; i++)
+		fprintf(stderr, " %zu%s: %zu", i, i == CHAINHIST - 1 ? "+" : "",
+		    hist[i]);
+	fprintf(stderr, "\n");
+}
+
+/* model_compile: build a model out of a frozen mrkvtab and its strtab
+ *
+ * Returns -1 on error, with errno set to EOVERFLOW if the chain is too big for
+ * the model format.
+ */
+static int
+model_compile(struct mrkvmodel *model, const struct mrkvtable *mrkvtab,
+    const struct strtable *strtab)
+{
+	struct mrkvhdr hdr;
+	size_t off[6];
+	const struct mrkvstate *sp, **sorted;
+	uint32_t *stroff, *bucket, *state, *sufword, *sufcum;
+	char *str;
+	size_t i, j, k;
+	size_t nsuf, strbytes, nbucket;
+	uint32_t *statep, h;
+
+	/* States are laid out sorted by prefix so that a model and the words
+	 * generated from it with a seed don't depend on the table's history. */
+	if ((sorted = reallocarray(NULL, MAX(mrkvtab->nmemb, 1),
+	    sizeof(*sorted))) == NULL)
+		return (-1);
+	nsuf = strbytes = 0;
+	for (i = j = 0; i < mrkvtab->bufnmemb; i++)
+		for (k = mrkvtab->tab[i]; k != NOSTATE; k = sp->next) {
+			sp = mrkv_state(mrkvtab, k);
+			nsuf += sp->nsuf;
+			sorted[j++] = sp;
+		}
+	statecmp_npref = mrkvtab->npref;
+	qsort(sorted, mrkvtab->nmemb, sizeof(*sorted), mrkv_statecmp);
+	for (i = 0; i < strtab->nmemb; i++)
+		strbytes += strlen(strtab->strs[i]) + 1;
+	/* Keep the load factor at or below 1/2. */
+	for (nbucket = 1; nbucket < mrkvtab->nmemb * 2; nbucket *= 2)
+		;
+	if (strtab->nmemb > UINT32_MAX || mrkvtab->nmemb >= UINT32_MAX ||
+	    nsuf > UINT32_MAX || strbytes > UINT32_MAX ||
+	    nbucket > UINT32_MAX) {
+		errno = EOVERFLOW;
+		free(sorted);
+		return (-1);
+	}
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, MODELMAGIC, sizeof(hdr.magic));
+	hdr.version = MODELVERSION;
+	hdr.byteorder = MODELBYTEORDER;
+	hdr.npref = mrkvtab->npref;
+	hdr.nstr = strtab->nmemb;
+	hdr.strbytes = strbytes;
+	hdr.nstate = mrkvtab->nmemb;
+	hdr.nsuf = nsuf;
+	hdr.nbucket = nbucket;
+
+	model->len = model_layout(&hdr, off);
+	if ((model->base = calloc(1, model->len)) == NULL) {
+		free(sorted);
+		return (-1);
+	}
+	model->mapped = 0;
+	memcpy(model->base, &hdr, sizeof(hdr));
+	model_setsections(model);
+	/* The sections are const for everyone else. */
+	stroff = (uint32_t *)model->stroff;
+	bucket = (uint32_t *)model->bucket;
+	state = (uint32_t *)model->state;
+	sufword = (uint32_t *)model->sufword;
+	sufcum = (uint32_t *)model->sufcum;
+	str = (char *)model->str;
+
+	/* Model string indices are table ids. */
+	for (i = k = 0; i < strtab->nmemb; i++) {
+		stroff[i] = k;
+		k += strlen(strcpy(str + k, strtab->strs[i])) + 1;
+	}
+
+	statep = state;
+	for (i = j = 0; i < mrkvtab->nmemb; i++) {
+		sp = sorted[i];
+		memcpy(statep, sp->pref, hdr.npref * sizeof(*statep));
+		statep[hdr.npref] = j;
+		statep[hdr.npref + 1] = sp->nsuf;
+		for (k = 0; k < sp->nsuf; k++, j++) {
+			sufword[j] = sp->suf[k].word;
+			sufcum[j] = sp->suf[k].count;
+		}
+		for (h = model_hash(model, statep); bucket[h] != 0;
+		    h = (h + 1) & (nbucket - 1))
+			;
+		bucket[h] = i + 1;
+		statep += hdr.npref + 2;
+	}
+	free(sorted);
+	return (0);
+}
+
+/* model_layout: put the offset of each section of a model into off
+ * The sections are in the order of struct mrkvmodel.
+ *
+ * Returns the size of the whole model.
+ */
+static size_t
+model_layout(const struct mrkvhdr *hdr, size_t off[])
+{
+	size_t i;
+	size_t size[6];
+	size_t len;
+
+	size[0] = (size_t)hdr->nstr * sizeof(uint32_t);
+	size[1] = (size_t)hdr->nbucket * sizeof(uint32_t);
+	size[2] = (size_t)hdr->nstate * (hdr->npref + 2) * sizeof(uint32_t);
+	size[3] = (size_t)hdr->nsuf * sizeof(uint32_t);
+	size[4] = (size_t)hdr->nsuf * sizeof(uint32_t);
+	size[5] = hdr->strbytes;
+	len = ALIGN(sizeof(*hdr), MODELALIGN);
+	for (i = 0; i < 6; i++) {
+		off[i] = len;
+		len = ALIGN(len + size[i], MODELALIGN);
 	}
+	return (len);
+}
+
+/* model_setsections: point model's sections into its base */
+static void
+model_setsections(struct mrkvmodel *model)
+{
+	size_t off[6];
+	const char *base = model->base;
+
+	model->hdr = model->base;
+	model_layout(model->hdr, off);
+	model->stroff = (const uint32_t *)(base + off[0]);
+	model->bucket = (const uint32_t *)(base + off[1]);
+	model->state = (const uint32_t *)(base + off[2]);
+	model->sufword = (const uint32_t *)(base + off[3]);
+	model->sufcum = (const uint32_t *)(base + off[4]);
+	model->str = base + off[5];
+}
+
+/* model_write: write model to the file at path
+ *
+ * Returns -1 on error.
+ */
+static int
+model_write(const struct mrkvmodel *model, const char *path)
+{
+	FILE *fp;
+	int ret = -1;
+
+	if ((fp = fopen(path, "wb")) == NULL)
+		return (-1);
+	if (fwrite(model->base, 1, model->len, fp) != model->len)
+		goto end;
+	ret = 0;
 end:
-	return (sp);
+	if (fclose(fp) == EOF)
+		ret = -1;
+	return (ret);
 }
 
-/* mrkv_prefcmp: strcmp an entire struct mrkvtable prefix */
+/* model_map: mmap the model file at path into model
+ * The file is trusted to have been written by model_write, only its header
+ * and size are checked.
+ *
+ * Returns -1 on error, with errno set to EINVAL if the file isn't a model.
+ */
 static int
-mrkv_prefcmp(const struct mrkvtable *tab, const char *apref[],
-    const char *bpref[])
+model_map(struct mrkvmodel *model, const char *path)
 {
-	int ret;
-	int i;
-	for (i = 0; i < tab->npref; i++)
-		if ((ret = strcmp(apref[i], bpref[i]) != 0))
-			return (ret);
+	struct mrkvhdr hdr;
+	size_t off[6];
+	struct stat sb;
+	void *base;
+	int fd;
+	int ret = -1;
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return (-1);
+	if (fstat(fd, &sb) == -1)
+		goto end;
+	if (sb.st_size < (off_t)sizeof(hdr) || pread(fd, &hdr, sizeof(hdr), 0)
+	    != sizeof(hdr))
+		goto inval;
+	if (memcmp(hdr.magic, MODELMAGIC, sizeof(hdr.magic)) != 0 ||
+	    hdr.version != MODELVERSION || hdr.byteorder != MODELBYTEORDER ||
+	    hdr.npref == 0 || model_layout(&hdr, off) != (size_t)sb.st_size)
+		goto inval;
+	if ((base = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0))
+	    == MAP_FAILED)
+		goto end;
+	model->base = base;
+	model->len = sb.st_size;
+	model->mapped = 1;
+	model_setsections(model);
+	ret = 0;
+	goto end;
+inval:
+	errno = EINVAL;
+end:
+	close(fd);
+	return (ret);
+}
+
+/* model_free: free or unmap model's resources, doesn't free model
+ * Also accepts a zeroed model.
+ */
+static void
+model_free(struct mrkvmodel *model)
+{
+	if (model->mapped)
+		munmap(model->base, model->len);
+	else
+		free(model->base);
+	model->base = NULL;
+	free(model->strbucket);
+	model->strbucket = NULL;
+}
+
+/* model_hash: hash a prefix of npref string indices into a bucket index */
+static uint32_t
+model_hash(const struct mrkvmodel *model, const uint32_t *pref)
+{
+	uint64_t hash;
+	size_t i;
+	for (hash = 0, i = 0; i < model->hdr->npref; i++)
+		hash = (hash ^ pref[i]) * UINT64_C(0x9e3779b97f4a7c15);
+	return ((hash >> 32) & (model->hdr->nbucket - 1));
+}
+
+/* model_lookup: lookup prefix in model
+ *
+ * Returns the state, or NULL if the state is not found.
+ */
+static const uint32_t *
+model_lookup(const struct mrkvmodel *model, const uint32_t *pref)
+{
+	const uint32_t *state;
+	const size_t npref = model->hdr->npref;
+	uint32_t h;
+
+	for (h = model_hash(model, pref); model->bucket[h] != 0;
+	    h = (h + 1) & (model->hdr->nbucket - 1)) {
+		state = model->state + (model->bucket[h] - 1) * (npref + 2);
+		if (memcmp(state, pref, npref * sizeof(*pref)) == 0)
+			return (state);
+	}
+	return (NULL);
+}
+
+/* model_prefixrand: set pref to the prefix of a state of model drawn from rng
+ * model must have at least one state.
+ */
+static void
+model_prefixrand(const struct mrkvmodel *model, struct rng *rng,
+    uint32_t *pref)
+{
+	const size_t npref = model->hdr->npref;
+	memcpy(pref, model->state + rng_uniform(rng, model->hdr->nstate) *
+	    (npref + 2), npref * sizeof(*pref));
+}
+
+/* model_sufrand: get string index from state's suffixes drawn from rng
+ * Each suffix is as likely as the number of times it was seen after the
+ * state's prefix.
+ */
+static uint32_t
+model_sufrand(const struct mrkvmodel *model, struct rng *rng,
+    const uint32_t *state)
+{
+	const size_t npref = model->hdr->npref;
+	const uint32_t *cum = model->sufcum + state[npref];
+	size_t r;
+	size_t lo, hi, mid;
+
+	r = rng_uniform(rng, cum[state[npref + 1] - 1]);
+	/* Find the first suffix whose cumulative count is above r. */
+	for (lo = 0, hi = state[npref + 1] - 1; lo < hi;) {
+		mid = lo + (hi - lo) / 2;
+		if (cum[mid] > r)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return (model->sufword[state[npref] + lo]);
+}
+
+/* model_str: return string at index id of model */
+static const char *
+model_str(const struct mrkvmodel *model, uint32_t id)
+{
+	return (model->str + model->stroff[id]);
+}
+
+/* model_strlen: strlen of string at index id of model, without calling
+ * strlen */
+static size_t
+model_strlen(const struct mrkvmodel *model, uint32_t id)
+{
+	size_t next;
+	next = id + 1 < model->hdr->nstr ? model->stroff[id + 1] :
+	    model->hdr->strbytes;
+	return (next - model->stroff[id] - 1);
+}
+
+/* model_strindex: build model's strbucket for model_strlookup
+ * Model files don't hold it, as only batch looks strings up.
+ *
+ * Returns -1 on error.
+ */
+static int
+model_strindex(struct mrkvmodel *model)
+{
+	size_t i, h, mask;
+
+	/* Keep the load factor at or below 1/2. */
+	model->nstrbucket = pow2(MAX(model->hdr->nstr * (size_t)2, 1));
+	if ((model->strbucket = calloc(model->nstrbucket,
+	    sizeof(*model->strbucket))) == NULL)
+		return (-1);
+	mask = model->nstrbucket - 1;
+	for (i = 0; i < model->hdr->nstr; i++) {
+		for (h = strt_hashstr(model_str(model, i)) & mask;
+		    model->strbucket[h] != 0; h = (h + 1) & mask)
+			;
+		model->strbucket[h] = i + 1;
+	}
+	return (0);
+}
+
+/* model_strlookup: get the index of str in model
+ * model_strindex must have been called.
+ *
+ * Returns NOID if str isn't in model.
+ */
+static uint32_t
+model_strlookup(const struct mrkvmodel *model, const char *str)
+{
+	size_t h;
+	const size_t mask = model->nstrbucket - 1;
+
+	for (h = strt_hashstr(str) & mask; model->strbucket[h] != 0;
+	    h = (h + 1) & mask)
+		if (strcmp(model_str(model, model->strbucket[h] - 1), str)
+		    == 0)
+			return (model->strbucket[h] - 1);
+	return (NOID);
+}
+
+/* outbuf_addword: append word of length len and a newline to ob
+ * Returns -1 on error.
+ */
+static int
+outbuf_addword(struct outbuf *ob, const char *word, size_t len)
+{
+	if (outbuf_add(ob, word, len) == -1 || outbuf_add(ob, "\n", 1) == -1)
+		return (-1);
 	return (0);
 }
@@ -0,0 +1,23 @@
+#!/bin/sh
+# Check that 3-2_3 -f prints as many words as -c asks for, with and without
+# -l evicting states, trained on its own source.
+# usage: 3-2_3test.sh [3-2_3 binary]
+
+bin=${1:-./3-2_3}
+corpus=$(dirname "$0")/3-2_3.c
+nfail=0
+
+for l in "" 200000 50000; do
+	for c in 0 1 200 1000; do
+		for s in 1 2 3 4 5 6 7 8; do
+			n=$("$bin" -f ${l:+-l "$l"} -c "$c" -s "$s" <"$corpus" |
+			    wc -w) || exit 1
+			if [ "$n" -ne "$c" ]; then
+				echo "-l ${l:-none} -c $c -s $s: $n words"
+				nfail=$((nfail + 1))
+			fi
+		done
+	done
+done
+echo "$nfail failed"
+[ "$nfail" -eq 0 ]
@@ -0,0 +1,247 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "csvlib.h"
+
+static int	batch_grow(struct csvbatch *, size_t);
+static int	batch_addcol(struct csvbatch *);
+static int	batch_field(struct csvbatch *, size_t, size_t,
+		    const struct csvslice *);
+static void	batch_convert(struct csvbatch *, size_t, size_t);
+
+/* csv_batchinit: init batch, return batch
+ * call csv_batchdestroy() to free the batch's resources.
+ * If batch is NULL, allocate it.
+ *
+ * Returns NULL on malloc error.
+ */
+struct csvbatch *
+csv_batchinit(struct csvbatch *batch)
+{
+	static const struct csvbatch zero;
+	const void *obatch = batch;
+
+	if (batch == NULL)
+		if ((batch = malloc(sizeof(*batch))) == NULL)
+			return (NULL);
+	*batch = zero;
+	/* Missing fields are the empty string at offset 0. */
+	batch->maxdata = 4096;
+	if ((batch->data = malloc(batch->maxdata)) == NULL) {
+		if (obatch == NULL)
+			free(batch);
+		return (NULL);
+	}
+	batch->data[0] = '\0';
+	batch->datalen = 1;
+	return (batch);
+}
+
+/* csv_batchdestroy: destroy resources in batch, doesn't free batch */
+void
+csv_batchdestroy(struct csvbatch *batch)
+{
+	struct csvcolumn *cp;
+	size_t i;
+
+	for (i = 0; i < batch->maxcol; i++) {
+		cp = &batch->col[i];
+		free(cp->off);
+		free(cp->len);
+		free(cp->i);
+		free(cp->d);
+		free(cp->bad);
+	}
+	free(batch->col);
+	free(batch->nfield);
+	free(batch->data);
+}
+
+/* csv_batchtype: convert the fields of 0-indexed column col to type from the
+ * next csv_getbatch on
+ * CSV_TINT fields are converted by csv_toint64, and CSV_TDOUBLE fields by
+ * csv_todouble.
+ *
+ * Returns -1 on malloc error, or with errno set to EINVAL on an unknown type.
+ */
+int
+csv_batchtype(struct csvbatch *batch, size_t col, int type)
+{
+	if (type != CSV_TSTRING && type != CSV_TINT && type != CSV_TDOUBLE) {
+		errno = EINVAL;
+		return (-1);
+	}
+	while (batch->maxcol <= col)
+		if (batch_addcol(batch) == -1)
+			return (-1);
+	batch->col[col].type = type;
+	return (0);
+}
+
+/* csv_getbatch: read up to n records from state with csv_getrecord into batch
+ * batch->nrec is 0 at end of file.
+ *
+ * Returns -1 on error.
+ */
+int
+csv_getbatch(struct csvstate *state, struct csvbatch *batch, size_t n)
+{
+	const struct csvslice *sp;
+	size_t i, j, nf, len;
+
+	batch->nrec = batch->ncol = 0;
+	batch->datalen = 1;
+	if (batch_grow(batch, n) == -1)
+		return (-1);
+	for (i = 0; i < n; i++) {
+		errno = 0;
+		if (csv_getrecord(state, &len) == NULL) {
+			if (errno != 0)
+				return (-1);
+			break;
+		}
+		nf = csv_nfield(state);
+		while (batch->maxcol < nf)
+			if (batch_addcol(batch) == -1)
+				return (-1);
+		/* A new column's earlier records are missing it. */
+		for (; batch->ncol < nf; batch->ncol++)
+			for (j = 0; j < i; j++)
+				if (batch_field(batch, batch->ncol, j, NULL)
+				    == -1)
+					return (-1);
+		for (j = 0; j < batch->ncol; j++) {
+			sp = j < nf ? csv_getslice(state, j) : NULL;
+			if (batch_field(batch, j, i, sp) == -1)
+				return (-1);
+		}
+		batch->nfield[i] = nf;
+	}
+	batch->nrec = i;
+	for (j = 0; j < batch->ncol; j++)
+		if (batch->col[j].type != CSV_TSTRING)
+			batch_convert(batch, j, batch->nrec);
+	return (0);
+}
+
+/* batch_grow: make room for n records in batch's arrays
+ * Returns -1 on malloc error.
+ */
+static int
+batch_grow(struct csvbatch *batch, size_t n)
+{
+	struct csvcolumn *cp;
+	void *tp;
+	size_t i;
+
+	if (n <= batch->maxrec)
+		return (0);
+	if ((tp = realloc(batch->nfield, n * sizeof(*batch->nfield))) == NULL)
+		return (-1);
+	batch->nfield = tp;
+	for (i = 0; i < batch->maxcol; i++) {
+		cp = &batch->col[i];
+		if ((tp = realloc(cp->off, n * sizeof(*cp->off))) == NULL)
+			return (-1);
+		cp->off = tp;
+		if ((tp = realloc(cp->len, n * sizeof(*cp->len))) == NULL)
+			return (-1);
+		cp->len = tp;
+		if ((tp = realloc(cp->i, n * sizeof(*cp->i))) == NULL)
+			return (-1);
+		cp->i = tp;
+		if ((tp = realloc(cp->d, n * sizeof(*cp->d))) == NULL)
+			return (-1);
+		cp->d = tp;
+		if ((tp = realloc(cp->bad, n * sizeof(*cp->bad))) == NULL)
+			return (-1);
+		cp->bad = tp;
+	}
+	batch->maxrec = n;
+	return (0);
+}
+
+/* batch_addcol: add a CSV_TSTRING column with room for maxrec records
+ * Returns -1 on malloc error.
+ */
+static int
+batch_addcol(struct csvbatch *batch)
+{
+	static const struct csvcolumn zero;
+	struct csvcolumn *cp;
+	size_t n = batch->maxrec > 0 ? batch->maxrec : 1;
+	void *tp;
+
+	if ((tp = realloc(batch->col, (batch->maxcol + 1) *
+	    sizeof(*batch->col))) == NULL)
+		return (-1);
+	batch->col = tp;
+	cp = &batch->col[batch->maxcol];
+	*cp = zero;
+	cp->type = CSV_TSTRING;
+	if ((cp->off = malloc(n * sizeof(*cp->off))) == NULL ||
+	    (cp->len = malloc(n * sizeof(*cp->len))) == NULL ||
+	    (cp->i = malloc(n * sizeof(*cp->i))) == NULL ||
+	    (cp->d = malloc(n * sizeof(*cp->d))) == NULL ||
+	    (cp->bad = malloc(n * sizeof(*cp->bad))) == NULL) {
+		free(cp->off);
+		free(cp->len);
+		free(cp->i);
+		free(cp->d);
+		return (-1);
+	}
+	batch->maxcol++;
+	return (0);
+}
+
+/* batch_field: set the field of record rec in column col to the value of sp,
+ * or to missing if sp is NULL
+ * Returns -1 on malloc error.
+ */
+static int
+batch_field(struct csvbatch *batch, size_t col, size_t rec,
+    const struct csvslice *sp)
+{
+	struct csvcolumn *cp = &batch->col[col];
+	size_t size;
+	void *tp;
+
+	cp->bad[rec] = sp == NULL;
+	if (sp == NULL || sp->len == 0) {
+		cp->off[rec] = cp->len[rec] = 0;
+		return (0);
+	}
+	if (batch->maxdata - batch->datalen < sp->len + 1) {
+		for (size = batch->maxdata * 2; size - batch->datalen <
+		    sp->len + 1; size *= 2)
+			;
+		if ((tp = realloc(batch->data, size)) == NULL)
+			return (-1);
+		batch->data = tp;
+		batch->maxdata = size;
+	}
+	cp->off[rec] = batch->datalen;
+	cp->len[rec] = csv_unescape(sp, batch->data + batch->datalen);
+	batch->datalen += cp->len[rec] + 1;
+	return (0);
+}
+
+/* batch_convert: convert the first nrec fields of column col to its type */
+static void
+batch_convert(struct csvbatch *batch, size_t col, size_t nrec)
+{
+	struct csvcolumn *cp = &batch->col[col];
+	const char *s;
+	size_t i;
+	int rv;
+
+	for (i = 0; i < nrec; i++) {
+		s = batch->data + cp->off[i];
+		if (cp->type == CSV_TINT)
+			rv = csv_toint64(s, cp->len[i], &cp->i[i]);
+		else
+			rv = csv_todouble(s, cp->len[i], &cp->d[i]);
+		cp->bad[i] = rv == -1;
+	}
+}
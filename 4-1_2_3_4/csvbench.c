@@ -0,0 +1,640 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "csvlib.h"
+
+enum { /* conversions timed by convert */
+	CONV_NONE,
+	CONV_INT64,
+	CONV_STRTOLL,
+	CONV_DOUBLE,
+	CONV_STRTOD,
+	CONV_TIME,
+	CONV_COUNT
+};
+
+enum {
+	/* records sought to by timeseek */
+	NSEEK = 10000
+};
+
+enum { /* outputs timed by rewrite */
+	REWRITE_NONE,
+	REWRITE_WRITER,
+	REWRITE_FPRINTF
+};
+
+/* How a run reads the file. */
+struct runopt {
+	const struct csvdialect *dialect;	/* or NULL */
+	size_t		 blksize;	/* or 0 */
+	size_t		*cols;		/* CSV_PROJECT columns, or NULL */
+	size_t		 ncol;
+};
+
+/* Records and fields read by a run. */
+struct count {
+	pthread_mutex_t	 lock;
+	size_t		 nrec;
+	size_t		 nfield;
+};
+
+static int	run(const char *, const struct runopt *, int, int,
+		    struct count *, double *);
+static int	sniff(const char *, struct csvdialect *);
+static int	countchunk(struct csvstate *, void *);
+static int	convert(const char *, int, size_t *, size_t *, double *);
+static int	timeconv(const char *);
+static int	rewrite(const char *, int, size_t *, double *);
+static int	timewrite(const char *);
+static int	timeseek(const char *, size_t);
+static int	loadindex(const char *, int, struct csvindex *);
+static int	getcols(const char *, size_t **, size_t *);
+static long	getnum(const char *, long, long);
+
+/* This program parses a CSV file with csvlib and prints the throughput for 1,
+ * 2, 4 and so on up to -j threads, or as many as there are processors. Each
+ * thread count is run with the records read in order by csv_getrecord, and
+ * with the chunks given to csv_parallel callbacks.
+ * With -b, a thread parses that many bytes at once.
+ * With -p, only the comma separated, 1-indexed columns are read, as
+ * CSV_PROJECT does.
+ * With -s, the file is read in the dialect csv_sniffinput guesses.
+ * With -t, it instead prints how long converting each field to a number or a
+ * time takes with csvlib, and to a number with strtoll and strtod.
+ * With -w, it instead prints how fast a csvwriter writes the file's records to
+ * /dev/null, and fprintf the fields without quoting.
+ * With -i, it instead indexes every -i records of the file into file.idx, or
+ * uses file.idx if it's still good, and prints how fast records are sought to
+ * with it.
+ */
+int
+main(int argc, char *argv[])
+{
+	struct csvdialect dialect;
+	struct runopt opt = {NULL, 0, NULL, 0};
+	struct count count;
+	double secs[2], mb;
+	size_t iflag = 0;
+	long jflag;
+	int c, nthread, fd, tflag = 0, wflag = 0;
+
+	if ((jflag = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		jflag = 1;
+	while ((c = getopt(argc, argv, "b:i:j:p:stw")) != -1) {
+		switch (c) {
+		case 'b':
+			if ((opt.blksize = getnum(optarg, 1, LONG_MAX)) == 0)
+				goto err;
+			break;
+		case 'i':
+			if ((iflag = getnum(optarg, 1, LONG_MAX)) == 0)
+				goto err;
+			break;
+		case 'j':
+			if ((jflag = getnum(optarg, 1, INT_MAX)) == 0)
+				goto err;
+			break;
+		case 'p':
+			free(opt.cols);
+			if (getcols(optarg, &opt.cols, &opt.ncol) == -1)
+				goto err;
+			break;
+		case 's':
+			opt.dialect = &dialect;
+			break;
+		case 't':
+			tflag = 1;
+			break;
+		case 'w':
+			wflag = 1;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 1)
+		goto usage;
+	if (tflag)
+		return (timeconv(argv[0]) == -1 ? EXIT_FAILURE : EXIT_SUCCESS);
+	if (wflag)
+		return (timewrite(argv[0]) == -1 ? EXIT_FAILURE : EXIT_SUCCESS);
+	if (iflag > 0)
+		return (timeseek(argv[0], iflag) == -1 ? EXIT_FAILURE :
+		    EXIT_SUCCESS);
+	if ((fd = open(argv[0], O_RDONLY)) == -1)
+		goto err;
+	mb = lseek(fd, 0, SEEK_END) / 1e6;
+	close(fd);
+	if (opt.dialect != NULL) {
+		if (sniff(argv[0], &dialect) == -1)
+			goto err;
+		printf("dialect: sep \"%s\", quote %d, esc %d, nl %d, "
+		    "header %d\n", dialect.sep, dialect.quote, dialect.esc,
+		    dialect.nl, dialect.header);
+	}
+	/* The first run reads the file into the page cache. */
+	if (run(argv[0], &opt, 1, 0, &count, &secs[0]) == -1)
+		goto err;
+	for (nthread = 1; nthread <= jflag; nthread *= 2) {
+		if (run(argv[0], &opt, nthread, 0, &count, &secs[0]) == -1 ||
+		    run(argv[0], &opt, nthread, 1, &count, &secs[1]) == -1)
+			goto err;
+		printf("threads %d: in order %.1f MB/s, chunks %.1f MB/s, "
+		    "%zu records, %zu fields\n", nthread, mb / secs[0],
+		    mb / secs[1], count.nrec, count.nfield);
+		if (nthread > INT_MAX / 2)
+			break;
+	}
+	free(opt.cols);
+	return (EXIT_SUCCESS);
+usage:
+	fprintf(stderr, "usage: csvbench [-stw] [-b blksize] [-i every] "
+	    "[-j maxthreads] [-p cols] file\n");
+	return (EXIT_FAILURE);
+err:
+	perror(NULL);
+	free(opt.cols);
+	return (EXIT_FAILURE);
+}
+
+/* run: parse path with nthread threads as opt says, and set *count to what was
+ * read and *secs to how long it took
+ * The records are read by csv_parallel callbacks if chunks is true, else in
+ * order.
+ *
+ * Returns -1 on error.
+ */
+static int
+run(const char *path, const struct runopt *opt, int nthread, int chunks,
+    struct count *count, double *secs)
+{
+	struct timespec start, stop;
+	struct csvstate *state;
+	int fd = -1;
+	int ret = -1;
+
+	count->nrec = count->nfield = 0;
+	if ((errno = pthread_mutex_init(&count->lock, NULL)) != 0)
+		return (-1);
+	if ((state = csv_init(NULL)) == NULL)
+		goto end;
+	if ((fd = open(path, O_RDONLY)) == -1)
+		goto end;
+	if (clock_gettime(CLOCK_MONOTONIC, &start) == -1)
+		goto end;
+	if ((opt->dialect != NULL &&
+	    csv_setopt(state, CSV_DIALECT, opt->dialect) == -1) ||
+	    (opt->blksize > 0 &&
+	    csv_setopt(state, CSV_BLKSIZE, opt->blksize) == -1) ||
+	    (opt->ncol > 0 &&
+	    csv_setopt(state, CSV_PROJECT, opt->cols, opt->ncol) == -1) ||
+	    csv_setopt(state, CSV_NTHREAD, nthread) == -1 ||
+	    csv_setfd(state, fd) == -1)
+		goto end;
+	if (chunks) {
+		if (csv_parallel(state, countchunk, count) == -1)
+			goto end;
+	} else {
+		errno = 0;
+		if (countchunk(state, count) == -1 || errno != 0)
+			goto end;
+	}
+	if (clock_gettime(CLOCK_MONOTONIC, &stop) == -1)
+		goto end;
+	*secs = (stop.tv_sec - start.tv_sec) +
+	    (stop.tv_nsec - start.tv_nsec) / 1e9;
+	ret = 0;
+end:
+	if (state != NULL) {
+		csv_destroy(state);
+		free(state);
+	}
+	if (fd != -1)
+		close(fd);
+	pthread_mutex_destroy(&count->lock);
+	return (ret);
+}
+
+/* sniff: set *d to the dialect csv_sniffinput guesses for path
+ * Returns -1 on error.
+ */
+static int
+sniff(const char *path, struct csvdialect *d)
+{
+	struct csvstate *state;
+	int fd = -1;
+	int ret = -1;
+
+	if ((state = csv_init(NULL)) == NULL)
+		return (-1);
+	if ((fd = open(path, O_RDONLY)) == -1 ||
+	    csv_setfd(state, fd) == -1 || csv_sniffinput(state, d) == -1)
+		goto end;
+	ret = 0;
+end:
+	csv_destroy(state);
+	free(state);
+	if (fd != -1)
+		close(fd);
+	return (ret);
+}
+
+/* countchunk: add the records and fields read from state to the count arg */
+static int
+countchunk(struct csvstate *state, void *arg)
+{
+	struct count *count = arg;
+	size_t len, nrec = 0, nfield = 0;
+
+	for (; csv_getrecord(state, &len) != NULL; nrec++)
+		nfield += csv_nfield(state);
+	pthread_mutex_lock(&count->lock);
+	count->nrec += nrec;
+	count->nfield += nfield;
+	pthread_mutex_unlock(&count->lock);
+	return (0);
+}
+
+/* timeconv: print how long each conversion of path's fields takes
+ * The time to read the fields is taken out.
+ *
+ * Returns -1 on error.
+ */
+static int
+timeconv(const char *path)
+{
+	static const char *const name[] = {
+		"none", "csv_getint64", "strtoll", "csv_getdouble", "strtod",
+		"csv_gettime"
+	};
+	size_t nfield, nconv;
+	double secs, base;
+	int conv;
+
+	/* The first run reads the file into the page cache. */
+	if (convert(path, CONV_NONE, &nfield, &nconv, &base) == -1 ||
+	    convert(path, CONV_NONE, &nfield, &nconv, &base) == -1)
+		goto err;
+	for (conv = CONV_INT64; conv < CONV_COUNT; conv++) {
+		if (convert(path, conv, &nfield, &nconv, &secs) == -1)
+			goto err;
+		printf("%s: %.1f ns/field, %zu of %zu fields converted\n",
+		    name[conv], nfield > 0 ? (secs - base) * 1e9 / nfield : 0,
+		    nconv, nfield);
+	}
+	return (0);
+err:
+	perror(NULL);
+	return (-1);
+}
+
+/* convert: read path's fields and convert them with conv
+ * *nfield is set to the number of fields, *nconv to the number converted, and
+ * *secs to how long it took. strtoll and strtod are given csv_getfield's copy,
+ * as they would be without slices.
+ *
+ * Returns -1 on error.
+ */
+static int
+convert(const char *path, int conv, size_t *nfield, size_t *nconv,
+    double *secs)
+{
+	struct timespec start, stop, ts;
+	struct csvstate *state;
+	int64_t i;
+	double d;
+	char *s, *end;
+	size_t len, n, j;
+	int fd = -1;
+	int ret = -1;
+
+	*nfield = *nconv = 0;
+	if ((state = csv_init(NULL)) == NULL)
+		return (-1);
+	if ((fd = open(path, O_RDONLY)) == -1)
+		goto end;
+	if (clock_gettime(CLOCK_MONOTONIC, &start) == -1 ||
+	    csv_setfd(state, fd) == -1)
+		goto end;
+	for (errno = 0; csv_getrecord(state, &len) != NULL; errno = 0) {
+		n = csv_nfield(state);
+		*nfield += n;
+		for (j = 0; j < n; j++) {
+			switch (conv) {
+			case CONV_INT64:
+				*nconv += csv_getint64(state, j, &i) == 0;
+				break;
+			case CONV_STRTOLL:
+				if ((s = csv_getfield(state, j)) == NULL)
+					goto end;
+				errno = 0;
+				i = strtoll(s, &end, 10);
+				*nconv += *end == '\0' && end != s &&
+				    errno == 0;
+				break;
+			case CONV_DOUBLE:
+				*nconv += csv_getdouble(state, j, &d) == 0;
+				break;
+			case CONV_STRTOD:
+				if ((s = csv_getfield(state, j)) == NULL)
+					goto end;
+				errno = 0;
+				d = strtod(s, &end);
+				*nconv += *end == '\0' && end != s &&
+				    errno == 0;
+				break;
+			case CONV_TIME:
+				*nconv += csv_gettime(state, j, &ts) == 0;
+				break;
+			}
+		}
+	}
+	if (errno != 0 || clock_gettime(CLOCK_MONOTONIC, &stop) == -1)
+		goto end;
+	*secs = (stop.tv_sec - start.tv_sec) +
+	    (stop.tv_nsec - start.tv_nsec) / 1e9;
+	ret = 0;
+end:
+	csv_destroy(state);
+	free(state);
+	if (fd != -1)
+		close(fd);
+	return (ret);
+}
+
+/* timewrite: print how fast path's records are written
+ * The time to read them is taken out.
+ *
+ * Returns -1 on error.
+ */
+static int
+timewrite(const char *path)
+{
+	static const char *const name[] = {"none", "csvwriter", "fprintf"};
+	size_t nrec;
+	double secs, base;
+	int how;
+
+	/* The first run reads the file into the page cache. */
+	if (rewrite(path, REWRITE_NONE, &nrec, &base) == -1 ||
+	    rewrite(path, REWRITE_NONE, &nrec, &base) == -1)
+		goto err;
+	for (how = REWRITE_WRITER; how <= REWRITE_FPRINTF; how++) {
+		if (rewrite(path, how, &nrec, &secs) == -1)
+			goto err;
+		secs -= base;
+		printf("%s: %.0f records/s, %zu records\n", name[how],
+		    secs > 0 ? nrec / secs : 0, nrec);
+	}
+	return (0);
+err:
+	perror(NULL);
+	return (-1);
+}
+
+/* rewrite: read path's records and write them to /dev/null as how says
+ * *nrec is set to the number of records and *secs to how long it took.
+ * fprintf is given csv_getfield's copies, csvwriter slices where it can.
+ *
+ * Returns -1 on error.
+ */
+static int
+rewrite(const char *path, int how, size_t *nrec, double *secs)
+{
+	struct timespec start, stop;
+	struct csvstate *state;
+	struct csvwriter *writer = NULL;
+	const struct csvslice *sp;
+	FILE *out = NULL;
+	char *s;
+	size_t len, n, j;
+	int fd = -1;
+	int ret = -1;
+
+	*nrec = 0;
+	if ((state = csv_init(NULL)) == NULL)
+		return (-1);
+	if ((out = fopen("/dev/null", "w")) == NULL ||
+	    (writer = csv_writerinit(NULL, fileno(out), ',')) == NULL)
+		goto end;
+	if ((fd = open(path, O_RDONLY)) == -1)
+		goto end;
+	if (clock_gettime(CLOCK_MONOTONIC, &start) == -1 ||
+	    csv_setfd(state, fd) == -1)
+		goto end;
+	for (errno = 0; csv_getrecord(state, &len) != NULL; errno = 0) {
+		n = csv_nfield(state);
+		(*nrec)++;
+		for (j = 0; j < n && how == REWRITE_WRITER; j++) {
+			if ((sp = csv_getslice(state, j)) == NULL)
+				goto end;
+			if (sp->escaped) {
+				if ((s = csv_getfield(state, j)) == NULL ||
+				    csv_writefield(writer, s, strlen(s)) == -1)
+					goto end;
+			} else if (csv_writefield(writer, sp->ptr, sp->len) ==
+			    -1)
+				goto end;
+		}
+		for (j = 0; j < n && how == REWRITE_FPRINTF; j++)
+			if ((s = csv_getfield(state, j)) == NULL ||
+			    fprintf(out, "%s%c", s, j + 1 < n ? ',' : '\n') < 0)
+				goto end;
+		if (how == REWRITE_WRITER && csv_endrecord(writer) == -1)
+			goto end;
+	}
+	if (errno != 0 || csv_flush(writer) == -1 || fflush(out) == EOF ||
+	    clock_gettime(CLOCK_MONOTONIC, &stop) == -1)
+		goto end;
+	*secs = (stop.tv_sec - start.tv_sec) +
+	    (stop.tv_nsec - start.tv_nsec) / 1e9;
+	ret = 0;
+end:
+	csv_destroy(state);
+	free(state);
+	if (writer != NULL) {
+		csv_writerdestroy(writer);
+		free(writer);
+	}
+	if (out != NULL)
+		fclose(out);
+	if (fd != -1)
+		close(fd);
+	return (ret);
+}
+
+/* timeseek: print how fast records of path are sought to with an index of
+ * every every-th record
+ * The index is loaded from path.idx if it's there and still good, else it's
+ * built and saved there.
+ *
+ * Returns -1 on error.
+ */
+static int
+timeseek(const char *path, size_t every)
+{
+	struct timespec start, stop;
+	struct csvstate *state = NULL;
+	struct csvindex *index;
+	size_t len, nrec, i;
+	double secs;
+	int fd = -1, loaded, ret = -1;
+
+	if ((index = csv_indexinit(NULL, every)) == NULL ||
+	    (fd = open(path, O_RDONLY)) == -1)
+		goto err;
+	if (clock_gettime(CLOCK_MONOTONIC, &start) == -1 ||
+	    (loaded = loadindex(path, fd, index)) == -1 ||
+	    clock_gettime(CLOCK_MONOTONIC, &stop) == -1)
+		goto err;
+	secs = (stop.tv_sec - start.tv_sec) +
+	    (stop.tv_nsec - start.tv_nsec) / 1e9;
+	nrec = csv_indexnrec(index);
+	printf("index: %s in %.3f s, %zu records\n",
+	    loaded ? "loaded" : "built", secs, nrec);
+	if ((state = csv_init(NULL)) == NULL || csv_setfd(state, fd) == -1)
+		goto err;
+	srand(1);
+	if (clock_gettime(CLOCK_MONOTONIC, &start) == -1)
+		goto err;
+	for (i = 0; i < NSEEK && nrec > 0; i++)
+		if (csv_indexseek(index, state,
+		    ((size_t)rand() * RAND_MAX + rand()) % nrec) == -1 ||
+		    csv_getrecord(state, &len) == NULL)
+			goto err;
+	if (clock_gettime(CLOCK_MONOTONIC, &stop) == -1)
+		goto err;
+	secs = (stop.tv_sec - start.tv_sec) +
+	    (stop.tv_nsec - start.tv_nsec) / 1e9;
+	printf("seek: %.2f us/record, %zu records\n", i > 0 ?
+	    secs * 1e6 / i : 0, i);
+	ret = 0;
+	goto end;
+err:
+	perror(NULL);
+end:
+	if (state != NULL) {
+		csv_destroy(state);
+		free(state);
+	}
+	if (index != NULL) {
+		csv_indexdestroy(index);
+		free(index);
+	}
+	if (fd != -1)
+		close(fd);
+	return (ret);
+}
+
+/* loadindex: load ix for path, open as fd, from path.idx, or build it and save
+ * it there if that fails
+ * Returns -1 on error.
+ * Returns 0 if ix was built.
+ * Returns 1 if ix was loaded.
+ */
+static int
+loadindex(const char *path, int fd, struct csvindex *ix)
+{
+	struct csvstate *state = NULL;
+	char *ixpath;
+	int ixfd, ret = -1;
+
+	if ((ixpath = malloc(strlen(path) + sizeof(".idx"))) == NULL)
+		return (-1);
+	strcpy(ixpath, path);
+	strcat(ixpath, ".idx");
+	if ((ixfd = open(ixpath, O_RDONLY)) != -1) {
+		if (csv_indexload(ix, ixfd, fd) == 0) {
+			ret = 1;
+			goto end;
+		}
+		if (errno != ESTALE && errno != EINVAL)
+			goto end;
+		close(ixfd);
+	} else if (errno != ENOENT) {
+		goto end;
+	}
+	if ((state = csv_init(NULL)) == NULL || csv_setfd(state, fd) == -1 ||
+	    csv_indexbuild(ix, state) == -1 ||
+	    (ixfd = open(ixpath, O_WRONLY | O_CREAT | O_TRUNC, 0666)) == -1 ||
+	    csv_indexsave(ix, ixfd, fd) == -1)
+		goto end;
+	ret = 0;
+end:
+	if (ixfd != -1 && close(ixfd) == -1)
+		ret = -1;
+	if (state != NULL) {
+		csv_destroy(state);
+		free(state);
+	}
+	free(ixpath);
+	return (ret);
+}
+
+/* getcols: set *cols to the 0-indexed columns of the comma separated, 1-indexed
+ * list s, and *ncol to their number
+ * Returns -1 on malloc error, or with errno set to EINVAL if s isn't such a
+ * list.
+ */
+static int
+getcols(const char *s, size_t **cols, size_t *ncol)
+{
+	char *list, *tok, *last;
+	size_t n = 0, *tp;
+	long col;
+
+	*cols = NULL;
+	*ncol = 0;
+	if ((list = strdup(s)) == NULL)
+		return (-1);
+	for (tok = strtok_r(list, ",", &last); tok != NULL;
+	    tok = strtok_r(NULL, ",", &last)) {
+		if ((col = getnum(tok, 1, LONG_MAX)) == 0)
+			goto err;
+		if ((tp = realloc(*cols, (n + 1) * sizeof(**cols))) == NULL)
+			goto err;
+		*cols = tp;
+		(*cols)[n++] = col - 1;
+	}
+	if (n == 0) {
+		errno = EINVAL;
+		goto err;
+	}
+	free(list);
+	*ncol = n;
+	return (0);
+err:
+	free(list);
+	free(*cols);
+	*cols = NULL;
+	return (-1);
+}
+
+/* getnum: return the number in s, between min and max
+ * Returns 0 with errno set to EINVAL if s isn't such a number.
+ */
+static long
+getnum(const char *s, long min, long max)
+{
+	char *end;
+	long n;
+
+	errno = 0;
+	n = strtol(s, &end, 10);
+	if (end == s || *end != '\0' || errno != 0 || n < min || n > max) {
+		errno = EINVAL;
+		return (0);
+	}
+	return (n);
+}
@@ -0,0 +1,338 @@
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "csvlib.h"
+
+#define MAGIC "CSVINDX1"
+
+enum {
+	/* bytes of an index file before its offsets */
+	INDEX_HDRLEN = 8 + 6 * 8,
+	/* most bytes of an offset delta */
+	INDEX_MAXVAR = 10
+};
+
+/* Offsets of every every-th record of an input, as a sidecar index to it.
+ * Offsets are kept as is, so that any can be sought to at once. An index
+ * file holds the deltas between them instead, as varints, after a header of
+ * MAGIC and little endian 64 bit numbers: the size, the modification time in
+ * seconds and nanoseconds of the input indexed, every, nrec and noff.
+ */
+struct csvindex {
+	size_t		 every;		/* records between offsets */
+	size_t		 nrec;		/* records in the input */
+	off_t		*off;		/* offset of record i * every */
+	size_t		 noff;		/* number of offsets in off */
+	size_t		 maxoff;	/* size of off[] */
+};
+
+static int	 addoff(struct csvindex *, off_t);
+static unsigned char *putu64(unsigned char *, uint64_t);
+static uint64_t	 getu64(const unsigned char *);
+static unsigned char *putvar(unsigned char *, uint64_t);
+static const unsigned char *getvar(const unsigned char *,
+		    const unsigned char *, uint64_t *);
+static int	 stamp(int, uint64_t *);
+
+/* csv_indexinit: init ix to index the offset of every every-th record, return
+ * ix
+ * call csv_indexdestroy() to free the index's resources.
+ * If ix is NULL, allocate it.
+ *
+ * Returns NULL on malloc error, or with errno set to EINVAL if every is 0.
+ */
+struct csvindex *
+csv_indexinit(struct csvindex *ix, size_t every)
+{
+	if (every == 0) {
+		errno = EINVAL;
+		return (NULL);
+	}
+	if (ix == NULL)
+		if ((ix = malloc(sizeof(*ix))) == NULL)
+			return (NULL);
+	ix->every = every;
+	ix->nrec = 0;
+	ix->off = NULL;
+	ix->noff = ix->maxoff = 0;
+	return (ix);
+}
+
+/* csv_indexdestroy: destroy resources in ix, doesn't free ix */
+void
+csv_indexdestroy(struct csvindex *ix)
+{
+	free(ix->off);
+}
+
+/* csv_indexbuild: index the records state's csv_getrecord reads, up to the end
+ * of its input
+ * Record 0 is the next one read, which should be the input's first. The index
+ * is only good for state's dialect.
+ *
+ * Returns -1 on error.
+ */
+int
+csv_indexbuild(struct csvindex *ix, struct csvstate *state)
+{
+	size_t len;
+	off_t off;
+
+	ix->nrec = ix->noff = 0;
+	for (errno = 0; csv_getrecord(state, &len) != NULL; errno = 0) {
+		if (ix->nrec++ % ix->every != 0)
+			continue;
+		if ((off = csv_tell(state)) == -1 || addoff(ix, off) == -1)
+			return (-1);
+	}
+	return (errno != 0 ? -1 : 0);
+}
+
+/* csv_indexnrec: return the number of records indexed */
+size_t
+csv_indexnrec(const struct csvindex *ix)
+{
+	return (ix->nrec);
+}
+
+/* csv_indexsave: write ix to fd, stamped with the size and modification time
+ * of datafd, the input it indexes
+ * Returns -1 on malloc or write error.
+ */
+int
+csv_indexsave(const struct csvindex *ix, int fd, int datafd)
+{
+	unsigned char *buf, *p, *q;
+	uint64_t st[3];
+	ssize_t nwrite;
+	size_t i;
+	off_t prev = 0;
+	int ret = -1;
+
+	if (stamp(datafd, st) == -1)
+		return (-1);
+	if ((buf = malloc(INDEX_HDRLEN + ix->noff * INDEX_MAXVAR)) == NULL)
+		return (-1);
+	memcpy(buf, MAGIC, 8);
+	p = buf + 8;
+	for (i = 0; i < 3; i++)
+		p = putu64(p, st[i]);
+	p = putu64(p, ix->every);
+	p = putu64(p, ix->nrec);
+	p = putu64(p, ix->noff);
+	for (i = 0; i < ix->noff; i++) {
+		p = putvar(p, ix->off[i] - prev);
+		prev = ix->off[i];
+	}
+	for (q = buf; q < p; q += nwrite)
+		while ((nwrite = write(fd, q, p - q)) == -1)
+			if (errno != EINTR)
+				goto end;
+	ret = 0;
+end:
+	free(buf);
+	return (ret);
+}
+
+/* csv_indexload: read ix from fd, as csv_indexsave wrote it for datafd
+ * Returns -1 on malloc or read error, with errno set to ESTALE if datafd's
+ * size or modification time changed since, or to EINVAL if fd doesn't hold an
+ * index.
+ */
+int
+csv_indexload(struct csvindex *ix, int fd, int datafd)
+{
+	struct stat sb;
+	unsigned char *buf = NULL;
+	const unsigned char *p, *lim;
+	uint64_t st[3], every, nrec, noff, delta, off = 0;
+	size_t len = 0, i;
+	ssize_t nread;
+	int ret = -1;
+
+	if (stamp(datafd, st) == -1 || fstat(fd, &sb) == -1)
+		return (-1);
+	if (sb.st_size < INDEX_HDRLEN || (uintmax_t)sb.st_size > SIZE_MAX)
+		goto inval;
+	if ((buf = malloc(sb.st_size)) == NULL)
+		return (-1);
+	while (len < (size_t)sb.st_size) {
+		if ((nread = read(fd, buf + len, sb.st_size - len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			goto end;
+		}
+		if (nread == 0)
+			goto inval;
+		len += nread;
+	}
+	if (memcmp(buf, MAGIC, 8) != 0)
+		goto inval;
+	for (i = 0; i < 3; i++)
+		if (getu64(buf + 8 + i * 8) != st[i]) {
+			errno = ESTALE;
+			goto end;
+		}
+	every = getu64(buf + 32);
+	nrec = getu64(buf + 40);
+	noff = getu64(buf + 48);
+	if (every == 0 || every > SIZE_MAX || nrec > SIZE_MAX ||
+	    noff != (nrec + every - 1) / every ||
+	    noff > (len - INDEX_HDRLEN))
+		goto inval;
+	ix->every = every;
+	ix->nrec = nrec;
+	ix->noff = 0;
+	lim = buf + len;
+	for (p = buf + INDEX_HDRLEN, i = 0; i < noff; i++) {
+		/* Offsets only grow, and are within the input. */
+		if ((p = getvar(p, lim, &delta)) == NULL ||
+		    (i > 0 && delta == 0) || delta >= st[0] - off)
+			goto inval;
+		off += delta;
+		if (addoff(ix, off) == -1)
+			goto end;
+	}
+	if (p != lim)
+		goto inval;
+	ret = 0;
+	goto end;
+inval:
+	errno = EINVAL;
+end:
+	if (ret == -1)
+		ix->nrec = ix->noff = 0;
+	free(buf);
+	return (ret);
+}
+
+/* csv_indexseek: make record n the next one state's csv_getrecord reads
+ * state's input must be the one ix indexes. The offset of the indexed record
+ * before n is sought to with csv_seek, and the records after it up to n are
+ * read. With more than one CSV_NTHREAD, every seek starts a parallel parse
+ * over.
+ *
+ * Returns -1 on error, with errno set to EINVAL if n isn't indexed, or to
+ * ESTALE if the input ends before n.
+ */
+int
+csv_indexseek(const struct csvindex *ix, struct csvstate *state, size_t n)
+{
+	size_t len, i;
+
+	if (n >= ix->nrec) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if (csv_seek(state, ix->off[n / ix->every]) == -1)
+		return (-1);
+	for (i = n % ix->every, errno = 0; i > 0; i--)
+		if (csv_getrecord(state, &len) == NULL) {
+			if (errno == 0)
+				errno = ESTALE;
+			return (-1);
+		}
+	return (0);
+}
+
+/* addoff: add off to ix's offsets
+ * Returns -1 on malloc error.
+ */
+static int
+addoff(struct csvindex *ix, off_t off)
+{
+	size_t size;
+	void *tp;
+
+	if (ix->noff == ix->maxoff) {
+		size = ix->maxoff > 0 ? ix->maxoff * 2 : 64;
+		if (size > SIZE_MAX / sizeof(*ix->off)) {
+			errno = ENOMEM;
+			return (-1);
+		}
+		if ((tp = realloc(ix->off, size * sizeof(*ix->off))) == NULL)
+			return (-1);
+		ix->off = tp;
+		ix->maxoff = size;
+	}
+	ix->off[ix->noff++] = off;
+	return (0);
+}
+
+/* putu64: store v at p little endian, return a pointer past it */
+static unsigned char *
+putu64(unsigned char *p, uint64_t v)
+{
+	int i;
+
+	for (i = 0; i < 8; i++)
+		*p++ = v >> (8 * i);
+	return (p);
+}
+
+/* getu64: return the little endian number at p */
+static uint64_t
+getu64(const unsigned char *p)
+{
+	uint64_t v = 0;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		v |= (uint64_t)p[i] << (8 * i);
+	return (v);
+}
+
+/* putvar: store v at p as a varint, 7 bits a byte from the lowest, with the
+ * high bit set if more follow, return a pointer past it
+ */
+static unsigned char *
+putvar(unsigned char *p, uint64_t v)
+{
+	for (; v >= 0x80; v >>= 7)
+		*p++ = (v & 0x7f) | 0x80;
+	*p++ = v;
+	return (p);
+}
+
+/* getvar: set *vp to the varint at p, return a pointer past it
+ * Returns NULL if it doesn't end before lim, or overflows.
+ */
+static const unsigned char *
+getvar(const unsigned char *p, const unsigned char *lim, uint64_t *vp)
+{
+	uint64_t v = 0;
+	int shift;
+
+	for (shift = 0; p < lim && shift < 64; shift += 7) {
+		if (shift == 63 && *p > 1)
+			return (NULL);
+		v |= (uint64_t)(*p & 0x7f) << shift;
+		if (!(*p++ & 0x80)) {
+			*vp = v;
+			return (p);
+		}
+	}
+	return (NULL);
+}
+
+/* stamp: set st to the size, and the modification time in seconds and
+ * nanoseconds of fd
+ * Returns -1 on error.
+ */
+static int
+stamp(int fd, uint64_t *st)
+{
+	struct stat sb;
+
+	if (fstat(fd, &sb) == -1)
+		return (-1);
+	st[0] = sb.st_size;
+	st[1] = sb.st_mtim.tv_sec;
+	st[2] = sb.st_mtim.tv_nsec;
+	return (0);
+}
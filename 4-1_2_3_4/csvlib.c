@@ -1,33 +1,167 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "csvlib.h"
+#include "csvscan.h"
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+enum {
+	/* bytes csv_speculate looks at for a telling quote */
+	CSV_SPECWIN = 1 << 16
+};
+
+enum { /* values of a csvslice's escaped */
+	SLICE_QUOTED = 1,	/* quoted, with doubled quotes or escapes */
+	SLICE_UNQUOTED = 2	/* unquoted, with escapes */
+};
+
+/* A record parsed by a worker, its fields are slice to slice + nfield of its
+ * chunk. */
+struct csvrecord {
+	const char	*ptr;
+	size_t		 len;
+	size_t		 slice;
+	size_t		 nfield;
+};
+
+/* The records a worker parsed out of a chunk of buf. */
+struct csvchunk {
+	const char	*buf;		/* buf of the state parsed */
+	size_t		 start;		/* offset of the first record */
+	size_t		 end;		/* offset past the last record */
+	struct csvrecord *rec;
+	size_t		 nrec;
+	size_t		 maxrec;
+	size_t		 cur;		/* next record csv_getrecord returns */
+	struct csvslice	*slice;
+	size_t		 nslice;
+	size_t		 maxslice;
+	int		 busy;		/* is the chunk being parsed or read? */
+};
+
+/* A parallel parse of a mapped buf.
+ * Chunk i holds the records starting between base plus i and i + 1 times
+ * blksize, and is parsed into chunk[i % nslot] once chunk i - nslot is no
+ * longer busy. Its first record is guessed by csv_speculate, and checked
+ * against where chunk i - 1 ended when that's known. Chunks are verified in
+ * order.
+ */
+struct csvpar {
+	struct csvstate	*state;		/* state whose buf is parsed */
+	int		(*fn)(struct csvstate *, void *);
+	void		*arg;		/* fn's argument */
+	pthread_t	*tid;
+	size_t		 nthr;		/* number of threads in tid */
+	struct csvchunk	*chunk;
+	size_t		 nslot;		/* number of chunks in chunk[] */
+	size_t		 base;		/* offset of the first record parsed */
+	size_t		 nchunk;	/* number of chunks past base */
+	size_t		 next;		/* next chunk to parse */
+	size_t		 nverified;	/* chunks whose first record is known */
+	size_t		 vend;		/* end of the last verified chunk */
+	size_t		 cur;		/* chunk csv_getrecord reads */
+	int		 failed;	/* did a worker or fn fail? */
+	int		 error;		/* errno of the first failure */
+	int		 stop;		/* should the workers stop? */
+	pthread_mutex_t	 lock;
+	pthread_cond_t	 cond;
+};
 
 struct csvstate {
-	char		*line;		/* input chars */
-	size_t		linelen;	/* strlen(line) */
-	char		*sline;		/* line copy used to split */
-	size_t	 	 maxline;	/* buffer size for line and sline */
-	char		 **field;	/* pointers to fields */
-	size_t	 	 maxfield;	/* size of field[] */
-	size_t	 	 nfield;	/* number of fields in field[]. */
-	const char	*sep;		/* field separator string */
+	char		*line;		/* input chars of csv_getline */
+	const char	*rec;		/* record in line or buf */
+	size_t		 reclen;	/* length of rec without the newline */
+	char		*sline;		/* record copy for csv_getfield */
+	size_t	 	 maxline;	/* buffer size for line */
+	size_t	 	 maxsline;	/* buffer size for sline */
+	struct csvslice	*slice;		/* fields as slices of line */
+	char		 **field;	/* fields in sline */
+	size_t	 	 maxfield;	/* size of slice[] and field[] */
+	size_t	 	 nfield;	/* number of fields in slice[]. */
+	int		 copied;	/* does field[] point to this line? */
+	const char	*sep;		/* separator chars, or NULL */
 	int	 	 sepalloc;	/* is sep allocated? */
+	struct csvdialect dialect;	/* set by CSV_DIALECT */
+	struct csvclass	 cls;		/* dialect, with sep if set */
+	size_t		*proj;		/* columns of CSV_PROJECT, or NULL */
+	size_t		 nproj;		/* number of columns in proj */
+	size_t		*colmap;	/* 1 + index in proj of each column */
+	size_t		 ncolmap;	/* largest column in proj + 1 */
+	size_t		 col;		/* column of the next field split */
+	struct csvslice	 skip;		/* slice of a column not in proj */
+	int		 fd;		/* input of csv_getrecord */
+	char		*buf;		/* fd's contents, mapped or read */
+	size_t		 buflen;	/* bytes in buf */
+	size_t		 bufoff;	/* offset of the next record in buf */
+	off_t		 bufpos;	/* offset of buf in fd */
+	off_t		 recoff;	/* offset of rec in fd, or -1 */
+	size_t		 maxbuf;	/* buffer size for buf if read */
+	size_t		 blksize;	/* bytes read at once */
+	int		 mapped;	/* is buf mmap()ed? */
+	int		 eof;		/* does buf end at fd's end? */
+	int		 nthread;	/* threads csv_getrecord parses with */
+	struct csvpar	*par;		/* parallel parse of buf, or NULL */
+	struct csvchunk	*chunk;		/* chunk csv_getrecord reads, or NULL */
 };
 
 /* initializes a struct csvstate with null pointers and default settings */
 static const struct csvstate CSV_INITIALIZER = {
 	.maxline = 512,
+	.maxsline = 512,
 	.maxfield = 32,
-	.sep = ","
+	.dialect = {.sep = ",", .quote = '"', .nl = '\n'},
+	.fd = -1,
+	.recoff = -1,
+	.blksize = 1 << 22,
+	.nthread = 1
 };
 
+static int	csv_compile(struct csvclass *, const struct csvdialect *,
+		    const char *);
+static int	csv_project(struct csvstate *, const size_t *, size_t);
 static int	csv_readline(struct csvstate *, FILE *);
-static void	csv_splitstr(struct csvstate *);
-static size_t	advquoted(struct csvstate *, char *);
-static size_t	advunquoted(struct csvstate *, char *);
+static int	csv_readblock(struct csvstate *);
+static const char *csv_splitrec(struct csvstate *, const char *,
+		    const char *);
+static int	csv_splitscan(struct csvstate *, const char *, const char *,
+		    const char **);
+static const char *csv_splitfields(struct csvstate *, const char *,
+		    const char *);
+static int	csv_addslice(struct csvstate *, size_t, size_t, size_t,
+		    size_t);
+static void	csv_startfields(struct csvstate *);
+static struct csvslice *csv_nextslice(struct csvstate *);
+static struct csvslice *csv_newslice(struct csvstate *);
+static int	csv_copyfields(struct csvstate *);
+static const char *advquoted(struct csvstate *, const char *, const char *,
+		    struct csvslice *);
+static const char *advunquoted(struct csvstate *, const char *,
+		    const char *, struct csvslice *);
+static const char *advtext(struct csvstate *, const char *, const char *,
+		    int *);
+static int	isrecend(const struct csvclass *, const char *, const char *);
+static int	isdelimat(const struct csvclass *, const char *, const char *);
+static int	csv_replay(struct csvstate *);
+static const char *csv_parnext(struct csvstate *);
+static struct csvpar *csv_parstart(struct csvstate *,
+		    int (*)(struct csvstate *, void *), void *);
+static int	csv_parend(struct csvpar *, int);
+static void	*csv_work(void *);
+static int	csv_parsechunk(struct csvstate *, struct csvchunk *,
+		    const struct csvstate *, size_t, size_t);
+static size_t	csv_speculate(const struct csvstate *, size_t);
+static int	isdelim(const struct csvclass *, int);
+static void	*grow(void *, size_t *, size_t, size_t);
 
 /* csv_init: init state, return state
  * call csv_destroy() to free the state's resources, and before reusing a
@@ -44,10 +178,14 @@ csv_init(struct csvstate *state)
 		if ((state = malloc(sizeof(*state))) == NULL)
 				return (NULL);
 	*state = CSV_INITIALIZER;
+	csv_compile(&state->cls, &state->dialect, NULL);
 	if ((state->line = malloc(state->maxline * sizeof(*state->line)))
 	    == NULL)
 		goto err;
-	if ((state->sline = malloc(state->maxline * sizeof(*state->sline)))
+	if ((state->sline = malloc(state->maxsline * sizeof(*state->sline)))
+	    == NULL)
+		goto err;
+	if ((state->slice = calloc(state->maxfield, sizeof(*state->slice)))
 	    == NULL)
 		goto err;
 	if ((state->field = calloc(state->maxfield, sizeof(*state->field)))
@@ -57,6 +195,7 @@ csv_init(struct csvstate *state)
 err:
 	free(state->line);
 	free(state->sline);
+	free(state->slice);
 	free(state->field);
 	if (ostate == NULL)
 		free(state);
@@ -64,11 +203,31 @@ err:
 }
 
 /* csv_setopt: set csvstate options
- * Currently only supports setting the separator.
+ * CSV_SEP takes a string of separator chars, any of which separates fields,
+ * and whether csv_destroy must free it.
+ * CSV_DIALECT takes a const struct csvdialect *, which is copied, and replaces
+ * CSV_SEP.
+ * CSV_BLKSIZE takes the size_t number of bytes csv_getrecord reads at once,
+ * when it can't map its input, or that a thread parses at once when it can.
+ * CSV_NTHREAD takes the int number of threads that csv_getrecord and
+ * csv_parallel parse a mapped input with.
+ * CSV_PROJECT takes a const size_t * array of 0-indexed columns and its size_t
+ * length. Field i of a record is then its column i of the array, or missing
+ * if it has no such column. Columns not in the array are only skipped over,
+ * and past the last of them the parser only looks for the record's end. An
+ * empty array reads every column again.
+ *
+ * Returns -1 on malloc error, or with errno set to EINVAL on an unknown cmd, a
+ * 0 block size, less than one thread, a dialect csv_compile rejects or a
+ * column given twice.
  */
 int
 csv_setopt(struct csvstate *state, int cmd, ...)
 {
+	const struct csvdialect *dp;
+	struct csvclass cls;
+	const size_t *cols;
+	size_t ncol;
 	va_list ap;
 	int ret = -1;
 
@@ -80,11 +239,41 @@ csv_setopt(struct csvstate *state, int cmd, ...)
 		state->sep = va_arg(ap, char *);
 		state->sepalloc = va_arg(ap, int);
 		state->sepalloc = !!state->sepalloc;
+		csv_compile(&state->cls, &state->dialect, state->sep);
+		break;
+	case CSV_DIALECT:
+		dp = va_arg(ap, const struct csvdialect *);
+		if (csv_compile(&cls, dp, NULL) == -1)
+			goto inval;
+		if (state->sepalloc)
+			free((void *)state->sep);
+		state->sep = NULL;
+		state->sepalloc = 0;
+		state->dialect = *dp;
+		state->cls = cls;
+		break;
+	case CSV_BLKSIZE:
+		if ((state->blksize = va_arg(ap, size_t)) == 0)
+			goto inval;
+		break;
+	case CSV_NTHREAD:
+		if ((state->nthread = va_arg(ap, int)) < 1)
+			goto inval;
+		break;
+	case CSV_PROJECT:
+		cols = va_arg(ap, const size_t *);
+		ncol = va_arg(ap, size_t);
+		if (csv_project(state, cols, ncol) == -1)
+			goto end;
+		break;
 	default:
-		goto end;
+		goto inval;
 	}
 
 	ret = 0;
+	goto end;
+inval:
+	errno = EINVAL;
 end:
 	va_end(ap);
 	return (ret);
@@ -94,117 +283,1198 @@ end:
 void
 csv_destroy(struct csvstate *state)
 {
+	if (state->par != NULL)
+		csv_parend(state->par, 1);
 	free(state->line);
 	free(state->sline);
+	free(state->slice);
 	free(state->field);
+	free(state->proj);
+	free(state->colmap);
+	if (state->sepalloc)
+		free((void *)state->sep);
+	if (state->mapped)
+		munmap(state->buf, state->buflen);
+	else
+		free(state->buf);
 }
 
 /* csv_nfield: return number of fields */
 size_t
 csv_nfield(struct csvstate *state)
 {
-	if (state->nfield == 0)
-		csv_splitstr(state);
 	return (state->nfield);
 }
 
-/* csv_field: return 0-indexed field n */
+/* csv_field: return 0-indexed field n
+ * The fields are unescaped, null terminated copies, made the first time a
+ * field of the record is asked for. csv_getslice doesn't copy.
+ *
+ * Returns NULL if there's no field n, or on malloc error.
+ */
 char *
 csv_getfield(struct csvstate *state, size_t n)
 {
 	if (n >= csv_nfield(state))
 		return (NULL);
+	if (!state->copied && csv_copyfields(state) == -1)
+		return (NULL);
 	return (state->field[n]);
 }
 
+/* csv_getslice: return 0-indexed field n as a slice of the record
+ * The slice is valid until the next record is read.
+ *
+ * Returns NULL if there's no field n.
+ */
+const struct csvslice *
+csv_getslice(struct csvstate *state, size_t n)
+{
+	if (n >= csv_nfield(state) || state->slice[n].ptr == NULL)
+		return (NULL);
+	return (&state->slice[n]);
+}
+
+/* csv_unescape: copy the value of the field in slice to buf, return its length
+ * buf must have room for slice->len + 1 chars, the value is null terminated.
+ * A quoted field's doubled quotes become one, and its closing quote is dropped.
+ * An escaped char is copied without its escape.
+ */
+size_t
+csv_unescape(const struct csvslice *slice, char *buf)
+{
+	size_t i, j;
+	int inquote;
+
+	if (!slice->escaped) {
+		memcpy(buf, slice->ptr, slice->len);
+		buf[slice->len] = '\0';
+		return (slice->len);
+	}
+	inquote = slice->escaped == SLICE_QUOTED;
+	for (i = j = 0; j < slice->len; j++) {
+		if (slice->esc != '\0' && slice->ptr[j] == slice->esc &&
+		    j + 1 < slice->len) {
+			buf[i++] = slice->ptr[++j];
+		} else if (!inquote || slice->ptr[j] != slice->quote) {
+			buf[i++] = slice->ptr[j];
+		} else if (j + 1 < slice->len &&
+		    slice->ptr[j + 1] == slice->quote) {
+			buf[i++] = slice->quote;
+			j++;
+		} else {
+			/* The closing quote, anything after it is kept. */
+			inquote = 0;
+		}
+	}
+	buf[i] = '\0';
+	return (i);
+}
+
 /* csv_getline: read a single csv line, return an untouched pointer to it
  * The buffer behind the pointer is this function's property and in addition to
- * being read-only must not be freed.
+ * being read-only must not be freed. A quoted field ends with the line.
  *
  * Returns NULL on error.
  */
 const char *
 csv_getline(struct csvstate *state, FILE *fp)
 {
+	state->recoff = -1;
 	return (csv_readline(state, fp) == -1 ? NULL : state->line);
 }
 
+/* csv_setfd: make fd the input of csv_getrecord
+ * A regular file is mapped, anything else is read blksize bytes at a time.
+ * fd isn't closed by csv_destroy. Can only be called once per state.
+ *
+ * Returns -1 on error.
+ */
+int
+csv_setfd(struct csvstate *state, int fd)
+{
+	struct stat sb;
+	void *base;
+
+	if (state->fd != -1) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if (fstat(fd, &sb) == -1)
+		return (-1);
+	state->fd = fd;
+	if (!S_ISREG(sb.st_mode) || sb.st_size == 0 ||
+	    (uintmax_t)sb.st_size > SIZE_MAX)
+		return (0);
+	/* Not all regular files can be mapped, those are read. */
+	if ((base = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0))
+	    == MAP_FAILED)
+		return (0);
+	posix_madvise(base, sb.st_size, POSIX_MADV_SEQUENTIAL);
+	state->buf = base;
+	state->buflen = sb.st_size;
+	state->mapped = 1;
+	state->eof = 1;
+	return (0);
+}
+
+/* csv_sniffinput: guess the dialect of the fd set by csv_setfd with csv_sniff
+ * The first blksize bytes are read if it isn't mapped, and stay buffered for
+ * csv_getrecord. The dialect guessed isn't set.
+ *
+ * Returns -1 on error, or with errno set to EINVAL if there's no fd, or
+ * records were read from it.
+ */
+int
+csv_sniffinput(struct csvstate *state, struct csvdialect *d)
+{
+	if (state->fd == -1 || state->bufoff > 0 || state->par != NULL) {
+		errno = EINVAL;
+		return (-1);
+	}
+	while (!state->eof && state->buflen < state->blksize)
+		if (csv_readblock(state) == -1)
+			return (-1);
+	return (csv_sniff(state->buf, MIN(state->buflen, state->blksize), d));
+}
+
+/* csv_getrecord: read a single record from the fd set by csv_setfd, return a
+ * pointer to it and set *len to its length
+ * Records end with a newline outside of quotes, so unlike lines they can hold
+ * newlines in quoted fields. The record isn't null terminated, and is valid
+ * until the next record is read.
+ * A mapped input is parsed ahead by CSV_NTHREAD threads if more than one, the
+ * records still come in order.
+ *
+ * Returns NULL on end of file or error.
+ */
+const char *
+csv_getrecord(struct csvstate *state, size_t *len)
+{
+	const char *p, *lim, *end;
+
+	state->nfield = 0;
+	if (state->chunk != NULL && state->par == NULL) {
+		/* A chunk given to a csv_parallel callback. */
+		if (csv_replay(state) != 1)
+			return (NULL);
+		*len = state->reclen;
+		return (state->rec);
+	}
+	if (state->mapped && state->nthread > 1) {
+		if (state->par == NULL &&
+		    (state->par = csv_parstart(state, NULL, NULL)) == NULL)
+			return (NULL);
+		if ((p = csv_parnext(state)) != NULL)
+			*len = state->reclen;
+		return (p);
+	}
+	for (;;) {
+		if (state->bufoff == state->buflen) {
+			if (state->eof)
+				return (NULL);
+			if (csv_readblock(state) == -1)
+				return (NULL);
+			continue;
+		}
+		p = state->buf + state->bufoff;
+		lim = state->buf + state->buflen;
+		if ((end = csv_splitrec(state, p, lim)) == NULL)
+			return (NULL);
+		if (end < lim || state->eof)
+			break;
+		/* The record goes on past buf, split it again with more. */
+		if (csv_readblock(state) == -1)
+			return (NULL);
+	}
+	state->bufoff = end - state->buf + (end < lim);
+	state->recoff = state->bufpos + (state->rec - state->buf);
+	*len = state->reclen;
+	return (state->rec);
+}
+
+/* csv_tell: return the offset in the fd set by csv_setfd of the last record
+ * csv_getrecord read
+ * Returns -1 with errno set to EINVAL if no record was read from the fd.
+ */
+off_t
+csv_tell(struct csvstate *state)
+{
+	if (state->recoff == -1)
+		errno = EINVAL;
+	return (state->recoff);
+}
+
+/* csv_seek: make the record at offset off of the fd set by csv_setfd the next
+ * one csv_getrecord reads
+ * off must be where a record starts, as csv_tell returns it. An input that
+ * isn't mapped is read from off again, unless off is still buffered. A
+ * parallel parse is stopped, and starts over at off.
+ *
+ * Returns -1 on error, or with errno set to EINVAL if there's no fd, off is
+ * past the end of a mapped input, or state is a csv_parallel callback's.
+ */
+int
+csv_seek(struct csvstate *state, off_t off)
+{
+	if (state->fd == -1 || off < 0 ||
+	    (state->mapped && (uintmax_t)off > state->buflen) ||
+	    (state->chunk != NULL && state->par == NULL)) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if (state->par != NULL) {
+		csv_parend(state->par, 1);
+		state->par = NULL;
+		state->chunk = NULL;
+	}
+	state->nfield = 0;
+	state->recoff = -1;
+	if (off >= state->bufpos && off - state->bufpos <=
+	    (off_t)state->buflen) {
+		state->bufoff = off - state->bufpos;
+		return (0);
+	}
+	if (lseek(state->fd, off, SEEK_SET) == -1)
+		return (-1);
+	state->bufpos = off;
+	state->buflen = state->bufoff = 0;
+	state->eof = 0;
+	return (0);
+}
+
+/* csv_parallel: call fn for every chunk of the fd set by csv_setfd, from
+ * CSV_NTHREAD threads
+ * fn's state is the thread's own, and its csv_getrecord returns the records of
+ * the chunk in order. Chunks are blksize bytes apart, are given to fn in no
+ * particular order, and several at a time. An input that isn't mapped, or is
+ * parsed by one thread, is a single chunk, and fn gets state itself. Records
+ * already read with csv_getrecord, or before csv_seek's offset, aren't in any
+ * chunk.
+ *
+ * Returns -1 on error, or if fn returns -1, which stops the other threads from
+ * calling it again.
+ */
+int
+csv_parallel(struct csvstate *state, int (*fn)(struct csvstate *, void *),
+    void *arg)
+{
+	struct csvpar *par;
+
+	if (!state->mapped || state->nthread == 1 || state->par != NULL)
+		return (fn(state, arg));
+	if ((par = csv_parstart(state, fn, arg)) == NULL)
+		return (-1);
+	state->bufoff = state->buflen;
+	return (csv_parend(par, 0));
+}
+
+/* csv_compile: compile dialect d into cls, with the separator chars of set if
+ * it isn't NULL
+ * A dialect's separator can't hold its quote or esc, nor newlines. Its quote
+ * and esc can't be newlines either, and an esc that is its quote is none.
+ *
+ * Returns -1 with errno set to EINVAL if d can't be compiled.
+ */
+static int
+csv_compile(struct csvclass *cls, const struct csvdialect *d,
+    const char *set)
+{
+	const char *sep = set != NULL ? set : d->sep;
+	char esc = d->esc != d->quote ? d->esc : '\0';
+	size_t i, len;
+
+	len = set != NULL ? strlen(set) : strnlen(d->sep, CSV_MAXSEP + 1);
+
+	if ((set == NULL && (len == 0 || len > CSV_MAXSEP)) ||
+	    (d->nl != '\n' && d->nl != '\r') ||
+	    d->quote == '\n' || d->quote == '\r' ||
+	    esc == '\n' || esc == '\r')
+		goto inval;
+	memset(cls, 0, sizeof(*cls));
+	cls->scan = len <= CSV_MAXSEP;
+	for (i = 0; i < len; i++) {
+		if (sep[i] == '\n' || sep[i] == '\r' ||
+		    (d->quote != '\0' && sep[i] == d->quote) ||
+		    (esc != '\0' && sep[i] == esc)) {
+			if (set == NULL)
+				goto inval;
+			cls->scan = 0;
+		}
+		if (set != NULL || i == 0)
+			cls->tab[(unsigned char)sep[i]] |= CSV_CSEP;
+		if (set != NULL || i == len - 1)
+			cls->tab[(unsigned char)sep[i]] |= CSV_CSEPEND;
+	}
+	if (cls->scan)
+		memcpy(cls->sepchars, sep, set != NULL ? len : 1);
+	if (set == NULL)
+		memcpy(cls->sep, sep, len);
+	cls->seplen = set != NULL ? 1 : len;
+	cls->quote = d->quote;
+	cls->esc = esc;
+	cls->nl = d->nl;
+	if (cls->quote != '\0')
+		cls->tab[(unsigned char)cls->quote] |= CSV_CQUOTE;
+	if (cls->esc != '\0')
+		cls->tab[(unsigned char)cls->esc] |= CSV_CESC;
+	cls->tab[(unsigned char)cls->nl] |= CSV_CNL;
+	if (cls->nl == '\n')
+		cls->tab['\r'] |= CSV_CCR;
+	return (0);
+inval:
+	errno = EINVAL;
+	return (-1);
+}
+
+/* csv_project: only split the ncol columns in cols out of records
+ * Returns -1 on malloc error, or with errno set to EINVAL if a column is given
+ * twice.
+ */
+static int
+csv_project(struct csvstate *state, const size_t *cols, size_t ncol)
+{
+	size_t *proj = NULL, *colmap = NULL, ncolmap = 0, i;
+	void *tp;
+
+	for (i = 0; i < ncol; i++)
+		if (cols[i] >= ncolmap)
+			ncolmap = cols[i] + 1;
+	if (ncol > 0 && ((proj = malloc(ncol * sizeof(*proj))) == NULL ||
+	    (colmap = calloc(ncolmap, sizeof(*colmap))) == NULL))
+		goto err;
+	for (i = 0; i < ncol; i++) {
+		if (colmap[cols[i]] != 0) {
+			errno = EINVAL;
+			goto err;
+		}
+		colmap[cols[i]] = i + 1;
+		proj[i] = cols[i];
+	}
+	/* Every column in proj has a slice, even if it's missing. */
+	if (ncol > state->maxfield) {
+		if ((tp = realloc(state->slice, ncol * sizeof(*state->slice)))
+		    == NULL)
+			goto err;
+		state->slice = tp;
+		if ((tp = realloc(state->field, ncol * sizeof(*state->field)))
+		    == NULL)
+			goto err;
+		state->field = tp;
+		state->maxfield = ncol;
+	}
+	free(state->proj);
+	free(state->colmap);
+	state->proj = proj;
+	state->nproj = ncol;
+	state->colmap = colmap;
+	state->ncolmap = ncolmap;
+	return (0);
+err:
+	free(proj);
+	free(colmap);
+	return (-1);
+}
+
 /* csv_readline: read line into csvstate, update structures accordingly
  * Returns -1 on error.
  */
 static int
 csv_readline(struct csvstate *state, FILE *fp)
 {
-	const size_t oldmaxline = state->maxline;
-	size_t nread;
-	void *tp;
+	ssize_t nread;
 	int retval = -1;
 
 	/*
 	 * nread == strlen(state->line) after this function call,
 	 * state->line[nread] is the line's null terminator.
 	 */
-	if ((nread = getline(&state->line, &state->maxline, fp)) == -1)
+	if ((nread = getdelim(&state->line, &state->maxline, state->cls.nl,
+	    fp)) == -1)
+		goto end;
+	if (nread > 0 && state->line[nread - 1] == state->cls.nl)
+		nread--;
+	if (state->cls.nl == '\n' && nread > 0 &&
+	    state->line[nread - 1] == '\r')
+		nread--;
+	if (csv_splitrec(state, state->line, state->line + nread) == NULL)
 		goto end;
-	if (oldmaxline < state->maxline) {
-		if ((tp = realloc(state->sline, state->maxline)) == NULL)
-			goto end;
-		state->sline = tp;
-	}
-	state->linelen = nread;
-	nread++; /* add space for null terminator */
-	memcpy(state->sline, state->line, nread);
-	state->nfield = 0;
 	retval = 0;
 end:
 	return (retval);
 }
 
-/* csv_splitstr: split CSV string into fields, update state. */
-static void
-csv_splitstr(struct csvstate *state)
-{
-	size_t flen;
-	char *p;
-	p = state->nfield == 0 ? state->sline : state->field[state->nfield];
-	while (p - state->sline < state->linelen) {
-		if (*p == '"')
-			flen = advquoted(state, ++p); /* ++p skips the quote */
+/* csv_readblock: move the unread part of buf to its start, and read at least
+ * one more byte after it, or up to the end of file
+ * buf is grown if the unread part fills it.
+ *
+ * Returns -1 on error.
+ */
+static int
+csv_readblock(struct csvstate *state)
+{
+	ssize_t nread;
+	size_t size;
+	void *tp;
+
+	if (state->bufoff > 0) {
+		state->bufpos += state->bufoff;
+		state->buflen -= state->bufoff;
+		memmove(state->buf, state->buf + state->bufoff, state->buflen);
+		state->bufoff = 0;
+	}
+	if (state->maxbuf - state->buflen < state->blksize) {
+		size = state->buflen + state->blksize;
+		if (size < state->maxbuf * 2)
+			size = state->maxbuf * 2;
+		if ((tp = realloc(state->buf, size)) == NULL)
+			return (-1);
+		state->buf = tp;
+		state->maxbuf = size;
+	}
+	while ((nread = read(state->fd, state->buf + state->buflen,
+	    state->maxbuf - state->buflen)) == -1)
+		if (errno != EINTR)
+			return (-1);
+	if (nread == 0)
+		state->eof = 1;
+	state->buflen += nread;
+	return (0);
+}
+
+/* csv_splitrec: split the record starting at p into slices, update state
+ * The record ends at the first newline outside of quotes, or at lim. A
+ * carriage return before the newline isn't part of the record. An empty
+ * record has no fields, otherwise there's one more field than there are
+ * separators outside of quotes. Newlines are the dialect's nl.
+ *
+ * Returns a pointer to the record's newline, or lim if it has none.
+ * Returns NULL on malloc error.
+ */
+static const char *
+csv_splitrec(struct csvstate *state, const char *p, const char *lim)
+{
+	const char *end;
+	int ret = 0;
+
+	state->copied = 0;
+	state->rec = p;
+	csv_startfields(state);
+	if (!state->cls.scan ||
+	    (ret = csv_splitscan(state, p, lim, &end)) == 1) {
+		csv_startfields(state);
+		end = csv_splitfields(state, p, lim);
+	} else if (ret == -1) {
+		end = NULL;
+	}
+	if (end == NULL)
+		return (NULL);
+	state->reclen = end - p;
+	if (state->cls.nl == '\n' && end < lim && end > p && end[-1] == '\r')
+		state->reclen--;
+	if (state->reclen == 0)
+		state->nfield = 0;
+	return (end);
+}
+
+/* csv_splitscan: split the record at p CSV_BLOCK bytes at a time, set *endp to
+ * its newline or lim
+ * The separators, quotes and newlines of a block are found at once by
+ * csv_classify, and the bytes inside quotes are the prefix xor of the quote
+ * mask. That only agrees with advquoted if every quote that opens a quoted
+ * region starts a field, or follows the quote that closed one (a doubled
+ * quote). Anywhere else advquoted and advunquoted take a quote literally, and
+ * the record is left to csv_splitfields, as it is if it has an escape.
+ * A separator of more than one byte is checked where its first byte is, and
+ * doesn't start within the one before it.
+ *
+ * Returns -1 on malloc error.
+ * Returns 1 if the record must be split by csv_splitfields.
+ */
+static int
+csv_splitscan(struct csvstate *state, const char *p, const char *lim,
+    const char **endp)
+{
+	const struct csvclass *cls = &state->cls;
+	char pad[CSV_BLOCK];
+	struct csvmask mask;
+	const char *block;
+	uint64_t inquote = 0, prevbit = 1, in, nl, bits;
+	size_t len, off, pos, end, start = 0, nquote = 0, lastquote = 0;
+	int i;
+
+	len = end = lim - p;
+	for (off = 0; off < len; off += CSV_BLOCK) {
+		block = p + off;
+		if (len - off < CSV_BLOCK) {
+			/* Don't read past lim, \0 is nothing to us. */
+			memset(pad, '\0', sizeof(pad));
+			memcpy(pad, block, len - off);
+			block = pad;
+		}
+		csv_classify(block, cls, &mask);
+		in = csv_prefixxor(mask.quote) ^ inquote;
+		inquote = (uint64_t)0 - (in >> 63);
+		/* Nothing past the record's newline is ours. */
+		if ((nl = mask.nl & ~in) != 0) {
+			mask.sep &= (nl & -nl) - 1;
+			mask.quote &= (nl & -nl) - 1;
+			mask.esc &= (nl & -nl) - 1;
+		}
+		if (mask.esc != 0)
+			return (1);
+		if (cls->seplen == 1 && (mask.quote & in) &
+		    ~((mask.sep | mask.quote) << 1 | prevbit))
+			return (1);
+		prevbit = (mask.sep | mask.quote) >> 63;
+		mask.sep &= ~in;
+		/* Past the last column wanted, only the newline matters. A
+		 * longer separator still needs its quotes checked below. */
+		if (state->colmap != NULL && state->col >= state->ncolmap &&
+		    cls->seplen == 1)
+			mask.sep = mask.quote = 0;
+		for (bits = mask.sep | mask.quote; bits != 0;
+		    bits &= bits - 1) {
+			i = csv_ctz(bits);
+			pos = off + i;
+			if (mask.sep >> i & 1) {
+				if (cls->seplen > 1 && (pos < start ||
+				    !isdelimat(cls, p + pos, lim)))
+					continue;
+				if (csv_addslice(state, start, pos, nquote,
+				    lastquote) == -1)
+					return (-1);
+				start = pos + cls->seplen;
+				nquote = 0;
+			} else if (pos != start) {
+				if (cls->seplen > 1 && (in >> i & 1) &&
+				    p[pos - 1] != cls->quote)
+					return (1);
+				nquote++;
+				lastquote = pos;
+			}
+		}
+		if (nl != 0) {
+			end = off + csv_ctz(nl);
+			break;
+		}
+	}
+	*endp = p + end;
+	if (cls->nl == '\n' && end < len && end > start && p[end - 1] == '\r')
+		end--;
+	return (csv_addslice(state, start, end, nquote, lastquote));
+}
+
+/* csv_splitfields: split the record at p a field at a time, with advquoted
+ * and advunquoted
+ * Returns a pointer to the record's newline, or lim if it has none.
+ * Returns NULL on malloc error.
+ */
+static const char *
+csv_splitfields(struct csvstate *state, const char *p, const char *lim)
+{
+	const struct csvclass *cls = &state->cls;
+	struct csvslice *sp;
+
+	for (;; p += cls->seplen) {
+		if ((sp = csv_nextslice(state)) == NULL)
+			return (NULL);
+		/* +1 skips the quote */
+		if (p < lim && cls->quote != '\0' && *p == cls->quote)
+			p = advquoted(state, p + 1, lim, sp);
 		else
-			flen = advunquoted(state, p);
-		state->field[state->nfield++] = p;
-		p += flen + 1; /* +1 to skip over the terminating '\0' */
+			p = advunquoted(state, p, lim, sp);
+		if (isrecend(cls, p, lim))
+			break;
 	}
+	return (cls->nl == '\n' && p < lim && *p == '\r' ? p + 1 : p);
 }
 
-/* advquoted: advanced a quoted CSV, return field length
+/* csv_addslice: add the field from start to end of the record, as
+ * csv_splitscan found it
+ * nquote is the number of quotes in the field past its first byte, lastquote
+ * is where the last one is. A quoted field needs to be unescaped unless its
+ * only other quote is the last byte, or it has none.
+ *
+ * Returns -1 on malloc error.
+ */
+static int
+csv_addslice(struct csvstate *state, size_t start, size_t end, size_t nquote,
+    size_t lastquote)
+{
+	struct csvslice *sp;
+
+	if ((sp = csv_nextslice(state)) == NULL)
+		return (-1);
+	if (sp == &state->skip)
+		return (0);
+	sp->ptr = state->rec + start;
+	sp->len = end - start;
+	sp->escaped = 0;
+	if (start == end || state->cls.quote == '\0' ||
+	    state->rec[start] != state->cls.quote)
+		return (0);
+	sp->ptr++;
+	sp->len--;
+	if (nquote == 1 && lastquote == end - 1) {
+		sp->len--;
+	} else if (nquote > 0) {
+		sp->escaped = SLICE_QUOTED;
+		sp->quote = state->cls.quote;
+		sp->esc = state->cls.esc;
+	}
+	return (0);
+}
+
+/* csv_startfields: start splitting a record, with no fields
+ * With a projection, every column in it has a slice, missing until it's
+ * found.
+ */
+static void
+csv_startfields(struct csvstate *state)
+{
+	size_t i;
+
+	state->nfield = 0;
+	state->col = 0;
+	if (state->colmap == NULL)
+		return;
+	for (i = 0; i < state->nproj; i++) {
+		state->slice[i].ptr = NULL;
+		state->slice[i].len = 0;
+		state->slice[i].escaped = 0;
+	}
+	state->nfield = state->nproj;
+}
+
+/* csv_nextslice: return the slice of the next field split
+ * A column not in the projection gets state's skip slice.
+ * Returns NULL on malloc error.
+ */
+static struct csvslice *
+csv_nextslice(struct csvstate *state)
+{
+	size_t col;
+
+	if (state->colmap == NULL)
+		return (csv_newslice(state));
+	col = state->col++;
+	if (col < state->ncolmap && state->colmap[col] != 0)
+		return (&state->slice[state->colmap[col] - 1]);
+	return (&state->skip);
+}
+
+/* csv_newslice: return the next free slice, making room for it
+ * Returns NULL on malloc error.
+ */
+static struct csvslice *
+csv_newslice(struct csvstate *state)
+{
+	void *tp;
+
+	if (state->nfield == state->maxfield) {
+		if ((tp = realloc(state->slice, state->maxfield * 2 *
+		    sizeof(*state->slice))) == NULL)
+			return (NULL);
+		state->slice = tp;
+		if ((tp = realloc(state->field, state->maxfield * 2 *
+		    sizeof(*state->field))) == NULL)
+			return (NULL);
+		state->field = tp;
+		state->maxfield *= 2;
+	}
+	return (&state->slice[state->nfield++]);
+}
+
+/* csv_copyfields: point field[] to null terminated, unescaped copies of the
+ * record's fields
+ * Every field is copied to where it is in the record, which leaves room for
+ * its terminator where its separator was.
+ *
+ * Returns -1 on malloc error.
+ */
+static int
+csv_copyfields(struct csvstate *state)
+{
+	const struct csvslice *sp;
+	size_t i;
+	void *tp;
+
+	if (state->maxsline < state->reclen + 1) {
+		if ((tp = realloc(state->sline, state->reclen + 1)) == NULL)
+			return (-1);
+		state->sline = tp;
+		state->maxsline = state->reclen + 1;
+	}
+	for (i = 0; i < state->nfield; i++) {
+		sp = &state->slice[i];
+		if (sp->ptr == NULL) {
+			state->field[i] = NULL;
+			continue;
+		}
+		state->field[i] = state->sline + (sp->ptr - state->rec);
+		csv_unescape(sp, state->field[i]);
+	}
+	state->copied = 1;
+	return (0);
+}
+
+/* advquoted: advance a quoted CSV field, set its slice, return a pointer to
+ * the separator or the end of the record after it
  * Skip the quote before calling this function.
  */
-static size_t
-advquoted(struct csvstate *state, char *p)
-{
-	size_t i, j, k;
-	for (i = j = 0; p[j] != '\0'; i++, j++) {
-		if (p[j] == '"' && p[++j] != '"') {
-			/* copy up to next separator or \0 */
-			k = strcspn(p + j, state->sep);
-			memmove(p + i, p + j, k);
-			i += k;
+static const char *
+advquoted(struct csvstate *state, const char *p, const char *lim,
+    struct csvslice *slice)
+{
+	const struct csvclass *cls = &state->cls;
+	const char *q;
+
+	slice->ptr = p;
+	slice->escaped = 0;
+	slice->quote = cls->quote;
+	slice->esc = cls->esc;
+	for (q = p; q < lim; q++) {
+		if (!(cls->tab[(unsigned char)*q] & (CSV_CQUOTE | CSV_CESC)))
+			continue;
+		if (*q == cls->esc) {
+			slice->escaped = SLICE_QUOTED;
+			if (q + 1 < lim)
+				q++;
+			continue;
+		}
+		if (q + 1 < lim && q[1] == cls->quote) {
+			slice->escaped = SLICE_QUOTED;
+			q++;
+			continue;
+		}
+		/* The closing quote, copy up to the next separator. */
+		if (!isrecend(cls, q + 1, lim) && !isdelimat(cls, q + 1, lim)) {
+			slice->escaped = SLICE_QUOTED;
+			q = advtext(state, q, lim, NULL);
+		} else if (slice->escaped) {
+			q++;
+		} else {
+			slice->len = q - p;
+			return (q + 1);
+		}
+		slice->len = q - p;
+		return (q);
+	}
+	/* No closing quote, the field runs to lim. */
+	slice->len = lim - p;
+	return (lim);
+}
+
+/* advunquoted: advance an unquoted CSV field, set its slice, return a pointer
+ * to the separator or the end of the record after it
+ */
+static const char *
+advunquoted(struct csvstate *state, const char *p, const char *lim,
+    struct csvslice *slice)
+{
+	const char *q;
+	int escaped = 0;
+
+	q = advtext(state, p, lim, &escaped);
+	slice->ptr = p;
+	slice->len = q - p;
+	slice->escaped = escaped ? SLICE_UNQUOTED : 0;
+	slice->quote = state->cls.quote;
+	slice->esc = state->cls.esc;
+	return (q);
+}
+
+/* advtext: return a pointer to the first separator or end of record from p
+ * An escaped char is skipped, and sets *escaped if escaped isn't NULL.
+ */
+static const char *
+advtext(struct csvstate *state, const char *p, const char *lim, int *escaped)
+{
+	const struct csvclass *cls = &state->cls;
+
+	for (; p < lim; p++) {
+		if (!(cls->tab[(unsigned char)*p] &
+		    (CSV_CSEP | CSV_CESC | CSV_CNL | CSV_CCR)))
+			continue;
+		if (*p == cls->esc) {
+			if (escaped != NULL)
+				*escaped = 1;
+			if (p + 1 < lim)
+				p++;
+			continue;
+		}
+		if (isrecend(cls, p, lim) || isdelimat(cls, p, lim))
+			break;
+	}
+	return (p);
+}
+
+/* isrecend: is p lim, or the newline or carriage return ending a record? */
+static int
+isrecend(const struct csvclass *cls, const char *p, const char *lim)
+{
+	return (p == lim || *p == cls->nl || (cls->nl == '\n' &&
+	    *p == '\r' && p + 1 < lim && p[1] == '\n'));
+}
+
+/* isdelimat: does a separator start at p, before lim? */
+static int
+isdelimat(const struct csvclass *cls, const char *p, const char *lim)
+{
+	return ((cls->tab[(unsigned char)*p] & CSV_CSEP) &&
+	    (cls->seplen == 1 || ((size_t)(lim - p) >= cls->seplen &&
+	    memcmp(p, cls->sep, cls->seplen) == 0)));
+}
+
+/* csv_replay: make the next record of state's chunk the current one
+ * Returns -1 on malloc error.
+ * Returns 0 at the end of the chunk.
+ * Returns 1 otherwise.
+ */
+static int
+csv_replay(struct csvstate *state)
+{
+	struct csvchunk *c = state->chunk;
+	const struct csvrecord *rp;
+
+	state->nfield = 0;
+	state->copied = 0;
+	state->recoff = -1;
+	if (c->cur == c->nrec)
+		return (0);
+	rp = &c->rec[c->cur++];
+	state->recoff = rp->ptr - c->buf;
+	while (state->nfield < rp->nfield)
+		if (csv_newslice(state) == NULL)
+			return (-1);
+	memcpy(state->slice, c->slice + rp->slice,
+	    rp->nfield * sizeof(*state->slice));
+	state->rec = rp->ptr;
+	state->reclen = rp->len;
+	return (1);
+}
+
+/* csv_parnext: make the next record of state's parallel parse the current one
+ * and return it
+ * Returns NULL on end of file or error.
+ */
+static const char *
+csv_parnext(struct csvstate *state)
+{
+	struct csvpar *par = state->par;
+	int r;
+
+	for (;;) {
+		if (state->chunk != NULL) {
+			if ((r = csv_replay(state)) == -1)
+				return (NULL);
+			if (r == 1)
+				return (state->rec);
+		}
+		pthread_mutex_lock(&par->lock);
+		if (state->chunk != NULL) {
+			state->chunk->busy = 0;
+			state->chunk = NULL;
+			par->cur++;
+			pthread_cond_broadcast(&par->cond);
+		}
+		while (!par->stop && par->cur < par->nchunk &&
+		    par->nverified <= par->cur)
+			pthread_cond_wait(&par->cond, &par->lock);
+		if (par->failed || par->cur == par->nchunk) {
+			if (par->failed)
+				errno = par->error;
+			pthread_mutex_unlock(&par->lock);
+			return (NULL);
+		}
+		state->chunk = &par->chunk[par->cur % par->nslot];
+		state->chunk->cur = 0;
+		pthread_mutex_unlock(&par->lock);
+	}
+}
+
+/* csv_parstart: start a parallel parse of state's buf
+ * Without fn, the chunks are left for csv_parnext.
+ *
+ * Returns NULL on error.
+ */
+static struct csvpar *
+csv_parstart(struct csvstate *state, int (*fn)(struct csvstate *, void *),
+    void *arg)
+{
+	struct csvpar *par;
+	size_t i;
+	int error;
+
+	if ((par = calloc(1, sizeof(*par))) == NULL)
+		return (NULL);
+	par->state = state;
+	par->fn = fn;
+	par->arg = arg;
+	par->nslot = 2 * state->nthread;
+	par->base = par->vend = state->bufoff;
+	if (state->buflen > par->base)
+		par->nchunk = (state->buflen - par->base - 1) / state->blksize
+		    + 1;
+	if ((errno = pthread_mutex_init(&par->lock, NULL)) != 0)
+		goto err;
+	if ((errno = pthread_cond_init(&par->cond, NULL)) != 0) {
+		pthread_mutex_destroy(&par->lock);
+		goto err;
+	}
+	if ((par->chunk = calloc(par->nslot, sizeof(*par->chunk))) == NULL ||
+	    (par->tid = calloc(state->nthread, sizeof(*par->tid))) == NULL)
+		goto end;
+	for (i = 0; i < (size_t)state->nthread; i++) {
+		if ((errno = pthread_create(&par->tid[i], NULL, csv_work, par))
+		    != 0)
+			goto end;
+		par->nthr++;
+	}
+	return (par);
+end:
+	error = errno;
+	csv_parend(par, 1);
+	errno = error;
+	return (NULL);
+err:
+	free(par);
+	return (NULL);
+}
+
+/* csv_parend: wait for par's workers and free par
+ * If stop is true, the workers stop at their next chunk.
+ *
+ * Returns -1 if a worker or fn failed, with errno set to its errno.
+ */
+static int
+csv_parend(struct csvpar *par, int stop)
+{
+	size_t i;
+	int ret = 0;
+
+	if (stop) {
+		pthread_mutex_lock(&par->lock);
+		par->stop = 1;
+		pthread_cond_broadcast(&par->cond);
+		pthread_mutex_unlock(&par->lock);
+	}
+	for (i = 0; i < par->nthr; i++)
+		pthread_join(par->tid[i], NULL);
+	if (par->failed) {
+		errno = par->error;
+		ret = -1;
+	}
+	for (i = 0; par->chunk != NULL && i < par->nslot; i++) {
+		free(par->chunk[i].rec);
+		free(par->chunk[i].slice);
+	}
+	free(par->chunk);
+	free(par->tid);
+	pthread_cond_destroy(&par->cond);
+	pthread_mutex_destroy(&par->lock);
+	free(par);
+	return (ret);
+}
+
+/* csv_work: parse chunks of a csvpar until there are none left
+ * Each chunk is first parsed from the record csv_speculate guesses it starts
+ * with, and again if the guess was wrong. With a fn, it's given to fn once
+ * verified.
+ */
+static void *
+csv_work(void *arg)
+{
+	struct csvpar *par = arg;
+	const struct csvstate *state = par->state;
+	struct csvstate *ws;
+	struct csvchunk *c;
+	size_t i, off, lim, vend;
+	int r;
+
+	ws = csv_init(NULL);
+	pthread_mutex_lock(&par->lock);
+	if (ws == NULL)
+		goto err;
+	ws->cls = state->cls;
+	if (state->nproj > 0 &&
+	    csv_project(ws, state->proj, state->nproj) == -1)
+		goto err;
+	for (;;) {
+		while (!par->stop && par->next < par->nchunk &&
+		    par->chunk[par->next % par->nslot].busy)
+			pthread_cond_wait(&par->cond, &par->lock);
+		if (par->stop || par->next == par->nchunk)
 			break;
+		i = par->next++;
+		c = &par->chunk[i % par->nslot];
+		c->busy = 1;
+		pthread_mutex_unlock(&par->lock);
 
+		off = par->base + i * state->blksize;
+		lim = MIN(state->buflen, off + state->blksize);
+		r = csv_parsechunk(ws, c, state,
+		    i == 0 ? off : csv_speculate(state, off), lim);
+		pthread_mutex_lock(&par->lock);
+		while (!par->stop && par->nverified < i)
+			pthread_cond_wait(&par->cond, &par->lock);
+		if (par->stop)
+			break;
+		if (r == 0 && c->start != par->vend) {
+			/* Nothing changes vend until this chunk is verified. */
+			vend = par->vend;
+			pthread_mutex_unlock(&par->lock);
+			r = csv_parsechunk(ws, c, state, vend, lim);
+			pthread_mutex_lock(&par->lock);
 		}
-		p[i] = p[j];
+		if (r == -1)
+			goto err;
+		par->vend = c->end;
+		par->nverified++;
+		pthread_cond_broadcast(&par->cond);
+		if (par->fn == NULL)
+			continue;
+
+		pthread_mutex_unlock(&par->lock);
+		c->cur = 0;
+		ws->chunk = c;
+		r = par->fn(ws, par->arg);
+		ws->chunk = NULL;
+		pthread_mutex_lock(&par->lock);
+		c->busy = 0;
+		pthread_cond_broadcast(&par->cond);
+		if (r == -1)
+			goto err;
 	}
-	p[i] = '\0';
-	return (i);
+	goto end;
+err:
+	if (!par->failed) {
+		par->failed = 1;
+		par->error = errno;
+	}
+	par->stop = 1;
+	pthread_cond_broadcast(&par->cond);
+end:
+	pthread_mutex_unlock(&par->lock);
+	if (ws != NULL) {
+		csv_destroy(ws);
+		free(ws);
+	}
+	return (NULL);
 }
 
-/* advunquoted: advance an unquoted CSV, return field length */
+/* csv_parsechunk: split the records of state's buf starting between start and
+ * lim into c, with ws
+ * A record can go on past lim.
+ *
+ * Returns -1 on malloc error.
+ */
+static int
+csv_parsechunk(struct csvstate *ws, struct csvchunk *c,
+    const struct csvstate *state, size_t start, size_t lim)
+{
+	const char *p, *end, *buflim = state->buf + state->buflen;
+	struct csvrecord *rp;
+	void *tp;
+
+	c->buf = state->buf;
+	c->start = start;
+	c->nrec = c->nslice = 0;
+	for (p = state->buf + start; p < state->buf + lim;
+	    p = end + (end < buflim)) {
+		if ((end = csv_splitrec(ws, p, buflim)) == NULL)
+			return (-1);
+		if ((tp = grow(c->rec, &c->maxrec, c->nrec + 1,
+		    sizeof(*c->rec))) == NULL)
+			return (-1);
+		c->rec = tp;
+		if ((tp = grow(c->slice, &c->maxslice, c->nslice + ws->nfield,
+		    sizeof(*c->slice))) == NULL)
+			return (-1);
+		c->slice = tp;
+		rp = &c->rec[c->nrec++];
+		rp->ptr = ws->rec;
+		rp->len = ws->reclen;
+		rp->slice = c->nslice;
+		rp->nfield = ws->nfield;
+		memcpy(c->slice + c->nslice, ws->slice,
+		    ws->nfield * sizeof(*c->slice));
+		c->nslice += ws->nfield;
+	}
+	c->end = p - state->buf;
+	return (0);
+}
+
+/* csv_speculate: guess the offset of the first record of state's buf at or
+ * after off
+ * Whether off is inside quotes is guessed from the first quote after it that
+ * can only be an opening or a closing one. One after a delimiter and before
+ * anything but a delimiter or quote opens a field. One after anything but a
+ * delimiter or quote and before a delimiter closes one. Without such a quote
+ * in CSV_SPECWIN bytes, off is taken to be outside of quotes. The record starts
+ * after the first newline outside of quotes from there. Without one in
+ * CSV_SPECWIN bytes either, the guess is that no record starts in the chunk.
+ */
 static size_t
-advunquoted(struct csvstate *state, char *p)
+csv_speculate(const struct csvstate *state, size_t off)
 {
-	size_t span;
-	span = strcspn(p, state->sep);
-	p[span] = '\0';
-	return (span);
+	const struct csvclass *cls = &state->cls;
+	const char *buf = state->buf, *p, *lim;
+	int before, after, inquote = 0, parity = 0;
+
+	lim = buf + MIN(state->buflen, off + CSV_SPECWIN);
+	for (p = buf + off; p < lim && cls->quote != '\0'; p++) {
+		if (*p != cls->quote)
+			continue;
+		before = p[-1];
+		after = p + 1 < buf + state->buflen ? p[1] : cls->nl;
+		if (isdelim(cls, before) && !isdelim(cls, after) &&
+		    after != cls->quote) {
+			inquote = parity;
+			break;
+		}
+		if (!isdelim(cls, before) && before != cls->quote &&
+		    isdelim(cls, after)) {
+			inquote = !parity;
+			break;
+		}
+		parity = !parity;
+	}
+	if (!inquote && buf[off - 1] == cls->nl)
+		return (off);
+	for (p = buf + off; p < lim; p++) {
+		if (cls->quote != '\0' && *p == cls->quote)
+			inquote = !inquote;
+		else if (*p == cls->nl && !inquote)
+			return (p + 1 - buf);
+	}
+	return (state->buflen);
+}
+
+/* isdelim: can c be next to a separator or a newline? */
+static int
+isdelim(const struct csvclass *cls, int c)
+{
+	return (cls->tab[(unsigned char)c] &
+	    (CSV_CSEP | CSV_CSEPEND | CSV_CNL));
+}
+
+/* grow: make room for n members of size in p, which has room for *max
+ * p is allocated even if n is 0, so NULL is only returned on error.
+ *
+ * Returns the new p, or NULL on malloc error, where p is left as is.
+ */
+static void *
+grow(void *p, size_t *max, size_t n, size_t size)
+{
+	size_t newmax;
+
+	if (p != NULL && n <= *max)
+		return (p);
+	for (newmax = *max > 0 ? *max : 64; newmax < n; newmax *= 2)
+		;
+	if ((p = realloc(p, newmax * size)) != NULL)
+		*max = newmax;
+	return (p);
 }
@@ -1,19 +1,139 @@
 #if !defined(H_CSVLIB)
 #define H_CSVLIB
 
+#include <sys/types.h>
+
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
 
 enum { /* settings for csv_setopt */
 	CSV_SEP = 1 << 0,
+	CSV_BLKSIZE = 1 << 1,
+	CSV_NTHREAD = 1 << 2,
+	CSV_DIALECT = 1 << 3,
+	CSV_PROJECT = 1 << 4
+};
+
+enum {
+	/* longest separator of a csvdialect */
+	CSV_MAXSEP = 8
 };
 
-/* This struct must NOT be touched by the user. */
+enum { /* column types for csv_batchtype */
+	CSV_TSTRING,
+	CSV_TINT,
+	CSV_TDOUBLE
+};
+
+/* These structs must NOT be touched by the user. */
 struct csvstate;
+struct csvwriter;
+struct csvindex;
+
+/* How a CSV file is written.
+ * Fields are separated by the sep string, and may be quoted with the quote
+ * char to hold separators, quotes or newlines. A quote in a quoted field is
+ * doubled. If esc isn't '\0', it also makes the char after it part of the
+ * field, in or out of quotes. Records end with the nl char, '\n' or '\r'. A
+ * carriage return before a '\n' isn't part of the record.
+ * csvlib reads a header like any other record, header only says if there's
+ * one.
+ */
+struct csvdialect {
+	char		 sep[CSV_MAXSEP + 1];	/* null terminated */
+	char		 quote;		/* or '\0' if fields aren't quoted */
+	char		 esc;		/* or '\0' */
+	char		 nl;
+	int		 header;	/* is the first record a header? */
+};
+
+/* A field as a slice of the line read, valid until the next line is read.
+ * A quoted field's slice doesn't include its quotes. If escaped is true, the
+ * slice still holds doubled quotes, escapes or its closing quote, and
+ * csv_unescape must be used to get the field's value.
+ */
+struct csvslice {
+	const char	*ptr;
+	size_t		 len;
+	int		 escaped;
+	/* The rest must NOT be touched by the user. */
+	char		 quote;		/* the dialect's, if escaped */
+	char		 esc;
+};
+
+/* A column of a csvbatch, member i is the field of the batch's record i.
+ * A missing field is an empty string, and bad for a CSV_TINT or CSV_TDOUBLE
+ * column, as is a field that isn't entirely a number.
+ */
+struct csvcolumn {
+	size_t		*off;		/* offset of the value in data */
+	size_t		*len;		/* length of the value */
+	int		 type;
+	int64_t		*i;		/* values of a CSV_TINT column */
+	double		*d;		/* values of a CSV_TDOUBLE column */
+	unsigned char	*bad;		/* is the field missing or no number? */
+};
+
+/* Records read at once by csv_getbatch, column by column.
+ * Field values are unescaped and null terminated, in data. The arrays are
+ * valid until the next csv_getbatch.
+ */
+struct csvbatch {
+	size_t		 nrec;		/* number of records */
+	size_t		 ncol;		/* most fields in a record */
+	size_t		*nfield;	/* number of fields of each record */
+	struct csvcolumn *col;
+	char		*data;
+	/* The rest must NOT be touched by the user. */
+	size_t		 maxrec;	/* size of the columns' arrays */
+	size_t		 maxcol;	/* size of col[] */
+	size_t		 datalen;	/* bytes in data */
+	size_t		 maxdata;	/* size of data */
+};
 
 /* All functions cannot receive null pointers unless otherwise stated. */
 struct csvstate *csv_init(struct csvstate *);
+int		 csv_setopt(struct csvstate *, int, ...);
 void 		 csv_destroy(struct csvstate *);
+const char	*csv_getline(struct csvstate *, FILE *);
+int		 csv_setfd(struct csvstate *, int);
+int		 csv_sniff(const char *, size_t, struct csvdialect *);
+int		 csv_sniffinput(struct csvstate *, struct csvdialect *);
+const char	*csv_getrecord(struct csvstate *, size_t *);
+off_t		 csv_tell(struct csvstate *);
+int		 csv_seek(struct csvstate *, off_t);
+int		 csv_parallel(struct csvstate *,
+		    int (*)(struct csvstate *, void *), void *);
 size_t		 csv_nfield(struct csvstate *);
 char 		*csv_getfield(struct csvstate *, size_t);
+const struct csvslice *csv_getslice(struct csvstate *, size_t);
+size_t		 csv_unescape(const struct csvslice *, char *);
+struct csvbatch	*csv_batchinit(struct csvbatch *);
+void		 csv_batchdestroy(struct csvbatch *);
+int		 csv_batchtype(struct csvbatch *, size_t, int);
+int		 csv_getbatch(struct csvstate *, struct csvbatch *, size_t);
+int		 csv_getint64(struct csvstate *, size_t, int64_t *);
+int		 csv_getdouble(struct csvstate *, size_t, double *);
+int		 csv_gettime(struct csvstate *, size_t, struct timespec *);
+int		 csv_toint64(const char *, size_t, int64_t *);
+int		 csv_todouble(const char *, size_t, double *);
+int		 csv_totime(const char *, size_t, struct timespec *);
+struct csvwriter *csv_writerinit(struct csvwriter *, int, char);
+void		 csv_writerdestroy(struct csvwriter *);
+int		 csv_writefield(struct csvwriter *, const char *, size_t);
+int		 csv_endrecord(struct csvwriter *);
+int		 csv_writerecord(struct csvwriter *, const char *const *,
+		    size_t);
+int		 csv_flush(struct csvwriter *);
+struct csvindex	*csv_indexinit(struct csvindex *, size_t);
+void		 csv_indexdestroy(struct csvindex *);
+int		 csv_indexbuild(struct csvindex *, struct csvstate *);
+size_t		 csv_indexnrec(const struct csvindex *);
+int		 csv_indexsave(const struct csvindex *, int, int);
+int		 csv_indexload(struct csvindex *, int, int);
+int		 csv_indexseek(const struct csvindex *, struct csvstate *,
+		    size_t);
 
 #endif /* !defined(H_CSVLIB) */
@@ -0,0 +1,82 @@
+#include <stdint.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "csvscan.h"
+
+#if defined(__AVX2__)
+typedef __m256i vec;
+#define NVEC		2
+#define VECLOAD(p)	_mm256_loadu_si256((const vec *)(p))
+#define VECEQ(v, c)	((uint32_t)_mm256_movemask_epi8( \
+			    _mm256_cmpeq_epi8((v), _mm256_set1_epi8(c))))
+#elif defined(__SSE2__)
+typedef __m128i vec;
+#define NVEC		4
+#define VECLOAD(p)	_mm_loadu_si128((const vec *)(p))
+#define VECEQ(v, c)	((uint32_t)_mm_movemask_epi8( \
+			    _mm_cmpeq_epi8((v), _mm_set1_epi8(c))))
+#endif
+
+#if defined(NVEC)
+static uint64_t	eqmask(const vec *, char);
+#endif
+
+/* csv_classify: find the separators, quotes, escapes and newlines in
+ * CSV_BLOCK bytes
+ * Any byte of cls's sepchars is a separator, the rest of a longer separator
+ * isn't checked.
+ */
+void
+csv_classify(const char *p, const struct csvclass *cls, struct csvmask *mask)
+{
+#if defined(NVEC)
+	const char *sep;
+	vec v[NVEC];
+	int i;
+
+	for (i = 0; i < NVEC; i++)
+		v[i] = VECLOAD(p + i * (CSV_BLOCK / NVEC));
+	mask->quote = cls->quote != '\0' ? eqmask(v, cls->quote) : 0;
+	mask->esc = cls->esc != '\0' ? eqmask(v, cls->esc) : 0;
+	mask->nl = eqmask(v, cls->nl);
+	for (mask->sep = 0, sep = cls->sepchars; *sep != '\0'; sep++)
+		mask->sep |= eqmask(v, *sep);
+#else
+	uint64_t bit;
+	int i, c;
+
+	mask->sep = mask->quote = mask->esc = mask->nl = 0;
+	for (i = 0; i < CSV_BLOCK; i++) {
+		if ((c = cls->tab[(unsigned char)p[i]]) == 0)
+			continue;
+		bit = (uint64_t)1 << i;
+		if (c & CSV_CSEP)
+			mask->sep |= bit;
+		if (c & CSV_CQUOTE)
+			mask->quote |= bit;
+		if (c & CSV_CESC)
+			mask->esc |= bit;
+		if (c & CSV_CNL)
+			mask->nl |= bit;
+	}
+#endif
+}
+
+#if defined(NVEC)
+/* eqmask: return the mask of the bytes in v equal to c */
+static uint64_t
+eqmask(const vec *v, char c)
+{
+	uint64_t mask = 0;
+	int i;
+
+	for (i = 0; i < NVEC; i++)
+		mask |= (uint64_t)VECEQ(v[i], c) << i * (CSV_BLOCK / NVEC);
+	return (mask);
+}
+#endif
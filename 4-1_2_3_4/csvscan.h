@@ -0,0 +1,80 @@
+#if !defined(H_CSVSCAN)
+#define H_CSVSCAN
+
+#include <stdint.h>
+
+#include "csvlib.h"
+
+enum {
+	/* number of bytes csv_classify looks at */
+	CSV_BLOCK = 64
+};
+
+enum { /* classes of a byte in a csvclass table */
+	CSV_CSEP = 1 << 0,	/* starts a separator */
+	CSV_CSEPEND = 1 << 1,	/* ends a separator */
+	CSV_CQUOTE = 1 << 2,
+	CSV_CESC = 1 << 3,
+	CSV_CNL = 1 << 4,	/* ends a record */
+	CSV_CCR = 1 << 5	/* ends a record before a newline */
+};
+
+/* A dialect compiled for the parser.
+ * A byte's class is looked up in tab, so that skipping over the bytes of a
+ * field costs the same whatever the dialect. The block scanner compares bytes
+ * with sepchars, quote, esc and nl instead.
+ */
+struct csvclass {
+	unsigned char	tab[256];
+	char		sepchars[CSV_MAXSEP + 1]; /* bytes with CSV_CSEP */
+	char		sep[CSV_MAXSEP + 1];	/* separator string if seplen */
+	size_t		seplen;		/* 1 if any CSV_CSEP byte separates */
+	char		quote;		/* or '\0' if fields aren't quoted */
+	char		esc;		/* or '\0' if nothing is escaped */
+	char		nl;		/* record terminator */
+	int		scan;		/* can records be split by blocks? */
+};
+
+/* Structural characters in a block, bit i is set if byte i is one. */
+struct csvmask {
+	uint64_t	sep;
+	uint64_t	quote;
+	uint64_t	esc;
+	uint64_t	nl;
+};
+
+void	csv_classify(const char *, const struct csvclass *,
+	    struct csvmask *);
+
+/* csv_prefixxor: return x with bit i set to the xor of bits 0 to i of x
+ * Applied to a quote mask, it gives the bytes between an opening quote and its
+ * closing one, the opening quote included.
+ */
+static inline uint64_t
+csv_prefixxor(uint64_t x)
+{
+	x ^= x << 1;
+	x ^= x << 2;
+	x ^= x << 4;
+	x ^= x << 8;
+	x ^= x << 16;
+	x ^= x << 32;
+	return (x);
+}
+
+/* csv_ctz: return the index of the lowest set bit of x, x can't be 0 */
+static inline int
+csv_ctz(uint64_t x)
+{
+#if defined(__GNUC__)
+	return (__builtin_ctzll(x));
+#else
+	int n;
+
+	for (n = 0; !(x & 1); n++)
+		x >>= 1;
+	return (n);
+#endif
+}
+
+#endif /* !defined(H_CSVSCAN) */
@@ -0,0 +1,261 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "csvlib.h"
+
+enum {
+	/* bytes csv_sniff looks at */
+	SNIFF_LEN = 1 << 16,
+	/* records csv_sniff looks at */
+	SNIFF_NREC = 100,
+	/* fields of a record csv_sniff looks at */
+	SNIFF_NFIELD = 64
+};
+
+/* Separators and quotes csv_sniff chooses from, in order of preference. */
+static const char sniffseps[] = ",;\t|:";
+static const char sniffquotes[] = "\"'";
+
+/* A field of a record split by sniffrec. */
+struct sniffield {
+	const char	*ptr;
+	size_t		 len;
+};
+
+static char	sniffquote(const char *, const char *, char);
+static char	sniffesc(const char *, const char *, char);
+static char	sniffsep(const char *, const char *, const struct csvdialect *);
+static int	sniffheader(const char *, const char *,
+		    const struct csvdialect *);
+static const char *sniffrec(const char *, const char *,
+		    const struct csvdialect *, struct sniffield *, size_t *);
+static int	isnumber(const struct sniffield *, char);
+static int	isboundary(int, char);
+
+/* csv_sniff: guess the dialect of the len chars at buf, the start of a CSV
+ * file, and set *d to it
+ * Up to the first 64 KiB are looked at. Records end with '\n' unless there's
+ * only '\r'. The quote is the one of " and ' that most often starts or ends a
+ * field, or " if neither does, and is escaped by \ if that's more common than
+ * doubling it. The separator is the one of , ; tab | and : that splits the
+ * most records into the same number of fields, more than one. There's a
+ * header if more of its fields stand out from their column, by being a number
+ * or not, or by length, than fit in.
+ *
+ * Returns 0, a dialect is always guessed.
+ */
+int
+csv_sniff(const char *buf, size_t len, struct csvdialect *d)
+{
+	const char *lim, *p;
+	size_t ncr = 0, nnl = 0;
+
+	memset(d, 0, sizeof(*d));
+	d->sep[0] = ',';
+	d->quote = '"';
+	d->nl = '\n';
+	if (len == 0)
+		return (0);
+	lim = buf + (len < SNIFF_LEN ? len : SNIFF_LEN);
+	for (p = buf; p < lim; p++) {
+		if (*p == '\n')
+			nnl++;
+		else if (*p == '\r')
+			ncr++;
+	}
+	if (nnl == 0 && ncr > 0)
+		d->nl = '\r';
+	/* Only look at whole records, unless there's just one. */
+	for (p = lim; p > buf && p[-1] != d->nl; p--)
+		;
+	if (p > buf && lim < buf + len)
+		lim = p;
+	d->quote = sniffquote(buf, lim, d->nl);
+	d->esc = sniffesc(buf, lim, d->quote);
+	d->sep[0] = sniffsep(buf, lim, d);
+	d->header = sniffheader(buf, lim, d);
+	return (0);
+}
+
+/* sniffquote: return the quote of sniffquotes that most often starts or ends
+ * a field of the chars from p to lim, or the first one
+ */
+static char
+sniffquote(const char *p, const char *lim, char nl)
+{
+	const char *q, *start = p;
+	size_t n, best = 0;
+	char quote = sniffquotes[0];
+
+	for (q = sniffquotes; *q != '\0'; q++) {
+		for (n = 0, p = start; p < lim; p++)
+			if (*p == *q && (p == start || p + 1 == lim ||
+			    isboundary(p[-1], nl) || isboundary(p[1], nl)))
+				n++;
+		if (n > best) {
+			best = n;
+			quote = *q;
+		}
+	}
+	return (quote);
+}
+
+/* sniffesc: return \ if it escapes quote more often than quote is doubled
+ * inside a field of the chars from p to lim, else '\0'
+ */
+static char
+sniffesc(const char *p, const char *lim, char quote)
+{
+	const char *start = p;
+	size_t nesc = 0, ndouble = 0;
+
+	for (; p + 1 < lim; p++) {
+		if (*p == '\\' && p[1] == quote) {
+			nesc++;
+			p++;
+		} else if (*p == quote && p[1] == quote && p > start &&
+		    !isboundary(p[-1], '\n')) {
+			ndouble++;
+			p++;
+		}
+	}
+	return (nesc > ndouble ? '\\' : '\0');
+}
+
+/* sniffsep: return the separator of sniffseps that splits the most records
+ * from p to lim into the same number of fields, or , if none splits any
+ */
+static char
+sniffsep(const char *p, const char *lim, const struct csvdialect *d)
+{
+	struct csvdialect cd = *d;
+	const char *sep, *q;
+	size_t nfield[SNIFF_NREC], nrec, i, j, count, best = 0, bestn = 0;
+	char ret = ',';
+
+	for (sep = sniffseps; *sep != '\0'; sep++) {
+		cd.sep[0] = *sep;
+		for (nrec = 0, q = p; q < lim && nrec < SNIFF_NREC; nrec++)
+			q = sniffrec(q, lim, &cd, NULL, &nfield[nrec]);
+		/* The most common number of fields, the most of them. */
+		for (i = 0; i < nrec; i++) {
+			if (nfield[i] < 2)
+				continue;
+			for (count = 0, j = 0; j < nrec; j++)
+				count += nfield[j] == nfield[i];
+			if (count > best ||
+			    (count == best && nfield[i] > bestn)) {
+				best = count;
+				bestn = nfield[i];
+				ret = *sep;
+			}
+		}
+	}
+	return (ret);
+}
+
+/* sniffheader: does the first record from p to lim look like a header?
+ * Each of its columns votes. A column whose other fields are all numbers
+ * votes for if its first isn't one, and against if it is. Else a column
+ * whose other fields all have the same length votes for if its first doesn't,
+ * and against if it does.
+ */
+static int
+sniffheader(const char *p, const char *lim, const struct csvdialect *d)
+{
+	struct sniffield first[SNIFF_NFIELD], f[SNIFF_NFIELD];
+	size_t nfirst, n, i, nrec, nsame = 0;
+	size_t len[SNIFF_NFIELD];
+	unsigned char allnum[SNIFF_NFIELD], samelen[SNIFF_NFIELD];
+	int vote = 0;
+
+	p = sniffrec(p, lim, d, first, &nfirst);
+	if (nfirst > SNIFF_NFIELD)
+		nfirst = SNIFF_NFIELD;
+	memset(allnum, 1, sizeof(allnum));
+	memset(samelen, 1, sizeof(samelen));
+	for (nrec = 0; p < lim && nrec < SNIFF_NREC; nrec++) {
+		p = sniffrec(p, lim, d, f, &n);
+		/* Records of another length say nothing. */
+		if (n != nfirst)
+			continue;
+		for (i = 0; i < nfirst; i++) {
+			allnum[i] &= isnumber(&f[i], d->quote);
+			if (nsame == 0)
+				len[i] = f[i].len;
+			samelen[i] &= f[i].len == len[i];
+		}
+		nsame++;
+	}
+	if (nsame == 0)
+		return (0);
+	for (i = 0; i < nfirst; i++) {
+		if (allnum[i])
+			vote += isnumber(&first[i], d->quote) ? -1 : 1;
+		else if (samelen[i])
+			vote += first[i].len == len[i] ? -1 : 1;
+	}
+	return (vote > 0);
+}
+
+/* sniffrec: split the record at p with d, return a pointer past it
+ * *nfield is set to its number of fields, the first SNIFF_NFIELD of which are
+ * set in f if it isn't NULL. Fields hold their quotes and escapes.
+ */
+static const char *
+sniffrec(const char *p, const char *lim, const struct csvdialect *d,
+    struct sniffield *f, size_t *nfield)
+{
+	const char *start = p;
+	int inquote = 0;
+
+	for (*nfield = 0; p < lim; p++) {
+		if (d->esc != '\0' && *p == d->esc) {
+			if (p + 1 < lim)
+				p++;
+		} else if (d->quote != '\0' && *p == d->quote) {
+			inquote = !inquote;
+		} else if (!inquote && (*p == d->sep[0] || *p == d->nl)) {
+			if (f != NULL && *nfield < SNIFF_NFIELD) {
+				f[*nfield].ptr = start;
+				f[*nfield].len = p - start;
+			}
+			(*nfield)++;
+			start = p + 1;
+			if (*p == d->nl)
+				return (p + 1);
+		}
+	}
+	if (f != NULL && *nfield < SNIFF_NFIELD) {
+		f[*nfield].ptr = start;
+		f[*nfield].len = p - start;
+	}
+	(*nfield)++;
+	return (p);
+}
+
+/* isnumber: is field f a number, inside quote if quoted? */
+static int
+isnumber(const struct sniffield *f, char quote)
+{
+	const char *p = f->ptr;
+	size_t len = f->len;
+	double d;
+
+	if (len > 0 && p[len - 1] == '\r')
+		len--;
+	if (len >= 2 && quote != '\0' && p[0] == quote &&
+	    p[len - 1] == quote) {
+		p++;
+		len -= 2;
+	}
+	return (csv_todouble(p, len, &d) == 0);
+}
+
+/* isboundary: is c nl, a newline or one of sniffseps? */
+static int
+isboundary(int c, char nl)
+{
+	return (c == nl || c == '\n' || c == '\r' ||
+	    (c != '\0' && strchr(sniffseps, c) != NULL));
+}
@@ -0,0 +1,481 @@
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "csvlib.h"
+#include "csvpow5.h"
+
+enum {
+	/* powers of ten pow5 covers, past them a double is 0 or infinite */
+	CSV_MINPOW10 = -342,
+	CSV_MAXPOW10 = 308,
+	/* most significant digits a uint64_t always holds */
+	CSV_MAXDIGITS = 19,
+	/* size of the buffer an escaped field is unescaped to */
+	CSV_NUMBUF = 128
+};
+
+/* Powers of ten a double holds exactly. */
+static const double exact10[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12,
+	1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static int	fieldvalue(struct csvstate *, size_t, char *, const char **,
+		    size_t *);
+static double	eisellemire(uint64_t, int64_t);
+static int	slowdouble(const char *, size_t, double *);
+static int	isword(const char *, const char *, const char *);
+static int	getdigits(const char **, const char *, int, int *);
+static int64_t	daysfromcivil(int64_t, int, int);
+static void	mul128(uint64_t, uint64_t, uint64_t *, uint64_t *);
+static int	clz64(uint64_t);
+
+/* csv_getint64: convert 0-indexed field n with csv_toint64
+ * Returns -1 with errno set to EINVAL if there's no field n.
+ */
+int
+csv_getint64(struct csvstate *state, size_t n, int64_t *val)
+{
+	char buf[CSV_NUMBUF];
+	const char *p;
+	size_t len;
+
+	if (fieldvalue(state, n, buf, &p, &len) == -1)
+		return (-1);
+	return (csv_toint64(p, len, val));
+}
+
+/* csv_getdouble: convert 0-indexed field n with csv_todouble
+ * Returns -1 with errno set to EINVAL if there's no field n.
+ */
+int
+csv_getdouble(struct csvstate *state, size_t n, double *val)
+{
+	char buf[CSV_NUMBUF];
+	const char *p;
+	size_t len;
+
+	if (fieldvalue(state, n, buf, &p, &len) == -1)
+		return (-1);
+	return (csv_todouble(p, len, val));
+}
+
+/* csv_gettime: convert 0-indexed field n with csv_totime
+ * Returns -1 with errno set to EINVAL if there's no field n.
+ */
+int
+csv_gettime(struct csvstate *state, size_t n, struct timespec *val)
+{
+	char buf[CSV_NUMBUF];
+	const char *p;
+	size_t len;
+
+	if (fieldvalue(state, n, buf, &p, &len) == -1)
+		return (-1);
+	return (csv_totime(p, len, val));
+}
+
+/* csv_toint64: convert the decimal integer in the len chars at p to *val
+ * It's an optional sign and digits, nothing else, not even spaces.
+ *
+ * Returns -1 with errno set to EINVAL if it isn't an integer, or to ERANGE if
+ * it doesn't fit in *val.
+ */
+int
+csv_toint64(const char *p, size_t len, int64_t *val)
+{
+	const char *end = p + len;
+	uint64_t n = 0, max;
+	int neg = 0, big = 0;
+
+	if (p < end && (*p == '-' || *p == '+'))
+		neg = *p++ == '-';
+	if (p == end)
+		goto inval;
+	max = neg ? (uint64_t)INT64_MAX + 1 : INT64_MAX;
+	for (; p < end; p++) {
+		if (*p < '0' || *p > '9')
+			goto inval;
+		if (n > (max - (*p - '0')) / 10)
+			big = 1;
+		else
+			n = n * 10 + (*p - '0');
+	}
+	if (big) {
+		errno = ERANGE;
+		return (-1);
+	}
+	*val = neg && n > 0 ? -(int64_t)(n - 1) - 1 : (int64_t)n;
+	return (0);
+inval:
+	errno = EINVAL;
+	return (-1);
+}
+
+/* csv_todouble: convert the decimal number in the len chars at p to *val
+ * It's an optional sign, digits with an optional decimal point, and an
+ * optional exponent, or inf, infinity or nan in any case. Nothing else, not
+ * even spaces, and the decimal point is always a dot. The result is correctly
+ * rounded.
+ * Up to 19 significant digits are converted with the Clinger fast path if
+ * exact, and Eisel-Lemire otherwise. More are left to strtod.
+ *
+ * Returns -1 with errno set to EINVAL if it isn't a number, or to ERANGE if
+ * it's too big or too small for a double, in which case *val is set to
+ * infinity or 0.
+ */
+int
+csv_todouble(const char *p, size_t len, double *val)
+{
+	const char *start = p, *end = p + len;
+	uint64_t w = 0;
+	int64_t q = 0, e = 0;
+	int neg = 0, eneg = 0, ndigit = 0, nsig = 0;
+
+	if (p < end && (*p == '-' || *p == '+'))
+		neg = *p++ == '-';
+	if (isword(p, end, "inf") || isword(p, end, "infinity")) {
+		*val = neg ? -HUGE_VAL : HUGE_VAL;
+		return (0);
+	}
+	if (isword(p, end, "nan")) {
+		*val = neg ? -NAN : NAN;
+		return (0);
+	}
+	for (; p < end && *p >= '0' && *p <= '9'; p++, ndigit++) {
+		/* Leading zeros aren't significant. */
+		if (w == 0 && *p == '0')
+			continue;
+		if (nsig++ < CSV_MAXDIGITS)
+			w = w * 10 + (*p - '0');
+		else
+			q++;
+	}
+	if (p < end && *p == '.') {
+		for (p++; p < end && *p >= '0' && *p <= '9'; p++, ndigit++) {
+			if (w == 0 && *p == '0') {
+				q--;
+				continue;
+			}
+			if (nsig++ < CSV_MAXDIGITS) {
+				w = w * 10 + (*p - '0');
+				q--;
+			}
+		}
+	}
+	if (ndigit == 0)
+		goto inval;
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		if (++p < end && (*p == '-' || *p == '+'))
+			eneg = *p++ == '-';
+		if (p == end)
+			goto inval;
+		for (; p < end && *p >= '0' && *p <= '9'; p++)
+			if (e < 100000)
+				e = e * 10 + (*p - '0');
+		q += eneg ? -e : e;
+	}
+	if (p != end)
+		goto inval;
+	if (nsig > CSV_MAXDIGITS)
+		return (slowdouble(start, len, val));
+
+	if (w == 0) {
+		*val = neg ? -0.0 : 0.0;
+		return (0);
+	}
+	if (q >= -22 && q <= 22 && w <= (uint64_t)1 << 53) {
+		*val = q < 0 ? (double)w / exact10[-q] : (double)w * exact10[q];
+	} else {
+		*val = eisellemire(w, q);
+		if (*val == 0 || *val == HUGE_VAL) {
+			*val = neg ? -*val : *val;
+			errno = ERANGE;
+			return (-1);
+		}
+	}
+	*val = neg ? -*val : *val;
+	return (0);
+inval:
+	errno = EINVAL;
+	return (-1);
+}
+
+/* csv_totime: convert the ISO 8601 time in the len chars at p to *val
+ * It's a date, YYYY-MM-DD, optionally followed by a T or a space and a time of
+ * day, hh:mm, hh:mm:ss or hh:mm:ss with a fraction of a second after a dot or
+ * a comma. The time of day can be followed by Z or an offset from UTC, +hh,
+ * +hh:mm or +hhmm, or -. Without an offset it's UTC. Digits of the fraction
+ * past nanoseconds are ignored.
+ *
+ * Returns -1 with errno set to EINVAL if it isn't such a time.
+ */
+int
+csv_totime(const char *p, size_t len, struct timespec *val)
+{
+	static const int mdays[] = {
+		31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31
+	};
+	const char *end = p + len;
+	int year, mon, day, hour = 0, min = 0, sec = 0, nsec = 0;
+	int offhour = 0, offmin = 0, offneg = 0, leap, i;
+
+	if (getdigits(&p, end, 4, &year) == -1 || p == end || *p++ != '-' ||
+	    getdigits(&p, end, 2, &mon) == -1 || p == end || *p++ != '-' ||
+	    getdigits(&p, end, 2, &day) == -1)
+		goto inval;
+	leap = year % 4 == 0 && (year % 100 != 0 || year % 400 == 0);
+	if (mon < 1 || mon > 12 || day < 1 ||
+	    day > mdays[mon - 1] + (mon == 2 && leap))
+		goto inval;
+	if (p == end)
+		goto done;
+	if (*p != 'T' && *p != ' ')
+		goto inval;
+	p++;
+	if (getdigits(&p, end, 2, &hour) == -1 || p == end || *p++ != ':' ||
+	    getdigits(&p, end, 2, &min) == -1)
+		goto inval;
+	if (p < end && *p == ':') {
+		p++;
+		if (getdigits(&p, end, 2, &sec) == -1)
+			goto inval;
+		if (p < end && (*p == '.' || *p == ',')) {
+			if (++p == end || *p < '0' || *p > '9')
+				goto inval;
+			for (i = 0; p < end && *p >= '0' && *p <= '9'; p++, i++)
+				if (i < 9)
+					nsec = nsec * 10 + (*p - '0');
+			for (; i < 9; i++)
+				nsec *= 10;
+		}
+	}
+	/* A leap second is taken as the first second of the next minute. */
+	if (hour > 23 || min > 59 || sec > 60)
+		goto inval;
+	if (p < end && *p == 'Z') {
+		p++;
+	} else if (p < end && (*p == '+' || *p == '-')) {
+		offneg = *p++ == '-';
+		if (getdigits(&p, end, 2, &offhour) == -1)
+			goto inval;
+		if (p < end && *p == ':' && ++p == end)
+			goto inval;
+		if (p < end && getdigits(&p, end, 2, &offmin) == -1)
+			goto inval;
+		if (offhour > 23 || offmin > 59)
+			goto inval;
+	}
+	if (p != end)
+		goto inval;
+done:
+	val->tv_sec = daysfromcivil(year, mon, day) * 86400 + hour * 3600 +
+	    min * 60 + sec;
+	val->tv_sec += (offneg ? 1 : -1) * (offhour * 3600 + offmin * 60);
+	val->tv_nsec = nsec;
+	return (0);
+inval:
+	errno = EINVAL;
+	return (-1);
+}
+
+/* fieldvalue: point *pp and *lenp to the value of 0-indexed field n
+ * A field that needs unescaping is unescaped to buf, which has room for
+ * CSV_NUMBUF chars. One that doesn't fit can't be a number.
+ *
+ * Returns -1 with errno set to EINVAL if there's no field n, or it's too long
+ * to unescape.
+ */
+static int
+fieldvalue(struct csvstate *state, size_t n, char *buf, const char **pp,
+    size_t *lenp)
+{
+	const struct csvslice *sp;
+
+	if ((sp = csv_getslice(state, n)) == NULL ||
+	    (sp->escaped && sp->len >= CSV_NUMBUF)) {
+		errno = EINVAL;
+		return (-1);
+	}
+	if (sp->escaped) {
+		*lenp = csv_unescape(sp, buf);
+		*pp = buf;
+	} else {
+		*lenp = sp->len;
+		*pp = sp->ptr;
+	}
+	return (0);
+}
+
+/* eisellemire: return w * 10^q as a double, correctly rounded
+ * w is not 0 and was read from at most 19 digits. The result is 0 or
+ * infinity if it's out of range.
+ * This is Eisel and Lemire's algorithm, with Mushtak and Lemire's proof that
+ * the 128-bit product of the powers of five is always precise enough.
+ */
+static double
+eisellemire(uint64_t w, int64_t q)
+{
+	const uint64_t mask = UINT64_MAX >> 55;
+	uint64_t hi, lo, hi2, lo2, mant, bits;
+	int64_t power2;
+	int lz, upper, shift;
+	double d;
+
+	if (q < CSV_MINPOW10)
+		return (0);
+	if (q > CSV_MAXPOW10)
+		return (HUGE_VAL);
+	lz = clz64(w);
+	w <<= lz;
+	mul128(w, pow5[q - CSV_MINPOW10][0], &hi, &lo);
+	if ((hi & mask) == mask) {
+		mul128(w, pow5[q - CSV_MINPOW10][1], &hi2, &lo2);
+		lo += hi2;
+		if (hi2 > lo)
+			hi++;
+	}
+	upper = hi >> 63;
+	shift = upper + 64 - 52 - 3;
+	mant = hi >> shift;
+	/* floor(log2(10^q)) + 63, and the double's exponent bias. */
+	power2 = (((152170 + 65536) * q) >> 16) + 63 + upper - lz + 1023;
+	if (power2 <= 0) {
+		/* Subnormal, or 0. */
+		if (-power2 + 1 >= 64)
+			return (0);
+		mant >>= -power2 + 1;
+		mant += mant & 1;
+		mant >>= 1;
+		power2 = mant < (uint64_t)1 << 52 ? 0 : 1;
+		goto pack;
+	}
+	/* Exactly halfway between two doubles, round to even. */
+	if (lo <= 1 && q >= -4 && q <= 23 && (mant & 3) == 1 &&
+	    mant << shift == hi)
+		mant &= ~(uint64_t)1;
+	mant += mant & 1;
+	mant >>= 1;
+	if (mant >= (uint64_t)2 << 52) {
+		mant = (uint64_t)1 << 52;
+		power2++;
+	}
+	mant &= ~((uint64_t)1 << 52);
+	if (power2 >= 0x7ff)
+		return (HUGE_VAL);
+pack:
+	bits = mant | (uint64_t)power2 << 52;
+	memcpy(&d, &bits, sizeof(d));
+	return (d);
+}
+
+/* slowdouble: convert the number in the len chars at p with strtod
+ * csv_todouble has checked it's a number, but strtod uses the locale's decimal
+ * point.
+ *
+ * Returns -1 on malloc error, or with errno set to ERANGE like csv_todouble.
+ */
+static int
+slowdouble(const char *p, size_t len, double *val)
+{
+	char buf[CSV_NUMBUF], *s = buf;
+
+	if (len >= sizeof(buf) && (s = malloc(len + 1)) == NULL)
+		return (-1);
+	memcpy(s, p, len);
+	s[len] = '\0';
+	errno = 0;
+	*val = strtod(s, NULL);
+	if (s != buf)
+		free(s);
+	return (errno == ERANGE ? -1 : 0);
+}
+
+/* isword: are the chars from p to end word, in any case? */
+static int
+isword(const char *p, const char *end, const char *word)
+{
+	for (; p < end && *word != '\0'; p++, word++)
+		if ((*p | 0x20) != *word)
+			return (0);
+	return (p == end && *word == '\0');
+}
+
+/* getdigits: read n digits at *pp into *val, advance *pp past them
+ * Returns -1 if there aren't n digits before end.
+ */
+static int
+getdigits(const char **pp, const char *end, int n, int *val)
+{
+	const char *p = *pp;
+
+	if (end - p < n)
+		return (-1);
+	for (*val = 0; n > 0; n--, p++) {
+		if (*p < '0' || *p > '9')
+			return (-1);
+		*val = *val * 10 + (*p - '0');
+	}
+	*pp = p;
+	return (0);
+}
+
+/* daysfromcivil: return the number of days from 1970-01-01 to the date
+ * This is Howard Hinnant's days_from_civil.
+ */
+static int64_t
+daysfromcivil(int64_t year, int mon, int day)
+{
+	int64_t era, yoe, doy, doe;
+
+	year -= mon <= 2;
+	era = (year >= 0 ? year : year - 399) / 400;
+	yoe = year - era * 400;
+	doy = (153 * (mon > 2 ? mon - 3 : mon + 9) + 2) / 5 + day - 1;
+	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return (era * 146097 + doe - 719468);
+}
+
+/* mul128: set *hi and *lo to the high and low 64 bits of a * b */
+static void
+mul128(uint64_t a, uint64_t b, uint64_t *hi, uint64_t *lo)
+{
+#if defined(__SIZEOF_INT128__)
+	__extension__ typedef unsigned __int128 uint128;
+	uint128 r = (uint128)a * b;
+
+	*hi = r >> 64;
+	*lo = r;
+#else
+	uint64_t alo = a & UINT32_MAX, ahi = a >> 32;
+	uint64_t blo = b & UINT32_MAX, bhi = b >> 32;
+	uint64_t ll, lh, hl, hh, mid;
+
+	ll = alo * blo;
+	lh = alo * bhi;
+	hl = ahi * blo;
+	hh = ahi * bhi;
+	mid = (ll >> 32) + (lh & UINT32_MAX) + (hl & UINT32_MAX);
+	*lo = (mid << 32) | (ll & UINT32_MAX);
+	*hi = hh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+#endif
+}
+
+/* clz64: return the number of leading zero bits of x, x can't be 0 */
+static int
+clz64(uint64_t x)
+{
+#if defined(__GNUC__)
+	return (__builtin_clzll(x));
+#else
+	int n;
+
+	for (n = 0; !(x & (uint64_t)1 << 63); n++)
+		x <<= 1;
+	return (n);
+#endif
+}
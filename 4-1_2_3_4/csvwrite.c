@@ -0,0 +1,215 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "csvlib.h"
+
+enum {
+	/* bytes buffered before they're written */
+	CSV_WRITEBUF = 1 << 18
+};
+
+struct csvwriter {
+	int		 fd;		/* output */
+	char		 sep;		/* field separator */
+	char		*buf;		/* formatted records not yet written */
+	size_t		 buflen;	/* bytes in buf */
+	size_t		 maxbuf;	/* buffer size for buf */
+	size_t		 nfield;	/* fields in the current record */
+	int		 firstempty;	/* is its first field empty? */
+	unsigned char	 special[256];	/* chars a field is quoted for */
+};
+
+static int	reserve(struct csvwriter *, size_t);
+
+/* csv_writerinit: init writer to write to fd with sep between fields, return
+ * writer
+ * call csv_writerdestroy() to free the writer's resources.
+ * If writer is NULL, allocate it.
+ *
+ * Returns NULL on malloc error, or with errno set to EINVAL if sep is a quote,
+ * a newline or a carriage return.
+ */
+struct csvwriter *
+csv_writerinit(struct csvwriter *writer, int fd, char sep)
+{
+	const void *owriter = writer;
+
+	if (sep == '"' || sep == '\n' || sep == '\r') {
+		errno = EINVAL;
+		return (NULL);
+	}
+	if (writer == NULL)
+		if ((writer = malloc(sizeof(*writer))) == NULL)
+			return (NULL);
+	writer->fd = fd;
+	writer->sep = sep;
+	writer->buflen = 0;
+	writer->maxbuf = CSV_WRITEBUF;
+	writer->nfield = 0;
+	writer->firstempty = 0;
+	memset(writer->special, 0, sizeof(writer->special));
+	writer->special['"'] = 1;
+	writer->special['\n'] = 1;
+	writer->special['\r'] = 1;
+	writer->special[(unsigned char)sep] = 1;
+	if ((writer->buf = malloc(writer->maxbuf)) == NULL) {
+		if (owriter == NULL)
+			free(writer);
+		return (NULL);
+	}
+	return (writer);
+}
+
+/* csv_writerdestroy: destroy resources in writer, doesn't free writer
+ * Buffered output that wasn't flushed is lost.
+ */
+void
+csv_writerdestroy(struct csvwriter *writer)
+{
+	free(writer->buf);
+}
+
+/* csv_writefield: add the len chars at p as the next field of the record
+ * The field is quoted if it holds the separator, a quote, a newline or a
+ * carriage return, and its quotes doubled.
+ *
+ * Returns -1 on malloc or write error.
+ */
+int
+csv_writefield(struct csvwriter *writer, const char *p, size_t len)
+{
+	const char *end = p + len, *q;
+	char *out;
+	size_t i;
+
+	for (i = 0; i < len && !writer->special[(unsigned char)p[i]]; i++)
+		;
+	if (i == len) {
+		if (reserve(writer, len + 1) == -1)
+			return (-1);
+		out = writer->buf + writer->buflen;
+		if (writer->nfield > 0)
+			*out++ = writer->sep;
+		else
+			writer->firstempty = len == 0;
+		memcpy(out, p, len);
+		writer->buflen = out + len - writer->buf;
+		writer->nfield++;
+		return (0);
+	}
+	if (len > (SIZE_MAX - 3) / 2) {
+		errno = ENOMEM;
+		return (-1);
+	}
+	if (reserve(writer, 2 * len + 3) == -1)
+		return (-1);
+	out = writer->buf + writer->buflen;
+	if (writer->nfield > 0)
+		*out++ = writer->sep;
+	*out++ = '"';
+	/* Copy up to and including each quote, and double it. */
+	while ((q = memchr(p, '"', end - p)) != NULL) {
+		memcpy(out, p, q + 1 - p);
+		out += q + 1 - p;
+		*out++ = '"';
+		p = q + 1;
+	}
+	memcpy(out, p, end - p);
+	out += end - p;
+	*out++ = '"';
+	writer->buflen = out - writer->buf;
+	writer->firstempty = 0;
+	writer->nfield++;
+	return (0);
+}
+
+/* csv_endrecord: end the record, the next field starts a new one
+ * A record of one empty field is written as "" so that it isn't read as a
+ * record without fields.
+ *
+ * Returns -1 on malloc or write error.
+ */
+int
+csv_endrecord(struct csvwriter *writer)
+{
+	if (reserve(writer, 3) == -1)
+		return (-1);
+	if (writer->nfield == 1 && writer->firstempty) {
+		writer->buf[writer->buflen++] = '"';
+		writer->buf[writer->buflen++] = '"';
+	}
+	writer->buf[writer->buflen++] = '\n';
+	writer->nfield = 0;
+	if (writer->buflen >= CSV_WRITEBUF)
+		return (csv_flush(writer));
+	return (0);
+}
+
+/* csv_writerecord: write the n null terminated strings in fields as a record
+ * Returns -1 on malloc or write error.
+ */
+int
+csv_writerecord(struct csvwriter *writer, const char *const *fields, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		if (csv_writefield(writer, fields[i], strlen(fields[i])) == -1)
+			return (-1);
+	return (csv_endrecord(writer));
+}
+
+/* csv_flush: write all buffered output to the writer's descriptor
+ * A record that isn't ended is written as far as it goes.
+ *
+ * Returns -1 on write error, the output that wasn't written stays buffered.
+ */
+int
+csv_flush(struct csvwriter *writer)
+{
+	size_t off = 0;
+	ssize_t n;
+	int ret = -1;
+
+	while (off < writer->buflen) {
+		if ((n = write(writer->fd, writer->buf + off,
+		    writer->buflen - off)) == -1) {
+			if (errno == EINTR)
+				continue;
+			goto end;
+		}
+		off += n;
+	}
+	ret = 0;
+end:
+	if (off > 0)
+		memmove(writer->buf, writer->buf + off, writer->buflen - off);
+	writer->buflen -= off;
+	return (ret);
+}
+
+/* reserve: make room for n more bytes in the writer's buffer
+ * The buffer is flushed first, and only grows for a field bigger than it.
+ *
+ * Returns -1 on malloc or write error.
+ */
+static int
+reserve(struct csvwriter *writer, size_t n)
+{
+	char *tp;
+
+	if (writer->maxbuf - writer->buflen >= n)
+		return (0);
+	if (csv_flush(writer) == -1)
+		return (-1);
+	if (writer->maxbuf >= n)
+		return (0);
+	if ((tp = realloc(writer->buf, n)) == NULL)
+		return (-1);
+	writer->buf = tp;
+	writer->maxbuf = n;
+	return (0);
+}
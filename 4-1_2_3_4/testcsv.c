@@ -0,0 +1,1068 @@
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "csvlib.h"
+
+#define ACNT(arr) (sizeof(arr) / sizeof(*arr))
+
+enum {
+	/* Largest number of fields in a test line. */
+	MAXTESTFIELD = 40
+};
+
+struct linetest {
+	const char	*line;
+	/* Expected fields, up to the first NULL. */
+	const char	*field[MAXTESTFIELD + 1];
+};
+
+struct inttest {
+	const char	*s;
+	int64_t		 val;
+	int		 err;	/* expected errno, or 0 */
+};
+
+struct dialecttest {
+	struct csvdialect d;
+	const char	*in;
+	/* Expected records, each field in <>, each record ended by ; */
+	const char	*out;
+};
+
+struct projtest {
+	size_t		 col[4];
+	size_t		 ncol;
+	const char	*in;
+	/* Expected records, as in dialecttest, a missing field is - */
+	const char	*out;
+};
+
+struct snifftest {
+	const char	*in;
+	struct csvdialect d;	/* expected */
+};
+
+struct timetest {
+	const char	*s;
+	time_t		 sec;
+	long		 nsec;
+	int		 err;	/* expected errno, or 0 */
+};
+
+static const struct linetest linetests[] = {
+	{"a,b,c\n", {"a", "b", "c"}},
+	{"a,b,c", {"a", "b", "c"}},
+	{"a,b,c\r\n", {"a", "b", "c"}},
+	{"\n", {NULL}},
+	{",\n", {"", ""}},
+	{"a,,b,\n", {"a", "", "b", ""}},
+	{"\"a,b\",c\n", {"a,b", "c"}},
+	{"\"say \"\"hi\"\"\",x\n", {"say \"hi\"", "x"}},
+	{"\"\"\"\"\n", {"\""}},
+	{"\"\"\n", {""}},
+	{"\"ab\"cd,e\n", {"abcd", "e"}},
+	{"\"open,x\n", {"open,x"}},
+	{"a\"b,c\n", {"a\"b", "c"}},
+	{"1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17,18,19,20,21,22,23,24,25,"
+	    "26,27,28,29,30,31,32,33,34,35\n", {"1", "2", "3", "4", "5", "6",
+	    "7", "8", "9", "10", "11", "12", "13", "14", "15", "16", "17", "18",
+	    "19", "20", "21", "22", "23", "24", "25", "26", "27", "28", "29",
+	    "30", "31", "32", "33", "34", "35"}},
+	/* Quotes and separators on both sides of 64 byte boundaries. */
+	{"0123456789012345678901234567890123456789"
+	    "012345678901234567890,\"a,\"\"b\",c\n",
+	    {"0123456789012345678901234567890123456789"
+	    "012345678901234567890", "a,\"b", "c"}},
+	{"\"0123456789012345678901234567890123456789"
+	    "012345678901234567890,"
+	    "0123456789012345678901234567890123456789"
+	    "0123456789012345678\"\",\",x\n",
+	    {"0123456789012345678901234567890123456789"
+	    "012345678901234567890,"
+	    "0123456789012345678901234567890123456789"
+	    "0123456789012345678\",", "x"}},
+	{"0123456789012345678901234567890123456789"
+	    "01234567890123456789012,a\"b,\"c\"\n",
+	    {"0123456789012345678901234567890123456789"
+	    "01234567890123456789012", "a\"b", "c"}},
+};
+
+/* Records can hold newlines in quotes, and may straddle read blocks. */
+static const char recinput[] =
+    "a,b\n"
+    "\"x\ny\",z\r\n"
+    "\n"
+    "\"\"\"q\"\"\",\"p\r\n\"\n"
+    "a\"b,\"c\n\"\n"
+    "\"ab\"cd,e\r\n"
+    "0123456789012345678901234567890123456789"
+    "01234567890123456789012,\"0123456789\n"
+    "0123456789012345678901234567890123456789"
+    "01234567890123456789\"\"\"\n"
+    "last";
+
+/* recinput's records, a record's fields end at the first NULL */
+static const char *const recfields[][MAXTESTFIELD + 1] = {
+	{"a", "b"},
+	{"x\ny", "z"},
+	{NULL},
+	{"\"q\"", "p\r\n"},
+	{"a\"b", "c\n"},
+	{"abcd", "e"},
+	{"0123456789012345678901234567890123456789"
+	    "01234567890123456789012", "0123456789\n"
+	    "0123456789012345678901234567890123456789"
+	    "01234567890123456789\""},
+	{"last"},
+};
+
+/* Records read by csv_getbatch two at a time, with typed columns 0 and 1. */
+static const char batchinput[] =
+    "1,2.5,x\n"
+    "-3,1e3\n"
+    ",abc,y,extra\n"
+    "9223372036854775808,1.6e1,\"q\"\"\"\n";
+
+static const struct inttest inttests[] = {
+	{"0", 0, 0},
+	{"-0", 0, 0},
+	{"+42", 42, 0},
+	{"-17", -17, 0},
+	{"007", 7, 0},
+	{"9223372036854775807", INT64_MAX, 0},
+	{"-9223372036854775808", INT64_MIN, 0},
+	{"9223372036854775808", 0, ERANGE},
+	{"-9223372036854775809", 0, ERANGE},
+	{"123456789012345678901234567890", 0, ERANGE},
+	{"", 0, EINVAL},
+	{"-", 0, EINVAL},
+	{" 1", 0, EINVAL},
+	{"1 ", 0, EINVAL},
+	{"1.0", 0, EINVAL},
+	{"0x10", 0, EINVAL},
+	{"99999999999999999999x", 0, EINVAL},
+};
+
+/* Numbers csv_todouble must convert exactly like strtod. */
+static const char *const doubletests[] = {
+	"0", "-0", "1", "-1", "0.1", ".5", "5.", "1e3", "1E-3", "+2.5e+10",
+	"3.14159265358979323846", "9007199254740993", "9007199254740992.5",
+	"1e22", "1e23", "123456789e-30", "2.2250738585072014e-308",
+	"2.2250738585072011e-308", "4.9406564584124654e-324",
+	"2.4703282292062327e-324", "2.4703282292062328e-324",
+	"1.7976931348623157e308", "1.7976931348623158e308",
+	"0.000000000000000000000000000001234", "7.0e-10", "8.589973e9",
+	"179769313486231580793728971405303415079934132710037826936173778980444"
+	"968292764750946649017977587207096330286416692887910946555547851940402"
+	"630657488671505820681908902000708383676273854845817711531764475730270"
+	"069855571366959622842914819860834936475292719074168444365510704342711"
+	"559699508093042880177904174497791.9999999999999999999999999999999999",
+	"0.500000000000000166533453693773481063544750213623046875",
+	"1.00000000000000011102230246251565404236316680908203125",
+	"5e-324", "1e-400", "1e400", "-1e400", "inf", "-Infinity", "NAN",
+};
+
+/* Strings that aren't numbers for csv_todouble. */
+static const char *const notdoubles[] = {
+	"", "-", ".", "e5", "1e", "1e+", "1.2.3", " 1", "1 ", "0x10", "infx",
+	"1,5",
+};
+
+static const struct timetest timetests[] = {
+	{"1970-01-01", 0, 0, 0},
+	{"2000-02-29T12:34:56Z", 951827696, 0, 0},
+	{"2000-02-29 12:34:56.5", 951827696, 500000000, 0},
+	{"2024-10-19T08:00+02:00", 1729317600, 0, 0},
+	{"2024-10-19T08:00:00-0130", 1729330200, 0, 0},
+	{"2024-10-19T08:00:00,123456789123+01", 1729321200, 123456789, 0},
+	{"1969-12-31T23:59:59Z", -1, 0, 0},
+	{"1900-03-01", -2203891200, 0, 0},
+	{"2016-12-31T23:59:60Z", 1483228800, 0, 0},
+	{"1900-02-29", 0, 0, EINVAL},
+	{"2023-13-01", 0, 0, EINVAL},
+	{"2023-01-01T24:00", 0, 0, EINVAL},
+	{"2023-01-01T12", 0, 0, EINVAL},
+	{"2023-01-01T12:00:00.", 0, 0, EINVAL},
+	{"2023-01-01T12:00+01:", 0, 0, EINVAL},
+	{"2023-01-01Z", 0, 0, EINVAL},
+	{"23-01-01", 0, 0, EINVAL},
+};
+
+/* Records written by csv_writerecord, and what must be written. */
+static const char *const writefields[][3] = {
+	{"", ",", "a\"b"},
+	{""},
+	{"x\ny", "\r"},
+};
+static const char writeoutput[] =
+    ",\",\",\"a\"\"b\"\n"
+    "\"\"\n"
+    "\"x\ny\",\"\r\"\n";
+
+static const struct dialecttest dialecttests[] = {
+	{{"||", '"', '\0', '\n', 0},
+	    "a||b|c||\"x||y\"\n||\na|||b\n",
+	    "<a><b|c><x||y>;<><>;<a><|b>;"},
+	{{"::", '"', '\0', '\n', 0},
+	    "0123456789012345678901234567890123456789"
+	    "01234567890123456789012::\"b\"::c\n",
+	    "<0123456789012345678901234567890123456789"
+	    "01234567890123456789012><b><c>;"},
+	{{";", '\'', '\0', '\n', 0},
+	    "'a;b';'it''s';x\n",
+	    "<a;b><it's><x>;"},
+	{{",", '"', '\\', '\n', 0},
+	    "a\\,b,\"x\\\"y\",\"p\"\"q\"\nc\\\nd,e\\",
+	    "<a,b><x\"y><p\"q>;<c\nd><e\\>;"},
+	{{",", '"', '\0', '\r', 0},
+	    "a,b\rc,\"d\r\"\n\r",
+	    "<a><b>;<c><d\r\n>;"},
+	{{",", '\0', '\0', '\n', 0},
+	    "\"a,b\"\n",
+	    "<\"a><b\">;"},
+	{{"\t", '"', '\0', '\n', 0},
+	    "a\tb\r\n\"c\r\n\"\td\r\n",
+	    "<a><b>;<c\r\n><d>;"},
+};
+
+/* Dialects csv_setopt must reject. */
+static const struct csvdialect baddialects[] = {
+	{"", '"', '\0', '\n', 0},
+	{"a\"", '"', '\0', '\n', 0},
+	{",\\", '"', '\\', '\n', 0},
+	{",", '"', '\0', 'x', 0},
+	{",", '\n', '\0', '\n', 0},
+	{"123456789", '"', '\0', '\n', 0},
+};
+
+/* Records read with a projection to the columns of col. */
+static const struct projtest projtests[] = {
+	{{2, 0}, 2,
+	    "a,b,c\n\"x\ny\",z\n\n\"p,q\",\"r\"\"\",s,t\n",
+	    "<c><a>;-<x\ny>;;<s><p,q>;"},
+	{{0}, 1,
+	    "a,\"b\nc\",d\r\ne,\"x\"\"\n\"\"\",y\nz",
+	    "<a>;<e>;<z>;"},
+	{{1, 3}, 2,
+	    "0123456789012345678901234567890123456789"
+	    "01234567890123456789012,b,\"c\n,\",\"d\"\nq,r\n",
+	    "<b><d>;<r>-;"},
+	{{2, 1}, 2,
+	    "ab\"c\"d,e,f\n",
+	    "<f><e>;"},
+};
+
+static const struct snifftest snifftests[] = {
+	{"name,age\nbob,42\nalice,7\n", {",", '"', '\0', '\n', 1}},
+	{"1;2;3\n4;5;6\n", {";", '"', '\0', '\n', 0}},
+	{"'id'|'name'\n1|'x|y'\n2|'z'\n", {"|", '\'', '\0', '\n', 1}},
+	{"a\tb\r\nc\td\r\n", {"\t", '"', '\0', '\n', 0}},
+	{"x,\"a\\\"b\"\ry,\"c\\\"d\"\r", {",", '"', '\\', '\r', 0}},
+};
+
+/* Totals of what csv_parallel's callbacks read. */
+struct chunktotal {
+	pthread_mutex_t	 lock;
+	size_t		 nrec;
+	size_t		 nfield;
+};
+
+static int testline(struct csvstate *, const struct linetest *);
+static int testrecords(int, size_t, int);
+static int testchunks(size_t);
+static int countchunk(struct csvstate *, void *);
+static int testbatch(void);
+static int testint(const struct inttest *);
+static int testdouble(const char *, int);
+static int testtime(const struct timetest *);
+static int testwrite(void);
+static int testdialect(const struct dialecttest *, int, size_t, int);
+static int testproject(const struct projtest *, int, size_t, int);
+static int testsniff(const struct snifftest *);
+static int testindex(int);
+static int openinput(const char *, int, FILE **, int *);
+
+int
+main(void)
+{
+	struct csvstate *state;
+	size_t i;
+	int ret, nfail = 0, ntest = ACNT(linetests);
+
+	if ((state = csv_init(NULL)) == NULL)
+		goto err;
+	for (i = 0; i < ACNT(linetests); i++) {
+		if ((ret = testline(state, &linetests[i])) == -1)
+			goto err;
+		nfail += ret;
+	}
+	csv_destroy(state);
+	free(state);
+	if ((ret = testrecords(1, 0, 1)) == -1)
+		goto err;
+	nfail += ret;
+	ntest++;
+	for (i = 1; i < 100; i *= 7) {
+		if ((ret = testrecords(0, i, 1)) == -1 ||
+		    (nfail += ret, ret = testrecords(1, i, 3)) == -1 ||
+		    (nfail += ret, ret = testchunks(i)) == -1)
+			goto err;
+		nfail += ret;
+		ntest += 3;
+	}
+	if ((ret = testbatch()) == -1)
+		goto err;
+	nfail += ret;
+	ntest++;
+	for (i = 0; i < ACNT(inttests); i++)
+		nfail += testint(&inttests[i]);
+	for (i = 0; i < ACNT(doubletests); i++)
+		nfail += testdouble(doubletests[i], 1);
+	for (i = 0; i < ACNT(notdoubles); i++)
+		nfail += testdouble(notdoubles[i], 0);
+	for (i = 0; i < ACNT(timetests); i++)
+		nfail += testtime(&timetests[i]);
+	ntest += ACNT(inttests) + ACNT(doubletests) + ACNT(notdoubles) +
+	    ACNT(timetests);
+	if ((ret = testwrite()) == -1)
+		goto err;
+	nfail += ret;
+	ntest++;
+	for (i = 0; i < ACNT(dialecttests); i++) {
+		if ((ret = testdialect(&dialecttests[i], 1, 0, 1)) == -1 ||
+		    (nfail += ret,
+		    ret = testdialect(&dialecttests[i], 0, 1, 1)) == -1 ||
+		    (nfail += ret,
+		    ret = testdialect(&dialecttests[i], 1, 7, 3)) == -1)
+			goto err;
+		nfail += ret;
+		ntest += 3;
+	}
+	if ((state = csv_init(NULL)) == NULL)
+		goto err;
+	for (i = 0; i < ACNT(baddialects); i++) {
+		errno = 0;
+		if (csv_setopt(state, CSV_DIALECT, &baddialects[i]) != -1 ||
+		    errno != EINVAL) {
+			printf("failed: bad dialect %zu\n", i);
+			nfail++;
+		}
+	}
+	csv_destroy(state);
+	free(state);
+	ntest += ACNT(baddialects);
+	for (i = 0; i < ACNT(projtests); i++) {
+		if ((ret = testproject(&projtests[i], 1, 0, 1)) == -1 ||
+		    (nfail += ret,
+		    ret = testproject(&projtests[i], 0, 1, 1)) == -1 ||
+		    (nfail += ret,
+		    ret = testproject(&projtests[i], 1, 7, 3)) == -1)
+			goto err;
+		nfail += ret;
+		ntest += 3;
+	}
+	if ((state = csv_init(NULL)) == NULL)
+		goto err;
+	errno = 0;
+	if (csv_setopt(state, CSV_PROJECT, projtests[0].col, (size_t)0) ==
+	    -1 ||
+	    csv_setopt(state, CSV_PROJECT, (size_t []){1, 1}, (size_t)2) !=
+	    -1 || errno != EINVAL) {
+		printf("failed: bad projection\n");
+		nfail++;
+	}
+	csv_destroy(state);
+	free(state);
+	ntest++;
+	for (i = 0; i < ACNT(snifftests); i++)
+		nfail += testsniff(&snifftests[i]);
+	ntest += ACNT(snifftests);
+	if ((ret = testindex(1)) == -1 ||
+	    (nfail += ret, ret = testindex(3)) == -1)
+		goto err;
+	nfail += ret;
+	ntest += 2;
+	if (nfail > 0) {
+		printf("failed %d of %d\n", nfail, ntest);
+		return (EXIT_FAILURE);
+	}
+	return (EXIT_SUCCESS);
+err:
+	perror("testcsv");
+	return (EXIT_FAILURE);
+}
+
+/* testline: read lt's line and compare its fields with lt's
+ * Fields are compared both as slices and as copies. Slices that don't need to
+ * be unescaped must point into the line.
+ * Returns -1 on error.
+ * Returns 0 on test success.
+ * Returns 1 on test error.
+ */
+static int
+testline(struct csvstate *state, const struct linetest *lt)
+{
+	char buf[BUFSIZ];
+	const struct csvslice *sp;
+	const char *line, *field;
+	FILE *fp;
+	size_t i, n;
+	int ret = -1;
+
+	if ((fp = fmemopen((void *)lt->line, strlen(lt->line), "r")) == NULL)
+		return (-1);
+	if ((line = csv_getline(state, fp)) == NULL)
+		goto end;
+	for (n = 0; lt->field[n] != NULL; n++)
+		;
+	ret = 1;
+	if (csv_nfield(state) != n)
+		goto fail;
+	for (i = 0; i < n; i++) {
+		sp = csv_getslice(state, i);
+		if (!sp->escaped && (sp->ptr < line ||
+		    sp->ptr + sp->len > line + strlen(line)))
+			goto fail;
+		if (csv_unescape(sp, buf) != strlen(lt->field[i]) ||
+		    strcmp(buf, lt->field[i]) != 0)
+			goto fail;
+		if ((field = csv_getfield(state, i)) == NULL ||
+		    strcmp(field, lt->field[i]) != 0)
+			goto fail;
+	}
+	if (csv_getslice(state, n) != NULL || csv_getfield(state, n) != NULL)
+		goto fail;
+	ret = 0;
+	goto end;
+fail:
+	printf("failed: %s", lt->line);
+end:
+	fclose(fp);
+	return (ret);
+}
+
+/* testrecords: read recinput with csv_getrecord and compare its records with
+ * recfields
+ * recinput is in a file if mapped is true, else it's in a pipe. It's read
+ * blksize bytes at a time unless blksize is 0, with nthread threads if mapped.
+ * Returns -1 on error.
+ * Returns 0 on test success.
+ * Returns 1 on test error.
+ */
+static int
+testrecords(int mapped, size_t blksize, int nthread)
+{
+	struct csvstate *state;
+	const char *field;
+	FILE *fp = NULL;
+	size_t i, n, len;
+	int fd = -1;
+	int ret = -1;
+
+	if ((state = csv_init(NULL)) == NULL)
+		return (-1);
+	if (openinput(recinput, mapped, &fp, &fd) == -1)
+		goto end;
+	if ((blksize > 0 && csv_setopt(state, CSV_BLKSIZE, blksize) == -1) ||
+	    csv_setopt(state, CSV_NTHREAD, nthread) == -1 ||
+	    csv_setfd(state, fd) == -1)
+		goto end;
+	ret = 1;
+	for (i = 0; i < ACNT(recfields); i++) {
+		if (csv_getrecord(state, &len) == NULL)
+			goto fail;
+		for (n = 0; recfields[i][n] != NULL; n++)
+			if ((field = csv_getfield(state, n)) == NULL ||
+			    strcmp(field, recfields[i][n]) != 0)
+				goto fail;
+		if (csv_nfield(state) != n)
+			goto fail;
+	}
+	if (csv_getrecord(state, &len) != NULL)
+		goto fail;
+	ret = 0;
+	goto end;
+fail:
+	printf("failed: record %zu, mapped %d, blksize %zu, %d threads\n", i,
+	    mapped, blksize, nthread);
+end:
+	if (fp != NULL)
+		fclose(fp);
+	else if (fd != -1)
+		close(fd);
+	csv_destroy(state);
+	free(state);
+	return (ret);
+}
+
+/* testchunks: read a mapped recinput blksize bytes at a time with
+ * csv_parallel, and compare the number of its records and fields with
+ * recfields'
+ * Returns -1 on error.
+ * Returns 0 on test success.
+ * Returns 1 on test error.
+ */
+static int
+testchunks(size_t blksize)
+{
+	struct chunktotal total = {.nrec = 0};
+	struct csvstate *state;
+	FILE *fp = NULL;
+	size_t i, n, nfield;
+	int fd = -1;
+	int ret = -1;
+
+	if ((errno = pthread_mutex_init(&total.lock, NULL)) != 0)
+		return (-1);
+	if ((state = csv_init(NULL)) == NULL)
+		goto end;
+	if (openinput(recinput, 1, &fp, &fd) == -1 ||
+	    csv_setopt(state, CSV_BLKSIZE, blksize) == -1 ||
+	    csv_setopt(state, CSV_NTHREAD, 3) == -1 ||
+	    csv_setfd(state, fd) == -1 ||
+	    csv_parallel(state, countchunk, &total) == -1)
+		goto end;
+	for (i = 0, nfield = 0; i < ACNT(recfields); i++)
+		for (n = 0; recfields[i][n] != NULL; n++)
+			nfield++;
+	ret = 0;
+	if (total.nrec != ACNT(recfields) || total.nfield != nfield) {
+		printf("failed: chunks, blksize %zu\n", blksize);
+		ret = 1;
+	}
+end:
+	if (fp != NULL)
+		fclose(fp);
+	if (state != NULL) {
+		csv_destroy(state);
+		free(state);
+	}
+	pthread_mutex_destroy(&total.lock);
+	return (ret);
+}
+
+/* testbatch: read batchinput with csv_getbatch and check its columns
+ * Returns -1 on error.
+ * Returns 0 on test success.
+ * Returns 1 on test error.
+ */
+static int
+testbatch(void)
+{
+	struct csvstate *state;
+	struct csvbatch *batch = NULL;
+	struct csvcolumn *cp;
+	FILE *fp = NULL;
+	int fd = -1;
+	int ret = -1;
+
+	if ((state = csv_init(NULL)) == NULL)
+		return (-1);
+	if ((batch = csv_batchinit(NULL)) == NULL ||
+	    csv_batchtype(batch, 0, CSV_TINT) == -1 ||
+	    csv_batchtype(batch, 1, CSV_TDOUBLE) == -1 ||
+	    openinput(batchinput, 0, &fp, &fd) == -1 ||
+	    csv_setfd(state, fd) == -1 ||
+	    csv_getbatch(state, batch, 2) == -1)
+		goto end;
+	ret = 1;
+	cp = batch->col;
+	if (batch->nrec != 2 || batch->ncol != 3 || batch->nfield[0] != 3 ||
+	    batch->nfield[1] != 2)
+		goto fail;
+	if (cp[0].bad[0] || cp[0].i[0] != 1 || cp[0].bad[1] ||
+	    cp[0].i[1] != -3)
+		goto fail;
+	if (cp[1].bad[0] || cp[1].d[0] != 2.5 || cp[1].bad[1] ||
+	    cp[1].d[1] != 1000)
+		goto fail;
+	if (strcmp(batch->data + cp[2].off[0], "x") != 0 || !cp[2].bad[1] ||
+	    cp[2].len[1] != 0)
+		goto fail;
+	if (csv_getbatch(state, batch, 2) == -1) {
+		ret = -1;
+		goto end;
+	}
+	cp = batch->col;
+	if (batch->nrec != 2 || batch->ncol != 4 || batch->nfield[0] != 4)
+		goto fail;
+	if (!cp[0].bad[0] || !cp[0].bad[1] || !cp[1].bad[0] ||
+	    cp[1].bad[1] || cp[1].d[1] != 16)
+		goto fail;
+	if (strcmp(batch->data + cp[2].off[1], "q\"") != 0 ||
+	    cp[2].len[1] != 2 ||
+	    strcmp(batch->data + cp[3].off[0], "extra") != 0 || !cp[3].bad[1])
+		goto fail;
+	if (csv_getbatch(state, batch, 2) == -1) {
+		ret = -1;
+		goto end;
+	}
+	if (batch->nrec != 0)
+		goto fail;
+	ret = 0;
+	goto end;
+fail:
+	printf("failed: batch\n");
+end:
+	if (fd != -1)
+		close(fd);
+	if (batch != NULL) {
+		csv_batchdestroy(batch);
+		free(batch);
+	}
+	csv_destroy(state);
+	free(state);
+	return (ret);
+}
+
+/* testint: convert its string with csv_toint64 and compare with it
+ * Returns 0 on test success.
+ * Returns 1 on test error.
+ */
+static int
+testint(const struct inttest *it)
+{
+	int64_t val = 0;
+	int ret;
+
+	errno = 0;
+	ret = csv_toint64(it->s, strlen(it->s), &val);
+	if (it->err != 0 ? ret != -1 || errno != it->err :
+	    ret != 0 || val != it->val) {
+		printf("failed: int \"%s\"\n", it->s);
+		return (1);
+	}
+	return (0);
+}
+
+/* testdouble: convert s with csv_todouble and compare with strtod
+ * If isnum is false, s must be rejected instead. Both the value and the error
+ * are compared, bit by bit. strtod's ERANGE for subnormals isn't.
+ * Returns 0 on test success.
+ * Returns 1 on test error.
+ */
+static int
+testdouble(const char *s, int isnum)
+{
+	double want, got = 0;
+	int ret, range;
+
+	errno = 0;
+	want = strtod(s, NULL);
+	range = errno == ERANGE && (want == 0 || want == HUGE_VAL ||
+	    want == -HUGE_VAL);
+	errno = 0;
+	ret = csv_todouble(s, strlen(s), &got);
+	if (!isnum) {
+		if (ret == -1 && errno == EINVAL)
+			return (0);
+	} else if ((range ? ret == -1 && errno == ERANGE : ret == 0) &&
+	    (want != want ? got != got : memcmp(&want, &got, sizeof(got)) == 0))
+		return (0);
+	printf("failed: double \"%s\"\n", s);
+	return (1);
+}
+
+/* testtime: convert tt's string with csv_totime and compare with it
+ * Returns 0 on test success.
+ * Returns 1 on test error.
+ */
+static int
+testtime(const struct timetest *tt)
+{
+	struct timespec ts = {0, 0};
+	int ret;
+
+	errno = 0;
+	ret = csv_totime(tt->s, strlen(tt->s), &ts);
+	if (tt->err != 0 ? ret != -1 || errno != tt->err :
+	    ret != 0 || ts.tv_sec != tt->sec || ts.tv_nsec != tt->nsec) {
+		printf("failed: time \"%s\"\n", tt->s);
+		return (1);
+	}
+	return (0);
+}
+
+/* testwrite: write writefields, recfields and a field bigger than the write
+ * buffer with a csvwriter, and check what's written and read back
+ * Returns -1 on error.
+ * Returns 0 on test success.
+ * Returns 1 on test error.
+ */
+static int
+testwrite(void)
+{
+	struct csvwriter *writer;
+	struct csvstate *state = NULL;
+	const char *field;
+	char *big = NULL, out[sizeof(writeoutput)];
+	FILE *fp;
+	size_t i, n, len, biglen = 1 << 20;
+	int fd, ret = -1;
+
+	if ((fp = tmpfile()) == NULL)
+		return (-1);
+	fd = fileno(fp);
+	if ((writer = csv_writerinit(NULL, fd, ',')) == NULL)
+		goto end;
+	if ((big = malloc(biglen)) == NULL)
+		goto end;
+	memset(big, 'x', biglen);
+	big[biglen / 2] = '"';
+	for (i = 0; i < ACNT(writefields); i++) {
+		for (n = 0; n < 3 && writefields[i][n] != NULL; n++)
+			;
+		if (csv_writerecord(writer, writefields[i], n) == -1)
+			goto end;
+	}
+	for (i = 0; i < ACNT(recfields); i++) {
+		for (n = 0; recfields[i][n] != NULL; n++)
+			;
+		if (csv_writerecord(writer, recfields[i], n) == -1)
+			goto end;
+	}
+	if (csv_writefield(writer, big, biglen) == -1 ||
+	    csv_endrecord(writer) == -1 || csv_flush(writer) == -1)
+		goto end;
+	if (pread(fd, out, sizeof(out) - 1, 0) != sizeof(out) - 1)
+		goto end;
+	out[sizeof(out) - 1] = '\0';
+	ret = 1;
+	if (strcmp(out, writeoutput) != 0)
+		goto fail;
+	ret = -1;
+	if ((state = csv_init(NULL)) == NULL || csv_setfd(state, fd) == -1)
+		goto end;
+	ret = 1;
+	for (i = 0; i < ACNT(writefields); i++)
+		if (csv_getrecord(state, &len) == NULL)
+			goto fail;
+	for (i = 0; i < ACNT(recfields); i++) {
+		if (csv_getrecord(state, &len) == NULL)
+			goto fail;
+		for (n = 0; recfields[i][n] != NULL; n++)
+			if ((field = csv_getfield(state, n)) == NULL ||
+			    strcmp(field, recfields[i][n]) != 0)
+				goto fail;
+		if (csv_nfield(state) != n)
+			goto fail;
+	}
+	if (csv_getrecord(state, &len) == NULL || csv_nfield(state) != 1 ||
+	    (field = csv_getfield(state, 0)) == NULL ||
+	    strlen(field) != biglen || memcmp(field, big, biglen) != 0 ||
+	    csv_getrecord(state, &len) != NULL)
+		goto fail;
+	ret = 0;
+	goto end;
+fail:
+	printf("failed: write, record %zu\n", i);
+end:
+	if (state != NULL) {
+		csv_destroy(state);
+		free(state);
+	}
+	if (writer != NULL) {
+		csv_writerdestroy(writer);
+		free(writer);
+	}
+	free(big);
+	fclose(fp);
+	return (ret);
+}
+
+/* testdialect: read dt's input with its dialect, and compare the records
+ * with dt's
+ * The input is read from a file if mapped is true, else from a pipe, and
+ * blksize bytes at a time by nthread threads.
+ * Returns -1 on error.
+ * Returns 0 on test success.
+ * Returns 1 on test error.
+ */
+static int
+testdialect(const struct dialecttest *dt, int mapped, size_t blksize,
+    int nthread)
+{
+	struct csvstate *state;
+	const char *field;
+	char out[256];
+	FILE *fp = NULL;
+	size_t i, n, len, outlen = 0;
+	int fd = -1;
+	int ret = -1;
+
+	if ((state = csv_init(NULL)) == NULL)
+		return (-1);
+	if (openinput(dt->in, mapped, &fp, &fd) == -1)
+		goto end;
+	if (csv_setopt(state, CSV_DIALECT, &dt->d) == -1 ||
+	    (blksize > 0 && csv_setopt(state, CSV_BLKSIZE, blksize) == -1) ||
+	    csv_setopt(state, CSV_NTHREAD, nthread) == -1 ||
+	    csv_setfd(state, fd) == -1)
+		goto end;
+	for (errno = 0; csv_getrecord(state, &len) != NULL; errno = 0) {
+		n = csv_nfield(state);
+		for (i = 0; i < n; i++) {
+			if ((field = csv_getfield(state, i)) == NULL)
+				goto end;
+			outlen += snprintf(out + outlen, sizeof(out) - outlen,
+			    "<%s>", field);
+			if (outlen >= sizeof(out))
+				goto end;
+		}
+		outlen += snprintf(out + outlen, sizeof(out) - outlen, ";");
+		if (outlen >= sizeof(out))
+			goto end;
+	}
+	if (errno != 0)
+		goto end;
+	ret = 0;
+	if (strcmp(out, dt->out) != 0) {
+		printf("failed: dialect \"%s\", mapped %d, blksize %zu, "
+		    "%d threads\n", dt->d.sep, mapped, blksize, nthread);
+		ret = 1;
+	}
+end:
+	if (fp != NULL)
+		fclose(fp);
+	else if (fd != -1)
+		close(fd);
+	csv_destroy(state);
+	free(state);
+	return (ret);
+}
+
+/* testproject: read pt's input with its projection, and compare the records
+ * with pt's
+ * The input is read as testdialect reads it.
+ * Returns -1 on error.
+ * Returns 0 on test success.
+ * Returns 1 on test error.
+ */
+static int
+testproject(const struct projtest *pt, int mapped, size_t blksize,
+    int nthread)
+{
+	struct csvstate *state;
+	const char *field;
+	char out[256];
+	FILE *fp = NULL;
+	size_t i, n, len, outlen = 0;
+	int fd = -1;
+	int ret = -1;
+
+	if ((state = csv_init(NULL)) == NULL)
+		return (-1);
+	if (openinput(pt->in, mapped, &fp, &fd) == -1)
+		goto end;
+	if (csv_setopt(state, CSV_PROJECT, pt->col, pt->ncol) == -1 ||
+	    (blksize > 0 && csv_setopt(state, CSV_BLKSIZE, blksize) == -1) ||
+	    csv_setopt(state, CSV_NTHREAD, nthread) == -1 ||
+	    csv_setfd(state, fd) == -1)
+		goto end;
+	for (errno = 0; csv_getrecord(state, &len) != NULL; errno = 0) {
+		n = csv_nfield(state);
+		for (i = 0; i < n; i++) {
+			/* A missing field has no slice, nor copy. */
+			if ((field = csv_getfield(state, i)) == NULL &&
+			    csv_getslice(state, i) != NULL)
+				goto end;
+			if (field == NULL)
+				outlen += snprintf(out + outlen,
+				    sizeof(out) - outlen, "-");
+			else
+				outlen += snprintf(out + outlen,
+				    sizeof(out) - outlen, "<%s>", field);
+			if (outlen >= sizeof(out))
+				goto end;
+		}
+		outlen += snprintf(out + outlen, sizeof(out) - outlen, ";");
+		if (outlen >= sizeof(out))
+			goto end;
+	}
+	if (errno != 0)
+		goto end;
+	ret = 0;
+	if (strcmp(out, pt->out) != 0) {
+		printf("failed: projection of %zu columns, mapped %d, "
+		    "blksize %zu, %d threads\n", pt->ncol, mapped, blksize,
+		    nthread);
+		ret = 1;
+	}
+end:
+	if (fp != NULL)
+		fclose(fp);
+	else if (fd != -1)
+		close(fd);
+	csv_destroy(state);
+	free(state);
+	return (ret);
+}
+
+/* testsniff: sniff st's input with csv_sniff and compare with st's dialect
+ * Returns 0 on test success.
+ * Returns 1 on test error.
+ */
+static int
+testsniff(const struct snifftest *st)
+{
+	struct csvdialect d;
+
+	csv_sniff(st->in, strlen(st->in), &d);
+	if (strcmp(d.sep, st->d.sep) != 0 || d.quote != st->d.quote ||
+	    d.esc != st->d.esc || d.nl != st->d.nl ||
+	    d.header != st->d.header) {
+		printf("failed: sniff \"%s\"\n", st->in);
+		return (1);
+	}
+	return (0);
+}
+
+/* testindex: index a mapped recinput every 3 records, read by nthread threads,
+ * and compare the records sought to with recfields
+ * The index is saved and loaded again first, and can't be loaded for another
+ * input. Offsets of the records must be the same read from a pipe a byte at a
+ * time.
+ * Returns -1 on error.
+ * Returns 0 on test success.
+ * Returns 1 on test error.
+ */
+static int
+testindex(int nthread)
+{
+	struct csvstate *state, *pstate = NULL;
+	struct csvindex *ix = NULL;
+	off_t off[ACNT(recfields)];
+	const char *field;
+	FILE *fp = NULL, *ixfp = NULL;
+	size_t i, n, len;
+	int fd = -1, pfd = -1;
+	int ret = -1;
+
+	if ((state = csv_init(NULL)) == NULL)
+		return (-1);
+	if ((ix = csv_indexinit(NULL, 3)) == NULL ||
+	    (pstate = csv_init(NULL)) == NULL)
+		goto end;
+	if (openinput(recinput, 1, &fp, &fd) == -1 ||
+	    csv_setopt(state, CSV_BLKSIZE, (size_t)7) == -1 ||
+	    csv_setopt(state, CSV_NTHREAD, nthread) == -1 ||
+	    csv_setfd(state, fd) == -1 || csv_indexbuild(ix, state) == -1)
+		goto end;
+	if ((ixfp = tmpfile()) == NULL ||
+	    csv_indexsave(ix, fileno(ixfp), fd) == -1 ||
+	    lseek(fileno(ixfp), 0, SEEK_SET) == -1)
+		goto end;
+	csv_indexdestroy(ix);
+	if (csv_indexinit(ix, 1) == NULL ||
+	    csv_indexload(ix, fileno(ixfp), fd) == -1)
+		goto end;
+	ret = 1;
+	if (csv_indexnrec(ix) != ACNT(recfields)) {
+		i = 0;
+		goto fail;
+	}
+	/* Backwards, so that every record is sought to. */
+	for (i = ACNT(recfields); i-- > 0;) {
+		if (csv_indexseek(ix, state, i) == -1 ||
+		    csv_getrecord(state, &len) == NULL)
+			goto fail;
+		off[i] = csv_tell(state);
+		for (n = 0; recfields[i][n] != NULL; n++)
+			if ((field = csv_getfield(state, n)) == NULL ||
+			    strcmp(field, recfields[i][n]) != 0)
+				goto fail;
+		if (csv_nfield(state) != n)
+			goto fail;
+	}
+	if (openinput(recinput, 0, NULL, &pfd) == -1 ||
+	    csv_setopt(pstate, CSV_BLKSIZE, (size_t)1) == -1 ||
+	    csv_setfd(pstate, pfd) == -1) {
+		ret = -1;
+		goto end;
+	}
+	for (i = 0; i < ACNT(recfields); i++)
+		if (csv_getrecord(pstate, &len) == NULL ||
+		    csv_tell(pstate) != off[i])
+			goto fail;
+	i = 0;
+	errno = 0;
+	if (lseek(fileno(ixfp), 0, SEEK_SET) == -1 ||
+	    csv_indexload(ix, fileno(ixfp), pfd) != -1 || errno != ESTALE)
+		goto fail;
+	ret = 0;
+	goto end;
+fail:
+	printf("failed: index, record %zu, %d threads\n", i, nthread);
+end:
+	if (fp != NULL)
+		fclose(fp);
+	if (ixfp != NULL)
+		fclose(ixfp);
+	if (pfd != -1)
+		close(pfd);
+	if (ix != NULL) {
+		csv_indexdestroy(ix);
+		free(ix);
+	}
+	if (pstate != NULL) {
+		csv_destroy(pstate);
+		free(pstate);
+	}
+	csv_destroy(state);
+	free(state);
+	return (ret);
+}
+
+/* countchunk: add the records and fields of a chunk to the chunktotal arg */
+static int
+countchunk(struct csvstate *state, void *arg)
+{
+	struct chunktotal *total = arg;
+	size_t len, nrec = 0, nfield = 0;
+
+	for (; csv_getrecord(state, &len) != NULL; nrec++)
+		nfield += csv_nfield(state);
+	pthread_mutex_lock(&total->lock);
+	total->nrec += nrec;
+	total->nfield += nfield;
+	pthread_mutex_unlock(&total->lock);
+	return (0);
+}
+
+/* openinput: set *fdp to a descriptor to read in from
+ * in is in a file, which *fpp is set to, if mapped is true. Else it's in a
+ * pipe, and must be smaller than its buffer.
+ *
+ * Returns -1 on error.
+ */
+static int
+openinput(const char *in, int mapped, FILE **fpp, int *fdp)
+{
+	size_t len = strlen(in);
+	int fd[2];
+
+	if (mapped) {
+		if ((*fpp = tmpfile()) == NULL)
+			return (-1);
+		if (fwrite(in, 1, len, *fpp) != len || fflush(*fpp) == EOF)
+			return (-1);
+		*fdp = fileno(*fpp);
+		return (0);
+	}
+	if (pipe(fd) == -1)
+		return (-1);
+	*fdp = fd[0];
+	if (write(fd[1], in, len) != (ssize_t)len) {
+		close(fd[1]);
+		return (-1);
+	}
+	close(fd[1]);
+	return (0);
+}
@@ -1,20 +1,182 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "8-2/misc.h"
+
 #if !defined(SIZE_MAX)
 	#define SIZE_MAX ((size_t)-1)
 #endif
 
 size_t lflag = 6;
+long jflag = 1;
+/* printf format of the offsets of strings, for -t. */
+const char *tflag = NULL;
+int uflag = 0;
 
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 
+enum {
+	/* bytes read at once from a file that isn't mapped */
+	BLKSIZE = 1 << 20,
+	/* bytes of output buffered before they're written */
+	OUTBUFSIZE = 1 << 16,
+	/* bytes of a mapped file a -j thread scans at once */
+	CHUNKSIZE = 1 << 22,
+	/* chunks queued per -j thread, scanned or waiting to be printed */
+	CHUNKSPERTHREAD = 4
+};
+
+/* Vectors of bytes, and the mask of those that isprint in the C locale: more
+ * than 0x1f as signed chars, so not 0x80 and up, and not DEL. For -u, the
+ * masks of NULs, of UTF-8 lead bytes: 0xc2 to 0xf4, -62 to -12 signed, and of
+ * continuation bytes: 0x80 to 0xbf, less than -64.
+ */
+#if defined(__AVX2__)
+typedef __m256i vec;
+#define VECLEN		32
+#define VECLOAD(p)	_mm256_loadu_si256((const vec *)(p))
+#define VECPRINT(v)	((uint32_t)_mm256_movemask_epi8(_mm256_andnot_si256( \
+			    _mm256_cmpeq_epi8((v), _mm256_set1_epi8(0x7f)), \
+			    _mm256_cmpgt_epi8((v), _mm256_set1_epi8(0x1f)))))
+#define VECZERO(v)	((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8((v), \
+			    _mm256_setzero_si256())))
+#define VECLEAD(v)	((uint32_t)_mm256_movemask_epi8(_mm256_and_si256( \
+			    _mm256_cmpgt_epi8((v), _mm256_set1_epi8(-63)), \
+			    _mm256_cmpgt_epi8(_mm256_set1_epi8(-11), (v)))))
+#define VECCONT(v)	((uint32_t)_mm256_movemask_epi8(_mm256_cmpgt_epi8( \
+			    _mm256_set1_epi8(-64), (v))))
+#elif defined(__SSE2__)
+typedef __m128i vec;
+#define VECLEN		16
+#define VECLOAD(p)	_mm_loadu_si128((const vec *)(p))
+#define VECPRINT(v)	((uint32_t)_mm_movemask_epi8(_mm_andnot_si128( \
+			    _mm_cmpeq_epi8((v), _mm_set1_epi8(0x7f)), \
+			    _mm_cmpgt_epi8((v), _mm_set1_epi8(0x1f)))))
+#define VECZERO(v)	((uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8((v), \
+			    _mm_setzero_si128())))
+#define VECLEAD(v)	((uint32_t)_mm_movemask_epi8(_mm_and_si128( \
+			    _mm_cmpgt_epi8((v), _mm_set1_epi8(-63)), \
+			    _mm_cmpgt_epi8(_mm_set1_epi8(-11), (v)))))
+#define VECCONT(v)	((uint32_t)_mm_movemask_epi8(_mm_cmpgt_epi8( \
+			    _mm_set1_epi8(-64), (v))))
+#endif
+
+/* A file to scan, mapped if it can be. */
+struct sfile {
+	char		*name;
+	int		fd;
+	/* The file's bytes, or NULL if it's read. */
+	unsigned char	*base;
+	size_t		len;
+	/* Number of its chunks queued and not printed yet, for -j. */
+	size_t		nleft;
+	/* Are all of its chunks queued? */
+	int		queued;
+};
+
+/* The encodings of the strings -u finds. */
+enum {
+	ENC_NONE,	/* not in a string */
+	ENC_UTF8,	/* ASCII or UTF-8 */
+	ENC_UTF16	/* UTF-16LE, of printable ASCII */
+};
+
+/* Where the scan of a file is, between the blocks it's read in. */
+struct scanner {
+	const char	*filename;
+	/* Bytes of a string of fewer than lflag characters so far. */
+	unsigned char	*pend;
+	size_t		npend;
+	/* Is a string being printed? */
+	int		inrun;
+	struct outbuf	*out;
+	/* File offset of the next byte scanned, and of the string. */
+	off_t		off;
+	off_t		start;
+	/* For -u: the string's encoding, its number of characters, and its
+	 * last byte if that's ASCII. Strings that start before from aren't
+	 * printed, and none start at stop or after, unless stop is -1.
+	 */
+	int		kind;
+	size_t		nchar;
+	unsigned char	last;
+	off_t		from;
+	off_t		stop;
+};
+
+/* A chunk of a file scanned by a -j thread, into out. A file that isn't mapped
+ * is a single chunk.
+ */
+struct chunk {
+	struct sfile	*file;
+	size_t		start;
+	size_t		end;
+	struct outbuf	out;
+	/* -1 if the scan failed. */
+	int		ret;
+	/* Is out complete? */
+	int		done;
+};
+
+/* The chunks of a -j run. Chunk i is in slot i % nslot, and its slot is only
+ * reused once it's printed, so chunks are printed in the order they're
+ * queued.
+ */
+struct pool {
+	struct chunk	*chunk;
+	size_t		nslot;
+	/* Number of chunks queued. */
+	size_t		nqueued;
+	/* Next chunk a thread scans. */
+	size_t		next;
+	/* Should the threads stop? */
+	int		stop;
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+};
+
+/* isprint of every byte, in the C locale the program runs in. */
+static unsigned char printable[UCHAR_MAX + 1];
+
 static int cook_args(int, char **);
-static int strings(char *, FILE *, char *, size_t);
-static int pstrings(unsigned char *, size_t, FILE *, char *);
+static int cook_parallel(int, char **);
+static void *scan_thread(void *);
+static int sfile_open(struct sfile *, char *);
+static void sfile_close(struct sfile *);
+static int strings(struct sfile *, size_t, size_t, unsigned char *,
+    struct outbuf *);
+static int scan(struct scanner *, const unsigned char *, size_t);
+static int scanu(struct scanner *, const unsigned char *, size_t, int,
+    size_t *);
+static int scanend(struct scanner *);
+static size_t span(const unsigned char *, size_t, int);
+static size_t span16(const unsigned char *, size_t);
+static size_t skipu(const unsigned char *, size_t);
+static int unit8(const unsigned char *, size_t, int);
+static void begin(struct scanner *, off_t, int);
+static int addchars(struct scanner *, const unsigned char *, size_t,
+    size_t);
+static int startrun(struct scanner *);
+#if defined(VECLEN)
+static int ctz(uint32_t);
+#endif
 
 int
 main(int argc, char *argv[])
@@ -23,22 +185,48 @@ main(int argc, char *argv[])
 	const char *err;
 	extern char *optarg;
 
-	while ((c = getopt(argc, argv, "l:")) != -1) {
+	while ((c = getopt(argc, argv, "j:l:t:u")) != -1) {
 		switch(c) {
+		case 'j':
+			jflag = strtonum(optarg, 1, INT_MAX, &err);
+			if (err != NULL)
+				fprintf(stderr, "%s\n", err);
+			break;
 		case 'l':
-			lflag = strtonum(optarg, 0, MIN(LLONG_MAX, SIZE_MAX),
-			    &err);
+			lflag = strtonum(optarg, 0,
+			    MIN(LLONG_MAX, SIZE_MAX / 4), &err);
 			if (err != NULL)
 				fprintf(stderr, "%s\n", err);
 			break;
+		case 't':
+			if (strcmp(optarg, "d") == 0)
+				tflag = "%jd ";
+			else if (strcmp(optarg, "o") == 0)
+				tflag = "%jo ";
+			else if (strcmp(optarg, "x") == 0)
+				tflag = "%jx ";
+			else
+				fprintf(stderr, "bad offset format %s\n",
+				    optarg);
+			break;
+		case 'u':
+			uflag = 1;
+			break;
 		default:
-			printf("usage: strings filenames");
+			printf("usage: strings [-u] [-j nthreads] [-l len] "
+			    "[-t d|o|x] filenames");
 			break;
 		}
 	}
 	argc -= optind;
 	argv += optind;
-	if (cook_args(argc, argv) == -1)
+	for (c = 0; c <= UCHAR_MAX; c++)
+		printable[c] = isprint(c) != 0;
+	if (jflag > 1)
+		c = cook_parallel(argc, argv);
+	else
+		c = cook_args(argc, argv);
+	if (c == -1)
 		return (EXIT_FAILURE);
 	return (EXIT_SUCCESS);
 }
@@ -49,81 +237,666 @@ main(int argc, char *argv[])
 static int
 cook_args(int argc, char *argv[])
 {
-	char *buf;
-	size_t buflen = lflag;
+	struct outbuf out;
+	struct sfile f;
+	unsigned char *buf;
 	int i;
-	FILE *fin;
-	int ret;
-	if ((buf = malloc(buflen)) == NULL)
+	int ret = -1;
+
+	/* Room for a string one character short of lflag, to carry between
+	 * blocks, at up to 4 bytes a character for -u.
+	 */
+	if ((buf = malloc(lflag > 0 ? lflag * 4 : 1)) == NULL)
 		return (-1);
+	if (outbuf_init(&out, STDOUT_FILENO, OUTBUFSIZE) == -1)
+		goto end;
 	for (i = 0; i < argc; i++) {
-		if ((fin = fopen(argv[i], "rb")) == NULL) {
-			printf("can't open %s:", argv[i]);
+		if (sfile_open(&f, argv[i]) == -1) {
+			fprintf(stderr, "can't open %s\n", argv[i]);
 		} else {
-			ret = strings(argv[i], fin, buf, buflen);
-			fclose(fin);
+			ret = strings(&f, 0, f.len, buf, &out);
+			sfile_close(&f);
 			if (ret == -1)
 				goto end;
 		}
 	}
-	ret = 0;
+	ret = outbuf_flush(&out);
 end:
+	outbuf_free(&out);
 	free(buf);
 	return (ret);
 }
 
-/* strings: extract printable strings from stream */
+/* cook_parallel: do the main work of the program with jflag threads
+ * Files are split into chunks that the threads scan, several files at once.
+ * The output of each chunk is kept until it's printed, in the order
+ * cook_args would print it.
+ *
+ * Returns -1 on error.
+ */
 static int
-strings(char *filename, FILE *fp, char *buf, size_t buflen)
+cook_parallel(int argc, char *argv[])
 {
-	int c;
+	struct pool pool = {.nslot = jflag * CHUNKSPERTHREAD};
+	struct sfile *f = NULL;
+	struct chunk *c;
+	pthread_t *tid;
+	size_t off = 0, nprinted = 0;
+	long nthr = 0, i;
+	int arg = 0;
+	int ret = -1;
 
+	if ((errno = pthread_mutex_init(&pool.lock, NULL)) != 0)
+		return (-1);
+	if ((errno = pthread_cond_init(&pool.cond, NULL)) != 0) {
+		pthread_mutex_destroy(&pool.lock);
+		return (-1);
+	}
+	if ((tid = calloc(jflag, sizeof(*tid))) == NULL ||
+	    (pool.chunk = calloc(pool.nslot, sizeof(*pool.chunk))) == NULL)
+		goto end;
+	for (; nthr < jflag; nthr++)
+		if ((errno = pthread_create(&tid[nthr], NULL, scan_thread,
+		    &pool)) != 0)
+			goto end;
+	pthread_mutex_lock(&pool.lock);
 	for (;;) {
-		c = getc(fp);
-		if (c == EOF) {
-			if (ferror(fp))
-				return (-1);
-			else if (feof(fp))
-				return (0);
+		/* Queue chunks while there are free slots. */
+		while (pool.nqueued - nprinted < pool.nslot &&
+		    (f != NULL || arg < argc)) {
+			if (f == NULL) {
+				pthread_mutex_unlock(&pool.lock);
+				if ((f = malloc(sizeof(*f))) == NULL)
+					goto end;
+				if (sfile_open(f, argv[arg]) == -1) {
+					fprintf(stderr, "can't open %s\n",
+					    argv[arg]);
+					free(f);
+					f = NULL;
+				}
+				arg++;
+				off = 0;
+				pthread_mutex_lock(&pool.lock);
+				continue;
+			}
+			c = &pool.chunk[pool.nqueued % pool.nslot];
+			c->file = f;
+			c->start = off;
+			c->end = f->base != NULL ? MIN(f->len - off,
+			    CHUNKSIZE) + off : f->len;
+			c->done = 0;
+			off = c->end;
+			f->nleft++;
+			if (off == f->len) {
+				f->queued = 1;
+				f = NULL;
+			}
+			pool.nqueued++;
+			pthread_cond_broadcast(&pool.cond);
+		}
+		if (nprinted == pool.nqueued)
+			break;
+		/* Print the oldest chunk once it's scanned. */
+		c = &pool.chunk[nprinted % pool.nslot];
+		while (!c->done)
+			pthread_cond_wait(&pool.cond, &pool.lock);
+		pthread_mutex_unlock(&pool.lock);
+		if (c->ret == -1 || nwrite(STDOUT_FILENO, c->out.buf,
+		    c->out.len) != (ssize_t)c->out.len) {
+			outbuf_free(&c->out);
+			goto end;
+		}
+		outbuf_free(&c->out);
+		if (--c->file->nleft == 0 && c->file->queued) {
+			sfile_close(c->file);
+			free(c->file);
 		}
-		if (isprint(c)) {
-			ungetc(c, fp);
-			pstrings(buf, buflen, fp, filename);
+		pthread_mutex_lock(&pool.lock);
+		nprinted++;
+	}
+	pthread_mutex_unlock(&pool.lock);
+	ret = 0;
+end:
+	pthread_mutex_lock(&pool.lock);
+	pool.stop = 1;
+	pthread_cond_broadcast(&pool.cond);
+	pthread_mutex_unlock(&pool.lock);
+	for (i = 0; i < nthr; i++)
+		pthread_join(tid[i], NULL);
+	if (ret == -1 && pool.chunk != NULL) {
+		/* Free what wasn't printed, each file with its last chunk. */
+		if (f != NULL && f->nleft == 0) {
+			sfile_close(f);
+			free(f);
+		}
+		for (; nprinted < pool.nqueued; nprinted++) {
+			c = &pool.chunk[nprinted % pool.nslot];
+			if (c->done)
+				outbuf_free(&c->out);
+			if (--c->file->nleft == 0) {
+				sfile_close(c->file);
+				free(c->file);
+			}
 		}
 	}
+	free(pool.chunk);
+	free(tid);
+	pthread_cond_destroy(&pool.cond);
+	pthread_mutex_destroy(&pool.lock);
+	return (ret);
 }
 
+/* scan_thread: scan the chunks of the pool arg, until it's stopped */
+static void *
+scan_thread(void *arg)
+{
+	struct pool *pool = arg;
+	struct chunk *c;
+	unsigned char *buf;
+	int ret;
+
+	buf = malloc(lflag > 0 ? lflag * 4 : 1);
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (!pool->stop && pool->next == pool->nqueued)
+			pthread_cond_wait(&pool->cond, &pool->lock);
+		if (pool->stop)
+			break;
+		c = &pool->chunk[pool->next++ % pool->nslot];
+		pthread_mutex_unlock(&pool->lock);
+		ret = -1;
+		if (outbuf_init(&c->out, -1, OUTBUFSIZE) == 0 && buf != NULL)
+			ret = strings(c->file, c->start, c->end, buf, &c->out);
+		pthread_mutex_lock(&pool->lock);
+		c->ret = ret;
+		c->done = 1;
+		pthread_cond_broadcast(&pool->cond);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	free(buf);
+	return (NULL);
+}
+
+/* sfile_open: open the file name into f, and map it if it's a regular file
+ * Returns -1 on error.
+ */
 static int
-pstrings(unsigned char *buf, size_t buflen, FILE *fp, char *filename)
+sfile_open(struct sfile *f, char *name)
 {
-	size_t i;
-	int c;
+	struct stat sb;
+	void *base;
+
+	f->name = name;
+	f->base = NULL;
+	f->len = 0;
+	f->nleft = 0;
+	f->queued = 0;
+	if ((f->fd = open(name, O_RDONLY)) == -1)
+		return (-1);
+	if (fstat(f->fd, &sb) == -1) {
+		close(f->fd);
+		return (-1);
+	}
+	if (!S_ISREG(sb.st_mode) || sb.st_size == 0 ||
+	    (uintmax_t)sb.st_size > SIZE_MAX)
+		return (0);
+	/* Not all regular files can be mapped, those are read. */
+	if ((base = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, f->fd, 0))
+	    == MAP_FAILED)
+		return (0);
+	posix_madvise(base, sb.st_size, POSIX_MADV_SEQUENTIAL);
+	f->base = base;
+	f->len = sb.st_size;
+	return (0);
+}
+
+/* sfile_close: unmap and close f */
+static void
+sfile_close(struct sfile *f)
+{
+	if (f->base != NULL)
+		munmap(f->base, f->len);
+	close(f->fd);
+}
+
+/* strings: print the printable strings of at least lflag characters that start
+ * between start and end of f, each on its own line after f's name
+ * A string that starts before end is printed whole, and one that goes on from
+ * before start is left to the chunk it starts in. A file that isn't mapped is
+ * read and scanned BLKSIZE bytes at a time, all of it. buf must have room for
+ * lflag characters.
+ * With -u, what string goes on at start depends on where it started, so the
+ * scan starts over after the last control byte before start, which ends any
+ * string, without printing the strings that start before start. That byte is
+ * only looked for up to CHUNKSIZE bytes back.
+ *
+ * Returns -1 on error.
+ */
+static int
+strings(struct sfile *f, size_t start, size_t end, unsigned char *buf,
+    struct outbuf *out)
+{
+	struct scanner sc = {.filename = f->name, .pend = buf, .out = out,
+	    .stop = -1};
+	unsigned char *blk;
+	ssize_t nread;
+	size_t s, carry = 0, used;
 	int ret = -1;
 
-	for (i = 0;;) {
-		c = getc(fp);
-		if (!isprint(c))
+	if (f->base != NULL && uflag) {
+		for (s = start; s > 0 && start - s < CHUNKSIZE; s--)
+			if ((f->base[s - 1] < 0x20 && f->base[s - 1] != 0) ||
+			    f->base[s - 1] == 0x7f)
+				break;
+		sc.off = s;
+		sc.from = start;
+		sc.stop = end;
+		if (scanu(&sc, f->base + s, f->len - s, 1, &used) == -1)
+			return (-1);
+		return (scanend(&sc));
+	}
+	if (f->base != NULL) {
+		if (start > 0 && printable[f->base[start - 1]])
+			start += span(f->base + start, end - start, 1);
+		sc.off = start;
+		if (scan(&sc, f->base + start, end - start) == -1)
+			return (-1);
+		if ((sc.inrun || sc.npend > 0) && scan(&sc, f->base + end,
+		    span(f->base + end, f->len - end, 1)) == -1)
+			return (-1);
+		return (scanend(&sc));
+	}
+	if ((blk = malloc(BLKSIZE)) == NULL)
+		return (-1);
+	for (;;) {
+		while ((nread = read(f->fd, blk + carry, BLKSIZE - carry)) ==
+		    -1)
+			if (errno != EINTR)
+				goto end;
+		/* -u carries the bytes of a character cut by the block. */
+		if (uflag) {
+			if (scanu(&sc, blk, carry + nread, nread == 0,
+			    &used) == -1)
+				goto end;
+			carry += nread - used;
+			memmove(blk, blk + used, carry);
+		} else if (scan(&sc, blk, nread) == -1)
 			goto end;
-		i++;
-		if (c == EOF) {
-			if (ferror(fp))
+		if (nread == 0)
+			break;
+	}
+	ret = scanend(&sc);
+end:
+	free(blk);
+	return (ret);
+}
+
+/* scan: print the strings of the len bytes at p, which follow the bytes sc
+ * scanned before
+ * A string that reaches the end of p is kept in sc->pend while it's shorter
+ * than lflag, and printed as it's scanned once it isn't.
+ *
+ * Returns -1 on write error.
+ */
+static int
+scan(struct scanner *sc, const unsigned char *p, size_t len)
+{
+	size_t i = 0, n;
+
+	while (i < len) {
+		if (!sc->inrun && sc->npend == 0) {
+			i += span(p + i, len - i, 0);
+			sc->start = sc->off + i;
+		}
+		n = span(p + i, len - i, 1);
+		if (!sc->inrun && sc->npend + n >= lflag && sc->npend + n > 0)
+			if (startrun(sc) == -1)
+				return (-1);
+		if (sc->inrun) {
+			if (outbuf_add(sc->out, p + i, n) == -1)
+				return (-1);
+		} else if (i + n == len) {
+			memcpy(sc->pend + sc->npend, p + i, n);
+			sc->npend += n;
+		}
+		i += n;
+		/* The string ends at an unprintable byte. */
+		if (i < len) {
+			if (sc->inrun && outbuf_add(sc->out, "\n", 1) == -1)
+				return (-1);
+			sc->inrun = 0;
+			sc->npend = 0;
+		}
+	}
+	sc->off += len;
+	return (0);
+}
+
+/* scanu: print the ASCII, UTF-8 and UTF-16LE strings of the len bytes at p,
+ * which follow the bytes sc scanned before, for -u
+ * A character is a printable ASCII byte, a valid UTF-8 sequence of a code
+ * point past the C1 controls, or in UTF-16LE a printable ASCII byte and a
+ * NUL. A string is a run of characters of one encoding, printed as UTF-8. A
+ * UTF-8 string that goes on as UTF-16LE ends there, and the UTF-16LE one
+ * starts with its last byte.
+ * The scan stops at a character that may go on past len unless eof is true,
+ * and at sc->stop once no string goes on. *used is set to the number of bytes
+ * scanned, the rest must be scanned again.
+ *
+ * Returns -1 on write error.
+ */
+static int
+scanu(struct scanner *sc, const unsigned char *p, size_t len, int eof,
+    size_t *used)
+{
+	unsigned char tmp[64];
+	size_t i = 0, lim, n, j;
+	int c;
+
+	while (i < len) {
+		switch (sc->kind) {
+		case ENC_NONE:
+			lim = len;
+			if (sc->stop != -1) {
+				if (sc->off + (off_t)i >= sc->stop)
+					goto end;
+				lim = MIN(len, (size_t)(sc->stop - sc->off));
+			}
+			if ((i += skipu(p + i, lim - i)) == lim)
+				break;
+			if (printable[p[i]]) {
+				/* Its next byte tells the encoding. */
+				if (i + 1 == len && !eof)
+					goto end;
+				/* Strings too short to print that are sure to
+				 * end are skipped whole, binaries are full of
+				 * them.
+				 */
+				if (i + 1 < len && p[i + 1] == 0) {
+					n = span16(p + i, len - i);
+					if (n < lflag && (eof ||
+					    len - i - 2 * n >= 2)) {
+						i += 2 * n;
+						break;
+					}
+					begin(sc, sc->off + i, ENC_UTF16);
+					break;
+				}
+				n = span(p + i, len - i, 1);
+				if (n < lflag && i + n < len) {
+					/* A UTF-16LE one starts at its last
+					 * byte.
+					 */
+					if (p[i + n] == 0) {
+						i += n - 1;
+						break;
+					}
+					if (unit8(p + i + n, len - i - n,
+					    eof) == 0) {
+						i += n;
+						break;
+					}
+				}
+				begin(sc, sc->off + i, ENC_UTF8);
+			} else if ((c = unit8(p + i, len - i, eof)) == -1)
 				goto end;
-			if (feof(fp))
+			else if (c == 0)
+				i++;
+			else
+				begin(sc, sc->off + i, ENC_UTF8);
+			break;
+		case ENC_UTF8:
+			if ((c = unit8(p + i, len - i, eof)) == -1)
+				goto end;
+			if (c == 0) {
+				c = sc->last;
+				if (scanend(sc) == -1)
+					return (-1);
+				if (c == 0 || p[i] != 0 || (sc->stop != -1 &&
+				    sc->off + (off_t)i - 1 >= sc->stop))
+					break;
+				begin(sc, sc->off + i - 1, ENC_UTF16);
+				tmp[0] = c;
+				if (addchars(sc, tmp, 1, 1) == -1)
+					return (-1);
+				i++;
 				break;
-		}
-		if (i < buflen) {
-			buf[i] = c;
-		} else if (i == buflen) {
-			printf("%s: ", filename);
-			fwrite(buf, sizeof(*buf), buflen, stdout);
-			putchar(c);
-		} else {
-			putchar(c);
+			}
+			if (addchars(sc, p + i, c, 1) == -1)
+				return (-1);
+			sc->last = c == 1 ? p[i] : 0;
+			i += c;
+			if (c == 1 && (n = span(p + i, len - i, 1)) > 0) {
+				if (addchars(sc, p + i, n, n) == -1)
+					return (-1);
+				sc->last = p[i + n - 1];
+				i += n;
+			}
+			break;
+		case ENC_UTF16:
+			if (len - i == 1 && !eof && printable[p[i]])
+				goto end;
+			if ((n = span16(p + i, len - i)) == 0) {
+				if (scanend(sc) == -1)
+					return (-1);
+				break;
+			}
+			for (; n > 0; n -= j) {
+				for (j = 0; j < n && j < sizeof(tmp); j++)
+					tmp[j] = p[i + 2 * j];
+				if (addchars(sc, tmp, j, j) == -1)
+					return (-1);
+				i += 2 * j;
+			}
+			break;
 		}
 	}
-	ret = 0;
 end:
-	if (i >= buflen)
-		putchar('\n');
-	return (ret);
+	sc->off += i;
+	*used = i;
+	return (0);
 }
+
+/* scanend: end the string being printed at the end of sc's file
+ * Returns -1 on write error.
+ */
+static int
+scanend(struct scanner *sc)
+{
+	sc->kind = ENC_NONE;
+	sc->npend = 0;
+	if (!sc->inrun)
+		return (0);
+	sc->inrun = 0;
+	return (outbuf_add(sc->out, "\n", 1));
+}
+
+/* startrun: start printing a string, with its offset for -t and the bytes
+ * pending in sc
+ * Returns -1 on write error.
+ */
+static int
+startrun(struct scanner *sc)
+{
+	char num[32];
+	int n = 0;
+
+	if (tflag != NULL)
+		n = snprintf(num, sizeof(num), tflag, (intmax_t)sc->start);
+	if (outbuf_add(sc->out, sc->filename, strlen(sc->filename)) == -1 ||
+	    outbuf_add(sc->out, ": ", 2) == -1 ||
+	    outbuf_add(sc->out, num, n) == -1 ||
+	    outbuf_add(sc->out, sc->pend, sc->npend) == -1)
+		return (-1);
+	sc->npend = 0;
+	sc->inrun = 1;
+	return (0);
+}
+
+/* span: return the number of bytes at the start of the len at p that are
+ * printable if print is true, or unprintable if it isn't
+ */
+static size_t
+span(const unsigned char *p, size_t len, int print)
+{
+	size_t i = 0;
+#if defined(VECLEN)
+	uint32_t m, all = (uint32_t)((UINT64_C(1) << VECLEN) - 1);
+
+	for (; len - i >= VECLEN; i += VECLEN) {
+		m = VECPRINT(VECLOAD(p + i));
+		if (!print)
+			m = ~m & all;
+		if (m != all)
+			return (i + ctz(~m));
+	}
+#endif
+	while (i < len && printable[p[i]] == print)
+		i++;
+	return (i);
+}
+
+/* span16: return the number of UTF-16LE characters of printable ASCII at the
+ * start of the len bytes at p
+ */
+static size_t
+span16(const unsigned char *p, size_t len)
+{
+	size_t i = 0;
+#if defined(VECLEN)
+	uint32_t m, even = (uint32_t)(UINT64_C(0x5555555555555555) &
+	    ((UINT64_C(1) << VECLEN) - 1));
+	vec v;
+
+	/* The even bytes are printable and the odd ones NUL. */
+	for (; len - i >= VECLEN; i += VECLEN) {
+		v = VECLOAD(p + i);
+		m = VECPRINT(v) & VECZERO(v) >> 1 & even;
+		if (m != even)
+			return ((i + ctz(~m & even)) / 2);
+	}
+#endif
+	while (len - i >= 2 && printable[p[i]] && p[i + 1] == 0)
+		i += 2;
+	return (i / 2);
+}
+
+/* skipu: return the number of bytes at the start of the len at p that can't
+ * start a character for -u: not printable, and not UTF-8 lead bytes
+ * Lead bytes that aren't followed by a continuation byte are skipped too, but
+ * the last of a vector is left to unit8.
+ */
+static size_t
+skipu(const unsigned char *p, size_t len)
+{
+	size_t i = 0;
+#if defined(VECLEN)
+	uint32_t m, top = (uint32_t)1 << (VECLEN - 1);
+	vec v;
+
+	for (; len - i >= VECLEN; i += VECLEN) {
+		v = VECLOAD(p + i);
+		m = VECPRINT(v) | (VECLEAD(v) & (VECCONT(v) >> 1 | top));
+		if (m != 0)
+			return (i + ctz(m));
+	}
+#endif
+	while (i < len && !printable[p[i]] && (p[i] < 0xc2 || p[i] > 0xf4))
+		i++;
+	return (i);
+}
+
+/* unit8: return the length of the character for -u at the start of the len
+ * bytes at p, which isn't UTF-16LE: 1 for a printable ASCII byte, that of a
+ * valid UTF-8 sequence of a code point from U+00A0 on, or 0 if it's neither
+ * Returns -1 if the sequence may go on past len, unless eof is true.
+ */
+static int
+unit8(const unsigned char *p, size_t len, int eof)
+{
+	unsigned char lo = 0x80, hi = 0xbf;
+	size_t i, n;
+
+	if (printable[p[0]])
+		return (1);
+	if (p[0] < 0xc2 || p[0] > 0xf4)
+		return (0);
+	/* No C1 controls, overlong forms, surrogates, or past U+10FFFF. */
+	if (p[0] < 0xe0) {
+		n = 2;
+		if (p[0] == 0xc2)
+			lo = 0xa0;
+	} else if (p[0] < 0xf0) {
+		n = 3;
+		if (p[0] == 0xe0)
+			lo = 0xa0;
+		else if (p[0] == 0xed)
+			hi = 0x9f;
+	} else {
+		n = 4;
+		if (p[0] == 0xf0)
+			lo = 0x90;
+		else if (p[0] == 0xf4)
+			hi = 0x8f;
+	}
+	for (i = 1; i < n; i++) {
+		if (i == len)
+			return (eof ? 0 : -1);
+		if (p[i] < lo || p[i] > hi)
+			return (0);
+		lo = 0x80;
+		hi = 0xbf;
+	}
+	return (n);
+}
+
+/* begin: start a string of kind at the file offset start in sc, for -u */
+static void
+begin(struct scanner *sc, off_t start, int kind)
+{
+	sc->kind = kind;
+	sc->start = start;
+	sc->nchar = 0;
+	sc->npend = 0;
+	sc->last = 0;
+}
+
+/* addchars: add nchar characters, the len bytes at p, to sc's string for -u
+ * Strings that start before sc->from are only counted.
+ *
+ * Returns -1 on write error.
+ */
+static int
+addchars(struct scanner *sc, const unsigned char *p, size_t len, size_t nchar)
+{
+	sc->nchar += nchar;
+	if (!sc->inrun) {
+		if (sc->start < sc->from)
+			return (0);
+		if (sc->nchar < lflag) {
+			memcpy(sc->pend + sc->npend, p, len);
+			sc->npend += len;
+			return (0);
+		}
+		if (startrun(sc) == -1)
+			return (-1);
+	}
+	return (outbuf_add(sc->out, p, len));
+}
+
+#if defined(VECLEN)
+/* ctz: return the index of the lowest set bit of x, x can't be 0 */
+static int
+ctz(uint32_t x)
+{
+#if defined(__GNUC__)
+	return (__builtin_ctz(x));
+#else
+	int n;
+
+	for (n = 0; !(x & 1); n++)
+		x >>= 1;
+	return (n);
+#endif
+}
+#endif
@@ -1,6 +1,8 @@
 #include <ctype.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <limits.h>
 
@@ -8,14 +10,48 @@
 static int fflag;
 /* Don't print non-printable and non-space characters if true. */
 static int dflag;
+/* Decode what vis printed, without -d and -f, back to its bytes if true. */
+static int uflag;
 
 #define TABWIDTH 8
+/* Bytes read at once. */
+#define VISBUFSIZE (1 << 16)
+/* Most bytes printed for a byte: an escape, and a newline before it. */
+#define VISMAX 5
 
+/* How a byte is printed, and how many columns it takes toward fflag. */
+struct visent {
+	char		s[4];
+	unsigned char	len;
+	unsigned char	width;
+};
+
+/* Where unvis is in an escape, between the reads it's split across. */
+enum {
+	UNVIS_TEXT,	/* not in an escape */
+	UNVIS_BS,	/* after the backslash */
+	UNVIS_X,	/* after the X */
+	UNVIS_HEX	/* after the first hex nibble */
+};
+
+struct unvisstate {
+	int		state;
+	/* The first hex nibble, in UNVIS_HEX. */
+	unsigned char	hi;
+};
+
+/* What every byte is printed as, after the flags are set. */
+static struct visent vistab[UCHAR_MAX + 1];
+/* The value of every byte as a hex nibble, or -1. */
+static signed char hexval[UCHAR_MAX + 1];
+
+static void	mkvistab(void);
 static int	cook_args(int, const char *[]);
 static int	vis(FILE *, void *, size_t);
-static int	visbuf(FILE *, void *, size_t);
-static void	tohex(char[], unsigned char);
-static int	fflagnl(FILE *, size_t *, size_t);
+static int	visbuf(FILE *, char *, const void *, size_t, size_t *);
+static int	unvis(FILE *, void *, size_t);
+static int	unvisbuf(FILE *, char *, const void *, size_t,
+		    struct unvisstate *);
 
 /* vis: print files presented as arguments, escaping them */
 int
@@ -23,7 +59,7 @@ main(int argc, char *argv[])
 {
 	int c;
 	const char *err;
-	while ((c = getopt(argc, argv, "df:")) != -1) {
+	while ((c = getopt(argc, argv, "df:u")) != -1) {
 		switch(c) {
 		case 'd':
 			dflag = 1;
@@ -33,6 +69,9 @@ main(int argc, char *argv[])
 			if (err)
 				printf("fold length is %s\n", err);
 			break;
+		case 'u':
+			uflag = 1;
+			break;
 		default:
 			abort();
 			break;
@@ -41,12 +80,47 @@ main(int argc, char *argv[])
 	argv += optind;
 	argc -= optind;
 
+	mkvistab();
 	if (cook_args(argc, (const char **)argv) == -1)
 		return (EXIT_FAILURE);
 	fflush(stdout);
 	return (EXIT_SUCCESS);
 }
 
+/* mkvistab: make vistab, from isprint and isspace, dflag and TABWIDTH, and
+ * hexval
+ * Printable and space bytes are printed as is, the others as {'\\', 'X', h, h}
+ * where h are hex nibbles, or not at all if dflag is true. A backslash is
+ * escaped too unless dflag is true, so that unvis can tell escapes from text.
+ */
+static void
+mkvistab(void)
+{
+	const char hex[] = "0123456789abcdef";
+	struct visent *e;
+	int c;
+
+	for (c = 0; c <= UCHAR_MAX; c++) {
+		hexval[c] = -1;
+		e = &vistab[c];
+		if ((isprint(c) || isspace(c)) && (c != '\\' || dflag)) {
+			e->s[0] = c;
+			e->len = 1;
+			e->width = c == '\t' ? TABWIDTH : 1;
+		} else if (!dflag) {
+			e->s[0] = '\\';
+			e->s[1] = 'X';
+			e->s[2] = hex[c >> 4];
+			e->s[3] = hex[c & 0xf];
+			e->len = e->width = 4;
+		} else {
+			e->len = e->width = 0;
+		}
+	}
+	for (c = 0; c < 16; c++)
+		hexval[(unsigned char)hex[c]] = hexval[toupper(hex[c])] = c;
+}
+
 /* cook_args: do the bulk of this program's work
  * argc is the count of files to proccess.
  * argv is an array of filenames to proccess.
@@ -57,7 +131,7 @@ static int
 cook_args(int argc, const char *argv[])
 {
 	void *buf;
-	const size_t buflen = BUFSIZ;
+	const size_t buflen = VISBUFSIZE;
 	int i;
 	FILE *fp;
 	int ret;
@@ -69,7 +143,10 @@ cook_args(int argc, const char *argv[])
 		if ((fp = fopen(argv[i], "rb")) == NULL) {
 			goto end;
 		} else {
-			ret = vis(fp, buf, buflen);
+			if (uflag)
+				ret = unvis(fp, buf, buflen);
+			else
+				ret = vis(fp, buf, buflen);
 			fclose(fp);
 			if (ret == -1)
 				goto end;
@@ -85,81 +162,188 @@ end:
  * fp must be open and at least on mode "rb"
  * buf is a buffer to read into and can be of any buflen except 0
  *
- * Returns -1 on FILE error.
+ * Returns -1 on FILE or malloc error.
  */
 static int
 vis(FILE *fp, void *buf, size_t buflen)
 {
-	size_t n;
+	char *obuf;
+	size_t n, written = 0;
+	int ret = -1;
 
+	if ((obuf = malloc(buflen * VISMAX)) == NULL)
+		return (-1);
 	for (;;) {
 		n = fread(buf, sizeof(char), buflen, fp);
 		if (n == 0) {
 			if (ferror(fp))
-				return (-1);
+				goto end;
 			if (feof(fp))
-				return (0);
+				break;
 		}
-		if (visbuf(stdout, buf, n) == -1)
-			return (-1);
+		if (visbuf(stdout, obuf, buf, n, &written) == -1)
+			goto end;
 	}
-
+	ret = 0;
+end:
+	free(obuf);
+	return (ret);
 }
 
 /* visbuf: vis n bytes from _buf into out
+ * The output is made in obuf, which must have room for VISMAX * n bytes, and
+ * written at once. written is the number of columns printed toward fflag
+ * since the last fold, kept between calls. A newline is printed before the
+ * byte that brings it to fflag, which then starts the count over.
  *
  * Returns -1 on error
  */
 static int
-visbuf(FILE *out, void *_buf, size_t n)
+visbuf(FILE *out, char *obuf, const void *_buf, size_t n, size_t *written)
 {
-	size_t i;
-	int clen;
-	size_t written;
-	unsigned char *buf = _buf;
-	/* {'\\', 'X', h, h} where h are hex nibbles */
-	char hex[4] = {'\\', 'X'};
-	char *hnp = &hex[2]; /* pointer to where the hex nibbles in hex are */
-
-	for (written = i = 0; i < n; i++) {
-		if (isprint(buf[i]) || isspace(buf[i])) {
-			clen = buf[i] == '\t' ? TABWIDTH : 1;
-			if (fflagnl(out, &written, clen) == -1)
-				return (-1);
-			if (putc(buf[i], out) == EOF)
-				return (-1);
-		} else if (!dflag) {
-			tohex(hnp, buf[i]);
-			if (fflagnl(out, &written, sizeof(hex)) == -1)
-				return (-1);
-			if (fwrite(hex, sizeof(*hex), sizeof(hex), out) !=
-			    sizeof(hex))
-				return (-1);
+	const unsigned char *buf = _buf;
+	const struct visent *e;
+	char *p = obuf;
+	size_t i, j, k;
+
+	for (i = 0; i < n; ) {
+		/* Runs of bytes printed as is, a column each, are copied
+		 * whole, with a fold every fflag of them.
+		 */
+		for (j = i; j < n && vistab[buf[j]].width == 1; j++)
+			;
+		while (fflag && j - i >= fflag - *written) {
+			k = fflag - *written;
+			memcpy(p, buf + i, k - 1);
+			p += k - 1;
+			*p++ = '\n';
+			*p++ = buf[i + k - 1];
+			i += k;
+			*written = 0;
 		}
+		memcpy(p, buf + i, j - i);
+		p += j - i;
+		if (fflag)
+			*written += j - i;
+		if ((i = j) == n)
+			break;
+		e = &vistab[buf[i++]];
+		if (fflag && e->width > 0 &&
+		    (*written += e->width) >= (size_t)fflag) {
+			*written = 0;
+			*p++ = '\n';
+		}
+		memcpy(p, e->s, e->len);
+		p += e->len;
 	}
+	if (fwrite(obuf, sizeof(*obuf), p - obuf, out) != (size_t)(p - obuf))
+		return (-1);
 	return (0);
 }
 
-/* tohex: makes byte into exactly 2 hexadeximal characters in arr */
-static void
-tohex(char arr[], unsigned char byte)
+/* unvis: unvis fp to stdout
+ * fp must be open and at least on mode "rb"
+ * buf is a buffer to read into and can be of any buflen except 0
+ *
+ * Returns -1 on FILE or malloc error, or with errno set to EINVAL if fp isn't
+ * what vis prints.
+ */
+static int
+unvis(FILE *fp, void *buf, size_t buflen)
 {
-	sprintf(arr, "%.2x", (unsigned int)byte);
+	struct unvisstate u = {UNVIS_TEXT, 0};
+	char *obuf;
+	size_t n;
+	int ret = -1;
+
+	if ((obuf = malloc(buflen)) == NULL)
+		return (-1);
+	for (;;) {
+		n = fread(buf, sizeof(char), buflen, fp);
+		if (n == 0) {
+			if (ferror(fp))
+				goto end;
+			if (feof(fp))
+				break;
+		}
+		if (unvisbuf(stdout, obuf, buf, n, &u) == -1)
+			goto end;
+	}
+	/* The file can't end in an escape. */
+	if (u.state != UNVIS_TEXT) {
+		errno = EINVAL;
+		goto end;
+	}
+	ret = 0;
+end:
+	free(obuf);
+	return (ret);
 }
 
-/* fflagnl: print the newline when fflag requires it
- * Returns -1 on error
+/* unvisbuf: unvis n bytes from _buf into out
+ * The output is made in obuf, which must have room for n bytes, and written
+ * at once. Text up to the next backslash is copied whole, and escapes are
+ * decoded at once unless they're split from the next call, with u keeping
+ * where they are between calls. Hex nibbles can be either case.
+ *
+ * Returns -1 on error, with errno set to EINVAL on a bad escape, after what
+ * comes before it is written.
  */
 static int
-fflagnl(FILE *out, size_t *written, size_t add)
+unvisbuf(FILE *out, char *obuf, const void *_buf, size_t n,
+    struct unvisstate *u)
 {
-	if (fflag) {
-		*written += add;
-		if (*written >= fflag) {
-			*written = 0;
-			if (putc('\n', out) == EOF)
-				return (-1);
+	const unsigned char *buf = _buf, *q;
+	char *p = obuf;
+	size_t i = 0;
+	int hi, lo, ret = -1;
+
+	while (i < n) {
+		switch (u->state) {
+		case UNVIS_TEXT:
+			if ((q = memchr(buf + i, '\\', n - i)) == NULL)
+				q = buf + n;
+			memcpy(p, buf + i, q - (buf + i));
+			p += q - (buf + i);
+			if ((i = q - buf) == n)
+				break;
+			if (n - i < 4) {
+				u->state = UNVIS_BS;
+				i++;
+				break;
+			}
+			if (buf[i + 1] != 'X' ||
+			    (hi = hexval[buf[i + 2]]) == -1 ||
+			    (lo = hexval[buf[i + 3]]) == -1)
+				goto inval;
+			*p++ = hi << 4 | lo;
+			i += 4;
+			break;
+		case UNVIS_BS:
+			if (buf[i++] != 'X')
+				goto inval;
+			u->state = UNVIS_X;
+			break;
+		case UNVIS_X:
+			if ((hi = hexval[buf[i++]]) == -1)
+				goto inval;
+			u->hi = hi;
+			u->state = UNVIS_HEX;
+			break;
+		case UNVIS_HEX:
+			if ((lo = hexval[buf[i++]]) == -1)
+				goto inval;
+			*p++ = u->hi << 4 | lo;
+			u->state = UNVIS_TEXT;
+			break;
 		}
 	}
-	return (0);
+	ret = 0;
+	goto end;
+inval:
+	errno = EINVAL;
+end:
+	if (fwrite(obuf, sizeof(*obuf), p - obuf, out) != (size_t)(p - obuf))
+		return (-1);
+	return (ret);
 }
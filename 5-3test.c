@@ -0,0 +1,325 @@
+/* Fuzz visbuf against unvisbuf, and time them, with 5-3.c's own static
+ * functions: it's included with its main renamed.
+ * Build with cc -D_POSIX_C_SOURCE=200809L -o 5-3test 5-3test.c, run without
+ * arguments to fuzz and with -b to time.
+ */
+#include <stdint.h>
+#include <time.h>
+
+#define main vismain
+#include "5-3.c"
+#undef main
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+enum {
+	/* most bytes of a fuzzed input */
+	FUZZMAX = 4096,
+	/* bytes of each input timed by bench */
+	BENCHSIZE = 1 << 26
+};
+
+/* The kinds of input bench times. */
+enum {
+	BENCH_TEXT,
+	BENCH_BINARY,
+	BENCH_COUNT
+};
+
+static uint64_t rndstate = 1;
+
+static int	fuzz(unsigned long);
+static int	fuzzone(unsigned long);
+static int	bench(void);
+static int	encode(const unsigned char *, size_t, size_t, char **,
+		    size_t *);
+static int	decode(const char *, size_t, size_t, char **, size_t *);
+static size_t	mkinput(unsigned char *, size_t, int);
+static size_t	piece(size_t);
+static uint64_t	rnd(void);
+
+int
+main(int argc, char *argv[])
+{
+	unsigned long niter = 10000;
+	int bflag = 0;
+	int c, ret;
+	const char *err;
+
+	while ((c = getopt(argc, argv, "bn:s:")) != -1) {
+		switch (c) {
+		case 'b':
+			bflag = 1;
+			break;
+		case 'n':
+			niter = strtonum(optarg, 1, LONG_MAX, &err);
+			if (err != NULL)
+				goto usage;
+			break;
+		case 's':
+			rndstate = strtonum(optarg, 1, LLONG_MAX, &err);
+			if (err != NULL)
+				goto usage;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc)
+		goto usage;
+	mkvistab();
+	if ((ret = bflag ? bench() : fuzz(niter)) != 0) {
+		if (ret == -1)
+			perror("5-3test");
+		return (EXIT_FAILURE);
+	}
+	return (EXIT_SUCCESS);
+usage:
+	fprintf(stderr, "usage: 5-3test [-b] [-n iterations] [-s seed]\n");
+	return (EXIT_FAILURE);
+}
+
+/* fuzz: check niter random inputs with fuzzone, print the failures
+ * Returns -1 on error, 1 if any input failed, or 0.
+ */
+static int
+fuzz(unsigned long niter)
+{
+	unsigned long i;
+	int nfail = 0, ret;
+
+	for (i = 0; i < niter; i++) {
+		if ((ret = fuzzone(i)) == -1)
+			return (-1);
+		nfail += ret;
+	}
+	printf("%d of %lu failed\n", nfail, niter);
+	return (nfail > 0);
+}
+
+/* fuzzone: check that a random input comes back from unvisbuf as visbuf
+ * printed it, that folds don't depend on how visbuf is called, and that
+ * unvisbuf finds the same in a damaged copy however it's read
+ * Returns -1 on error, 1 on failure, or 0.
+ */
+static int
+fuzzone(unsigned long iter)
+{
+	unsigned char in[FUZZMAX];
+	char *enc = NULL, *fold1 = NULL, *fold2 = NULL, *dec = NULL;
+	char *bad1 = NULL, *bad2 = NULL;
+	size_t n, nenc, nfold1, nfold2, ndec, nbad1, nbad2, i;
+	int err1, err2, ret = -1;
+
+	n = mkinput(in, rnd() % (FUZZMAX + 1), rnd() % BENCH_COUNT);
+	fflag = 0;
+	if (encode(in, n, n, &enc, &nenc) == -1 ||
+	    decode(enc, nenc, piece(nenc), &dec, &ndec) == -1)
+		goto end;
+	if (ndec != n || memcmp(dec, in, n) != 0) {
+		printf("%lu: round trip of %zu bytes differs\n", iter, n);
+		ret = 1;
+		goto end;
+	}
+
+	fflag = 1 + rnd() % 100;
+	if (encode(in, n, n, &fold1, &nfold1) == -1 ||
+	    encode(in, n, piece(n), &fold2, &nfold2) == -1)
+		goto end;
+	fflag = 0;
+	if (nfold1 != nfold2 || memcmp(fold1, fold2, nfold1) != 0) {
+		printf("%lu: folds differ by read size\n", iter);
+		ret = 1;
+		goto end;
+	}
+
+	/* Damage: bytes replaced with some an escape might have. */
+	for (i = rnd() % 4; i > 0 && nenc > 0; i--)
+		enc[rnd() % nenc] = "\\X0aF"[rnd() % 5];
+	err1 = decode(enc, nenc, nenc, &bad1, &nbad1);
+	if (err1 == -1 && errno != EINVAL)
+		goto end;
+	err2 = decode(enc, nenc, piece(nenc), &bad2, &nbad2);
+	if (err2 == -1 && errno != EINVAL)
+		goto end;
+	if (err1 != err2 || nbad1 != nbad2 ||
+	    memcmp(bad1, bad2, nbad1) != 0) {
+		printf("%lu: damaged input decodes by read size\n", iter);
+		ret = 1;
+		goto end;
+	}
+	ret = 0;
+end:
+	free(enc);
+	free(fold1);
+	free(fold2);
+	free(dec);
+	free(bad1);
+	free(bad2);
+	return (ret);
+}
+
+/* bench: time visbuf and unvisbuf on BENCHSIZE bytes of text and of binary,
+ * read VISBUFSIZE bytes at a time
+ * Returns -1 on error.
+ */
+static int
+bench(void)
+{
+	const char *kind[BENCH_COUNT] = {"text", "binary"};
+	struct timespec t[3];
+	struct unvisstate u;
+	FILE *null;
+	unsigned char *in = NULL;
+	char *obuf = NULL, *enc = NULL;
+	size_t n, nenc, i, written;
+	int k, ret = -1;
+
+	if ((null = fopen("/dev/null", "w")) == NULL)
+		return (-1);
+	if ((in = malloc(BENCHSIZE)) == NULL ||
+	    (obuf = malloc(VISBUFSIZE * VISMAX)) == NULL)
+		goto end;
+	for (k = 0; k < BENCH_COUNT; k++) {
+		n = mkinput(in, BENCHSIZE, k);
+		free(enc);
+		if (encode(in, n, n, &enc, &nenc) == -1)
+			goto end;
+		if (clock_gettime(CLOCK_MONOTONIC, &t[0]) == -1)
+			goto end;
+		for (written = i = 0; i < n; i += VISBUFSIZE)
+			if (visbuf(null, obuf, in + i,
+			    MIN(VISBUFSIZE, n - i), &written) == -1)
+				goto end;
+		if (clock_gettime(CLOCK_MONOTONIC, &t[1]) == -1)
+			goto end;
+		u.state = UNVIS_TEXT;
+		for (i = 0; i < nenc; i += VISBUFSIZE)
+			if (unvisbuf(null, obuf, enc + i,
+			    MIN(VISBUFSIZE, nenc - i), &u) == -1)
+				goto end;
+		if (clock_gettime(CLOCK_MONOTONIC, &t[2]) == -1)
+			goto end;
+		printf("%s: vis %.0f MB/s, unvis %.0f MB/s, of %zu bytes\n",
+		    kind[k], n / 1e6 / ((t[1].tv_sec - t[0].tv_sec) +
+		    (t[1].tv_nsec - t[0].tv_nsec) / 1e9),
+		    n / 1e6 / ((t[2].tv_sec - t[1].tv_sec) +
+		    (t[2].tv_nsec - t[1].tv_nsec) / 1e9), n);
+	}
+	ret = 0;
+end:
+	fclose(null);
+	free(in);
+	free(obuf);
+	free(enc);
+	return (ret);
+}
+
+/* encode: set *out and *outlen to what visbuf prints for the n bytes at in,
+ * given to it blk bytes at a time, *out must be freed
+ * Returns -1 on error.
+ */
+static int
+encode(const unsigned char *in, size_t n, size_t blk, char **out,
+    size_t *outlen)
+{
+	FILE *fp;
+	char *obuf;
+	size_t i, written = 0;
+	int ret = -1;
+
+	*out = NULL;
+	if ((fp = open_memstream(out, outlen)) == NULL)
+		return (-1);
+	if ((obuf = malloc(blk * VISMAX + 1)) == NULL)
+		goto end;
+	for (i = 0; i < n; i += blk)
+		if (visbuf(fp, obuf, in + i, MIN(blk, n - i),
+		    &written) == -1)
+			goto end;
+	ret = 0;
+end:
+	free(obuf);
+	if (fclose(fp) == EOF)
+		ret = -1;
+	return (ret);
+}
+
+/* decode: set *out and *outlen to what unvisbuf prints for the n bytes at in,
+ * given to it blk bytes at a time, *out must be freed
+ * Returns -1 on error, with errno set to EINVAL if in isn't what vis prints.
+ */
+static int
+decode(const char *in, size_t n, size_t blk, char **out, size_t *outlen)
+{
+	struct unvisstate u = {UNVIS_TEXT, 0};
+	FILE *fp;
+	char *obuf;
+	size_t i;
+	int ret = -1, saved;
+
+	*out = NULL;
+	if ((fp = open_memstream(out, outlen)) == NULL)
+		return (-1);
+	if ((obuf = malloc(blk + 1)) == NULL)
+		goto end;
+	for (i = 0; i < n; i += blk)
+		if (unvisbuf(fp, obuf, in + i, MIN(blk, n - i), &u) == -1)
+			goto end;
+	if (u.state != UNVIS_TEXT) {
+		errno = EINVAL;
+		goto end;
+	}
+	ret = 0;
+end:
+	saved = errno;
+	free(obuf);
+	if (fclose(fp) == EOF)
+		return (-1);
+	errno = saved;
+	return (ret);
+}
+
+/* mkinput: fill in with n random bytes of kind, return n
+ * Text is printable bytes, spaces and backslashes, with the odd other byte.
+ * Binary is any byte, a quarter of them those of escapes, which have to round
+ * trip too.
+ */
+static size_t
+mkinput(unsigned char *in, size_t n, int kind)
+{
+	const char text[] = "abcdefghij XYZ0123456789\\\t\n.,";
+	const char esc[] = "\\Xx0aF";
+	size_t i, j, len;
+
+	for (i = 0; i < n; i += len) {
+		len = 1 + rnd() % 32;
+		len = MIN(n - i, len);
+		for (j = 0; j < len; j++) {
+			if (kind == BENCH_TEXT && rnd() % 64 != 0)
+				in[i + j] = text[rnd() % (sizeof(text) - 1)];
+			else if (rnd() % 4 == 0)
+				in[i + j] = esc[rnd() % (sizeof(esc) - 1)];
+			else
+				in[i + j] = rnd();
+		}
+	}
+	return (n);
+}
+
+/* piece: return a random block size to split n bytes by, at least 1 */
+static size_t
+piece(size_t n)
+{
+	return (1 + rnd() % (rnd() % 2 == 0 ? 8 : n + 1));
+}
+
+/* rnd: return the next number of a xorshift generator */
+static uint64_t
+rnd(void)
+{
+	rndstate ^= rndstate << 13;
+	rndstate ^= rndstate >> 7;
+	rndstate ^= rndstate << 17;
+	return (rndstate);
+}
@@ -1,11 +1,19 @@
 #include <sys/param.h>
 #include <sys/stat.h>
 
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include "misc.h"
 
+/* IOV_MAX is XSI, and can't be less than 16. */
+#if !defined(IOV_MAX)
+#define IOV_MAX 16
+#endif
+
 /* nwrite: reentrant nwrite, return value != nbytes on error. */
 ssize_t
 nwrite(int fd, const void *_buf, size_t nbytes)
@@ -22,6 +30,30 @@ nwrite(int fd, const void *_buf, size_t nbytes)
 	return (off);
 }
 
+/* nwritev: reentrant writev of any number of iovecs, which are modified
+ * Return value != the sum of the lengths on error.
+ */
+ssize_t
+nwritev(int fd, struct iovec *iov, int iovcnt)
+{
+	size_t off;
+	ssize_t nw, n;
+
+	for (off = 0; iovcnt > 0; off += nw) {
+		nw = writev(fd, iov, MIN(iovcnt, IOV_MAX));
+		if (nw == 0 || nw == -1)
+			break;
+		/* Skip what was written, which can end inside of an iovec. */
+		for (n = nw; iovcnt > 0 && (size_t)n >= iov->iov_len; iovcnt--)
+			n -= (iov++)->iov_len;
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return (off);
+}
+
 /* getfdblksize: get optimal i/o size for fd */
 size_t
 getfdblksize(int fd)
@@ -32,3 +64,70 @@ getfdblksize(int fd)
 		return (BUFSIZ);
 	return (sb.st_blksize);
 }
+
+/* outbuf_init: set up ob to write to fd, with a buffer of size bytes
+ *
+ * Returns -1 on malloc error.
+ */
+int
+outbuf_init(struct outbuf *ob, int fd, size_t size)
+{
+	ob->len = 0;
+	ob->size = size;
+	ob->fd = fd;
+	if ((ob->buf = malloc(ob->size)) == NULL)
+		return (-1);
+	return (0);
+}
+
+/* outbuf_add: append the len bytes at p to ob
+ * Writes ob out first if they don't fit, or grows it if ob->fd is -1. Bytes
+ * that are more than the buffer holds are written directly.
+ *
+ * Returns -1 on error.
+ */
+int
+outbuf_add(struct outbuf *ob, const void *p, size_t len)
+{
+	char *tp;
+	size_t size;
+
+	if (ob->len + len > ob->size && ob->fd == -1) {
+		for (size = ob->size * 2; ob->len + len > size; size *= 2)
+			;
+		if ((tp = realloc(ob->buf, size)) == NULL)
+			return (-1);
+		ob->buf = tp;
+		ob->size = size;
+	} else if (ob->len + len > ob->size) {
+		if (outbuf_flush(ob) == -1)
+			return (-1);
+		if (len > ob->size)
+			return (nwrite(ob->fd, p, len) != (ssize_t)len ?
+			    -1 : 0);
+	}
+	memcpy(ob->buf + ob->len, p, len);
+	ob->len += len;
+	return (0);
+}
+
+/* outbuf_flush: write out what's in ob, ob->fd must not be -1
+ *
+ * Returns -1 on error.
+ */
+int
+outbuf_flush(struct outbuf *ob)
+{
+	if (nwrite(ob->fd, ob->buf, ob->len) != (ssize_t)ob->len)
+		return (-1);
+	ob->len = 0;
+	return (0);
+}
+
+/* outbuf_free: free ob's resources, doesn't free ob */
+void
+outbuf_free(struct outbuf *ob)
+{
+	free(ob->buf);
+	ob->buf = NULL;
+}
@@ -2,8 +2,25 @@
 #define H_MISC
 
 #include <sys/types.h>
+#include <sys/uio.h>
+
+/* Bytes are appended to buf and written out to fd once it's full, or buf grows
+ * if fd is -1. */
+struct outbuf {
+	char		*buf;
+	/* Number of bytes in buf. */
+	size_t		len;
+	/* Size of buf. */
+	size_t		size;
+	int		fd;
+};
 
 ssize_t nwrite(int, const void *, size_t);
+ssize_t nwritev(int, struct iovec *, int);
 size_t getfdblksize(int);
+int outbuf_init(struct outbuf *, int, size_t);
+int outbuf_add(struct outbuf *, const void *, size_t);
+int outbuf_flush(struct outbuf *);
+void outbuf_free(struct outbuf *);
 
 #endif